@@ -0,0 +1,61 @@
+// amount.h
+
+#ifndef AMOUNT_H
+#define AMOUNT_H
+
+#include <stdint.h>
+
+/* Output values are mostly round numbers of satoshis, so they are stored with their trailing
+ * decimal zeros taken out, the same way Bitcoin Core compresses amounts in its UTXO set:
+ * a value n * 10^e, where n doesn't end in 0 (or e = 9), becomes
+ *   0                              if the value is 0
+ *   1 + 10 * (9 * (n / 10) + (n % 10) - 1) + e   if e < 9
+ *   1 + 10 * (n - 1) + 9                         if e = 9
+ * For example, 50 BTC (5 * 10^9 satoshis) becomes 50. This only works for values up to
+ * MAX_MONEY; the result of anything bigger could overflow. */
+static const uint64_t MAX_MONEY = 21000000ULL * 100000000ULL;
+
+uint64_t compressAmount(uint64_t n);
+uint64_t decompressAmount(uint64_t x);
+
+uint64_t compressAmount(uint64_t n)
+{
+  if (n == 0)
+    return 0;
+  int e = 0;
+  while (n % 10 == 0 && e < 9)
+  {
+    n /= 10;
+    e++;
+  }
+  if (e < 9)
+  {
+    int d = n % 10;
+    n /= 10;
+    return 1 + (n * 9 + d - 1) * 10 + e;
+  }
+  return 1 + (n - 1) * 10 + 9;
+}
+
+uint64_t decompressAmount(uint64_t x)
+{
+  if (x == 0)
+    return 0;
+  x--;
+  int e = x % 10;
+  x /= 10;
+  uint64_t n;
+  if (e < 9)
+  {
+    int d = x % 9 + 1;
+    x /= 9;
+    n = x * 10 + d;
+  }
+  else
+    n = x + 1;
+  for (; e > 0; e--)
+    n *= 10;
+  return n;
+}
+
+#endif
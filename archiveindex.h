@@ -0,0 +1,371 @@
+// archiveindex.h
+
+#ifndef ARCHIVEINDEX_H
+#define ARCHIVEINDEX_H
+
+#include "block.h"
+#include "blockheader.h"
+#include "bytewriter.h"
+#include "externalsort.h"
+#include "mappedfile.h"
+#include "txhashlocation.h"
+
+#include <algorithm>
+#include <array>
+#include <iostream>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+/* An optional footer after the last block of an archive, for getting single blocks out of it
+ * without decompressing everything before them. It contains:
+ *   u32 nBlocks, u32 nHeights, u64 nTransactions, u64 nExternalHashes
+ *   u64 offset of each block, in archive order
+ *   u64 number of each block's first transaction (counting every transaction in archive order)
+ *   (hash[32], u32 version, u32 time, u32 bits) of each block, in archive order, which is what
+ *       the header of the block after it is coded against (see HeaderContext)
+ *   u32 the block at each height of the longest chain in the archive. The first block of the
+ *       archive's chain has height 0, which is the genesis block if the archive starts there.
+ *   (hash[32], u32 block) for every block, sorted by hash
+ *   hash[32] the txid of every transaction, in archive order
+ *   hash[32] every external hash (see TxHashLocation), in order
+ * and ends with a u64 giving the offset of the footer, and the u32 INDEX_MAGIC.
+ * With the txids and external hashes at hand, a block's previous transaction hashes can be
+ * resolved without decompressing the blocks they refer to. Hashes are stored in the same byte
+ * order as in Block::hash. */
+
+static const uint32_t INDEX_MAGIC = 0x58444e49; // "INDX"
+
+// Collects what goes in the footer while an archive is written.
+struct ArchiveIndexBuilder
+{
+  ArchiveIndexBuilder() : txIds(0), externalHashes(0), nTransactions(0), nExternalHashes(0), bytesWritten(0) {}
+  ~ArchiveIndexBuilder();
+  ArchiveIndexBuilder(const ArchiveIndexBuilder &) = delete;
+  ArchiveIndexBuilder &operator= (const ArchiveIndexBuilder &) = delete;
+
+  bool open(const std::string &tempDirectory);
+  void addBlock(uint64_t offset, const HeaderContext &header, const uint8_t prevHash[32]);
+  bool addTransaction(const std::array<uint8_t, 32> &txId);
+  bool addExternalHash(const std::array<uint8_t, 32> &hash);
+  bool write(std::ostream &fout, uint64_t footerOffset);
+
+  struct BlockEntry
+  {
+    uint64_t offset, firstTx;
+    HeaderContext header;
+    std::array<uint8_t, 32> hash, prevHash;
+  };
+
+  std::vector<BlockEntry> blocks;
+  // The txids and external hashes go to temporary files, as there can be too many to keep around
+  FILE *txIds;
+  FILE *externalHashes;
+  uint64_t nTransactions;
+  uint64_t nExternalHashes;
+  uint64_t bytesWritten; // The size of the index, once it has been written
+};
+
+// Reads the footer of a mapped archive.
+struct ArchiveIndex
+{
+  bool open(const MappedFile &archive);
+  int64_t findHeight(uint64_t height) const;
+  int64_t findHash(const std::array<uint8_t, 32> &hash) const;
+  bool resolveTransactionHashes(uint32_t block, Block *parsed, const std::vector<TxHashLocation> &locations) const;
+  HeaderContext previousHeader(uint32_t block) const;
+
+  uint64_t readU64(const uint8_t *p) const { uint64_t n; memcpy(&n, p, sizeof(uint64_t)); return n; }
+  uint32_t readU32(const uint8_t *p) const { uint32_t n; memcpy(&n, p, sizeof(uint32_t)); return n; }
+  uint64_t blockOffset(uint32_t block) const { return readU64(offsets + 8 * block); }
+  uint64_t blockFirstTx(uint32_t block) const { return readU64(firstTxs + 8 * block); }
+
+  const MappedFile *archive;
+  uint32_t nBlocks, nHeights;
+  uint64_t nTransactions, nExternalHashes;
+  uint64_t footerOffset;
+  const uint8_t *offsets, *firstTxs, *headers, *heights, *hashes, *txIds, *externalHashes;
+};
+
+ArchiveIndexBuilder::~ArchiveIndexBuilder()
+{
+  if (txIds)
+    fclose(txIds);
+  if (externalHashes)
+    fclose(externalHashes);
+}
+
+bool ArchiveIndexBuilder::open(const std::string &tempDirectory)
+{
+  txIds = createTempFile(tempDirectory);
+  externalHashes = createTempFile(tempDirectory);
+  if (!txIds || !externalHashes)
+  {
+    std::cout << "Could not create temporary file in \'" << tempDirectory << "\'" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// Blocks must be added in archive order, each before its transactions.
+void ArchiveIndexBuilder::addBlock(uint64_t offset, const HeaderContext &header, const uint8_t prevHash[32])
+{
+  BlockEntry entry;
+  entry.offset = offset;
+  entry.firstTx = nTransactions;
+  entry.header = header;
+  memcpy(entry.hash.data(), header.hash, 32);
+  memcpy(entry.prevHash.data(), prevHash, 32);
+  blocks.push_back(entry);
+}
+
+bool ArchiveIndexBuilder::addTransaction(const std::array<uint8_t, 32> &txId)
+{
+  nTransactions++;
+  if (fwrite(txId.data(), 32, 1, txIds) != 1)
+  {
+    std::cout << "Could not write temporary file" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool ArchiveIndexBuilder::addExternalHash(const std::array<uint8_t, 32> &hash)
+{
+  nExternalHashes++;
+  if (fwrite(hash.data(), 32, 1, externalHashes) != 1)
+  {
+    std::cout << "Could not write temporary file" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool ArchiveIndexBuilder::write(std::ostream &fout, uint64_t footerOffset)
+{
+  uint32_t nBlocks = blocks.size();
+
+  // Sort the blocks by hash, so they can be looked up, and so each block's parent can be found.
+  std::vector<std::pair<std::array<uint8_t, 32>, uint32_t>> byHash(nBlocks);
+  for (uint32_t i = 0; i < nBlocks; i++)
+    byHash[i] = std::make_pair(blocks[i].hash, i);
+  std::sort(byHash.begin(), byHash.end());
+
+  std::vector<int64_t> parent(nBlocks, -1);
+  for (uint32_t i = 0; i < nBlocks; i++)
+  {
+    auto it = std::lower_bound(byHash.begin(), byHash.end(), std::make_pair(blocks[i].prevHash, (uint32_t)0));
+    if (it != byHash.end() && it->first == blocks[i].prevHash)
+      parent[i] = it->second;
+  }
+
+  // Blocks can come before their parents in an archive, so heights are worked out by walking up
+  // to the nearest block whose height is known, then back down.
+  std::vector<int64_t> height(nBlocks, -1);
+  std::vector<uint32_t> path;
+  for (uint32_t i = 0; i < nBlocks; i++)
+  {
+    int64_t b = i;
+    while (b >= 0 && height[b] < 0)
+    {
+      path.push_back(b);
+      b = parent[b];
+    }
+    int64_t h = b >= 0 ? height[b] : -1;
+    while (!path.empty())
+    {
+      height[path.back()] = ++h;
+      path.pop_back();
+    }
+  }
+
+  // The longest chain ends at the highest block. (On a tie, the one that comes first.)
+  int64_t tip = -1;
+  for (uint32_t i = 0; i < nBlocks; i++)
+    if (tip < 0 || height[i] > height[tip])
+      tip = i;
+  uint32_t nHeights = tip >= 0 ? height[tip] + 1 : 0;
+  std::vector<uint32_t> chain(nHeights);
+  for (int64_t b = tip; b >= 0; b = parent[b])
+    chain[height[b]] = b;
+
+  ByteWriter out;
+  out.put32(nBlocks);
+  out.put32(nHeights);
+  out.put64(nTransactions);
+  out.put64(nExternalHashes);
+  for (auto &entry : blocks)
+    out.put64(entry.offset);
+  for (auto &entry : blocks)
+    out.put64(entry.firstTx);
+  for (auto &entry : blocks)
+  {
+    out.append(entry.header.hash, 32);
+    out.put32(entry.header.version);
+    out.put32(entry.header.time);
+    out.put32(entry.header.bits);
+  }
+  for (uint32_t b : chain)
+    out.put32(b);
+  for (auto &entry : byHash)
+  {
+    out.append(entry.first.data(), 32);
+    out.put32(entry.second);
+  }
+  bytesWritten += out.size;
+  out.flushTo(fout);
+
+  // Copy the hashes over from the temporary files
+  const size_t CHUNK_SIZE = 1 << 20;
+  for (FILE *file : { txIds, externalHashes })
+  {
+    rewind(file);
+    size_t n;
+    while ((n = fread(out.reserve(CHUNK_SIZE), 1, CHUNK_SIZE, file)) > 0)
+    {
+      out.size += n;
+      bytesWritten += out.size;
+      out.flushTo(fout);
+    }
+    if (ferror(file))
+    {
+      std::cout << "Could not read temporary file" << std::endl;
+      return false;
+    }
+  }
+
+  out.put64(footerOffset);
+  out.put32(INDEX_MAGIC);
+  bytesWritten += out.size;
+  out.flushTo(fout);
+  return fout.good();
+}
+
+bool ArchiveIndex::open(const MappedFile &archive)
+{
+  this->archive = &archive;
+
+  // The footer ends with its offset and the magic number
+  if (archive.size < 12 || readU32(archive.data + archive.size - 4) != INDEX_MAGIC)
+  {
+    std::cout << "Archive has no index. Compress with -i to add one." << std::endl;
+    return false;
+  }
+  footerOffset = readU64(archive.data + archive.size - 12);
+  if (footerOffset > archive.size - 12 || archive.size - 12 - footerOffset < 24)
+  {
+    std::cout << "Archive index is invalid" << std::endl;
+    return false;
+  }
+
+  const uint8_t *p = archive.data + footerOffset;
+  nBlocks = readU32(p);
+  nHeights = readU32(p + 4);
+  nTransactions = readU64(p + 8);
+  nExternalHashes = readU64(p + 16);
+  p += 24;
+
+  // Every part of the footer must fit exactly
+  uint64_t available = archive.size - 12 - footerOffset - 24;
+  uint64_t size = (uint64_t)nBlocks * (8 + 8 + 44 + 36) + (uint64_t)nHeights * 4 + (nTransactions + nExternalHashes) * 32;
+  if (nHeights > nBlocks || nTransactions > available / 32 || nExternalHashes > available / 32 || available != size)
+  {
+    std::cout << "Archive index is invalid" << std::endl;
+    return false;
+  }
+
+  offsets = p;
+  firstTxs = offsets + 8 * (uint64_t)nBlocks;
+  headers = firstTxs + 8 * (uint64_t)nBlocks;
+  heights = headers + 44 * (uint64_t)nBlocks;
+  hashes = heights + 4 * (uint64_t)nHeights;
+  txIds = hashes + 36 * (uint64_t)nBlocks;
+  externalHashes = txIds + 32 * nTransactions;
+  return true;
+}
+
+// Returns the block at the given height in the longest chain, or -1 if there isn't one.
+int64_t ArchiveIndex::findHeight(uint64_t height) const
+{
+  if (height >= nHeights)
+    return -1;
+  uint32_t block = readU32(heights + 4 * height);
+  return block < nBlocks ? block : -1;
+}
+
+// Returns the block with the given hash, or -1 if there isn't one.
+int64_t ArchiveIndex::findHash(const std::array<uint8_t, 32> &hash) const
+{
+  uint32_t lo = 0, hi = nBlocks;
+  while (lo < hi)
+  {
+    uint32_t mid = lo + (hi - lo) / 2;
+    int c = memcmp(hashes + 36 * (uint64_t)mid, hash.data(), 32);
+    if (c == 0)
+    {
+      uint32_t block = readU32(hashes + 36 * (uint64_t)mid + 32);
+      return block < nBlocks ? block : -1;
+    }
+    if (c < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return -1;
+}
+
+// What the header of the given block is coded against: the header of the block before it
+HeaderContext ArchiveIndex::previousHeader(uint32_t block) const
+{
+  HeaderContext header;
+  if (block > 0)
+  {
+    const uint8_t *p = headers + 44 * (uint64_t)(block - 1);
+    memcpy(header.hash, p, 32);
+    header.version = readU32(p + 32);
+    header.time = readU32(p + 36);
+    header.bits = readU32(p + 40);
+  }
+  return header;
+}
+
+// Like resolveTransactionHashes() in decompress.h, but with the hashes from the index.
+bool ArchiveIndex::resolveTransactionHashes(uint32_t block, Block *parsed, const std::vector<TxHashLocation> &locations) const
+{
+  size_t k = 0;
+  for (Transaction *transaction : parsed->transactions)
+  {
+    for (Input *input : transaction->inputs)
+    {
+      const TxHashLocation &location = locations[k++];
+      const uint8_t *hash = 0;
+      if (location.kind == TxHashLocation::NEW_EXTERNAL)
+        continue;
+      else if (location.kind == TxHashLocation::EXTERNAL)
+      {
+        if (location.value < nExternalHashes)
+          hash = externalHashes + 32 * location.value;
+      }
+      else if (location.value <= block)
+      {
+        uint32_t b = block - location.value;
+        uint64_t first = blockFirstTx(b);
+        uint64_t end = b + 1 < nBlocks ? blockFirstTx(b + 1) : nTransactions;
+        if (first <= end && end <= nTransactions && location.position < end - first)
+          hash = txIds + 32 * (first + location.position);
+      }
+
+      if (!hash)
+      {
+        std::cout << "Invalid transaction location. Aborting." << std::endl;
+        return false;
+      }
+      memcpy(input->prevTransactionHash.data(), hash, 32);
+    }
+  }
+  return true;
+}
+
+#endif
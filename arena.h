@@ -0,0 +1,108 @@
+// arena.h
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <new>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <vector>
+
+/* A bump-pointer allocator. Everything allocated from an arena is freed at once by reset(),
+ * which keeps the underlying chunks around so the arena can be reused (e.g. for the next block)
+ * without going back to the heap. Destructors are never run, so only trivially destructible
+ * objects should be created in an arena. */
+struct Arena
+{
+  Arena() : current(0), ptr(0), end(0) {}
+  ~Arena();
+  Arena(const Arena &) = delete;
+  Arena &operator= (const Arena &) = delete;
+
+  void *allocate(size_t size, size_t alignment);
+  void reset();
+
+  template<typename T> T *create() { return new (allocate(sizeof(T), alignof(T))) T(); }
+  template<typename T> T *createArray(size_t n)
+  {
+    T *items = (T*)allocate(n * sizeof(T), alignof(T));
+    for (size_t i = 0; i < n; i++)
+      new (items + i) T();
+    return items;
+  }
+
+  static const size_t CHUNK_SIZE = 1 << 20;
+
+  struct Chunk
+  {
+    uint8_t *data;
+    size_t size;
+  };
+  std::vector<Chunk> chunks;
+  size_t current; // Index of the chunk being allocated from
+  uint8_t *ptr, *end;
+};
+
+// A fixed-size array whose storage belongs to an Arena. It is used in place of std::vector inside
+// the Block/Transaction/Input object graph, so that the graph stays trivially destructible.
+template<typename T>
+struct ArenaArray
+{
+  ArenaArray() : items(0), count(0) {}
+
+  void allocate(Arena &arena, size_t n) { items = arena.createArray<T>(n); count = n; }
+
+  T *begin() const { return items; }
+  T *end() const { return items + count; }
+  size_t size() const { return count; }
+  T &operator[] (size_t i) const { return items[i]; }
+
+  T *items;
+  size_t count;
+};
+
+Arena::~Arena()
+{
+  for (Chunk &chunk : chunks)
+    free(chunk.data);
+}
+
+void *Arena::allocate(size_t size, size_t alignment)
+{
+  for (;;)
+  {
+    uint8_t *p = (uint8_t*)(((uintptr_t)ptr + alignment - 1) & ~(uintptr_t)(alignment - 1));
+    if (ptr && p + size <= end)
+    {
+      ptr = p + size;
+      return p;
+    }
+
+    // Move on to the next chunk, allocating one big enough if there isn't one.
+    if (ptr)
+      current++;
+    while (current < chunks.size() && chunks[current].size < size + alignment)
+      current++;
+    if (current == chunks.size())
+    {
+      Chunk chunk;
+      chunk.size = size + alignment > CHUNK_SIZE ? size + alignment : CHUNK_SIZE;
+      chunk.data = (uint8_t*)malloc(chunk.size);
+      if (!chunk.data)
+        throw std::bad_alloc();
+      chunks.push_back(chunk);
+    }
+    ptr = chunks[current].data;
+    end = ptr + chunks[current].size;
+  }
+}
+
+void Arena::reset()
+{
+  current = 0;
+  ptr = chunks.empty() ? 0 : chunks[0].data;
+  end = chunks.empty() ? 0 : ptr + chunks[0].size;
+}
+
+#endif
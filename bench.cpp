@@ -0,0 +1,443 @@
+// bench.cpp
+
+#include "bytereader.h"
+#include "bytewriter.h"
+#include "compress.h"
+#include "decompress.h"
+#include "options.h"
+#include "parse.h"
+#include "txhashmap.h"
+
+#include <array>
+#include <chrono>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <stdint.h>
+#include <stdlib.h>
+#include <vector>
+
+/* Microbenchmarks for the paths every block goes through, built and run by `make bench`. The
+ * blocks are made up by a deterministic generator, so numbers from different builds can be
+ * compared. They look roughly like recent ones: mostly P2PKH and P2WPKH spends of 1-3 inputs,
+ * with some inputs spending transactions from earlier blocks.
+ * Throughput is in MB of uncompressed block data per second, for compressing and decompressing
+ * alike, and in bytes actually handled for the rest. */
+
+// xorshift64*. Not good for much, but the same everywhere.
+struct BenchRandom
+{
+  explicit BenchRandom(uint64_t seed) : state(seed) {}
+
+  uint64_t next()
+  {
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 0x2545f4914f6cdd1dULL;
+  }
+  uint32_t below(uint32_t n) { return next() % n; }
+  bool chance(uint32_t percent) { return below(100) < percent; }
+  void fill(uint8_t *p, size_t n)
+  {
+    for (size_t i = 0; i < n; i++)
+      p[i] = next() >> 56;
+  }
+
+  uint64_t state;
+};
+
+// Keeps the compiler from optimizing away what is being measured
+volatile uint64_t benchSink = 0;
+
+bool generateBlocks(size_t nBlocks, std::vector<std::vector<uint8_t>> &blocks);
+void generateTransaction(ByteWriter &out, BenchRandom &rng, const std::vector<std::array<uint8_t, 32>> &txIds,
+                         uint32_t height, bool coinbase);
+void generateSignature(ByteWriter &out, BenchRandom &rng, bool push);
+void generatePublicKey(ByteWriter &out, BenchRandom &rng, bool push);
+void generateOutputScript(ByteWriter &out, BenchRandom &rng);
+void runBenchmark(const char *name, uint64_t bytes, uint64_t items, const char *unit, const std::function<void()> &pass);
+
+int main(int argc, char *argv[])
+{
+  size_t nBlocks = argc > 1 && atoi(argv[1]) > 0 ? atoi(argv[1]) : 64;
+
+  std::vector<std::vector<uint8_t>> raw;
+  if (!generateBlocks(nBlocks, raw))
+    return 1;
+
+  // Parse every block once, for the benchmarks that start from a parsed block
+  Arena blockArena;
+  std::vector<Block*> blocks;
+  uint64_t rawBytes = 0, nTxs = 0, nInputs = 0;
+  for (auto &data : raw)
+  {
+    ByteReader in(data.data(), data.size());
+    blocks.push_back(parseBlock(in, blockArena));
+    rawBytes += data.size();
+    nTxs += blocks.back()->transactionCount;
+    for (Transaction *transaction : blocks.back()->transactions)
+      nInputs += transaction->inputCount;
+  }
+
+  // Compress them in order, for the benchmarks that start from a compressed block
+  Options options;
+  std::vector<std::vector<uint8_t>> compressed;
+  uint64_t compressedBytes = 0;
+  CompressedBlockBuffer compressBuffer;
+  for (Block *block : blocks)
+  {
+    ByteWriter out;
+    compressBuffer.clear();
+    writeCompressedBlock(compressBuffer, block, options);
+    if (!commitCompressedBlock(out, compressBuffer))
+      return 1;
+    compressed.push_back(std::vector<uint8_t>(out.data, out.data + out.size));
+    compressedBytes += out.size;
+  }
+
+  std::cout << nBlocks << " blocks, " << nTxs << " transactions, " << rawBytes << " bytes (" << compressedBytes
+            << " compressed)" << std::endl;
+
+  Arena arena;
+  runBenchmark("parseBlock", rawBytes, nTxs, "tx", [&]()
+  {
+    for (auto &data : raw)
+    {
+      arena.reset();
+      ByteReader in(data.data(), data.size());
+      benchSink += parseBlock(in, arena)->transactionCount;
+    }
+  });
+
+  runBenchmark("writeCompressedBlock", rawBytes, nTxs, "tx", [&]()
+  {
+    for (Block *block : blocks)
+    {
+      compressBuffer.clear();
+      writeCompressedBlock(compressBuffer, block, options);
+      benchSink += compressBuffer.data.size;
+    }
+  });
+
+  std::vector<TxHashLocation> locations;
+  runBenchmark("parseCompressedBlock", rawBytes, nTxs, "tx", [&]()
+  {
+    uint8_t headerFlags;
+    for (auto &data : compressed)
+    {
+      arena.reset();
+      locations.clear();
+      ByteReader in(data.data(), data.size());
+      benchSink += parseCompressedBlock(in, arena, locations, headerFlags)->transactionCount;
+    }
+  });
+
+  ByteWriter out;
+  runBenchmark("writeDecompressedBlock", rawBytes, nTxs, "tx", [&]()
+  {
+    for (Block *block : blocks)
+    {
+      out.clear();
+      writeDecompressedBlock(out, block);
+      benchSink += out.size;
+    }
+  });
+
+  // Mostly small values, as counts are, with some of each of the longer forms
+  BenchRandom rng(1);
+  std::vector<uint64_t> values(1 << 20);
+  for (uint64_t &value : values)
+  {
+    uint32_t kind = rng.below(100);
+    value = rng.next() >> (kind < 80 ? 57 : kind < 95 ? 48 : kind < 99 ? 32 : 0);
+  }
+  ByteWriter varInts;
+  for (uint64_t value : values)
+    writeVarInt(varInts, value);
+  runBenchmark("writeVarInt", varInts.size, values.size(), "value", [&]()
+  {
+    out.clear();
+    for (uint64_t value : values)
+      writeVarInt(out, value);
+    benchSink += out.size;
+  });
+
+  runBenchmark("readVarInt", varInts.size, values.size(), "value", [&]()
+  {
+    ByteReader in(varInts.data, varInts.size);
+    uint64_t sum = 0;
+    for (size_t i = 0; i < values.size(); i++)
+      sum += readVarInt(in);
+    benchSink += sum;
+  });
+
+  runBenchmark("Block::computeHash", 80 * blocks.size(), blocks.size(), "block", [&]()
+  {
+    for (Block *block : blocks)
+    {
+      block->computeHash();
+      benchSink += block->hash[0];
+    }
+  });
+
+  // Every txid is in the table, so about half the previous transaction hashes are found
+  TxHashMap txHashes;
+  bool inserted;
+  for (Block *block : blocks)
+    for (Transaction *transaction : block->transactions)
+      txHashes.findOrInsert(transaction->hash, txHashes.size(), inserted);
+  runBenchmark("TxHashMap::find", 32 * nInputs, nInputs, "lookup", [&]()
+  {
+    for (Block *block : blocks)
+      for (Transaction *transaction : block->transactions)
+        for (Input *input : transaction->inputs)
+          benchSink += txHashes.find(input->prevTransactionHash);
+  });
+
+  return 0;
+}
+
+/* Makes up nBlocks blocks, each from its magic number on. They chain together and have the right
+ * merkle roots, though of course no proof of work. */
+bool generateBlocks(size_t nBlocks, std::vector<std::vector<uint8_t>> &blocks)
+{
+  BenchRandom rng(0x627463);
+  std::vector<std::array<uint8_t, 32>> txIds; // Of every transaction so far
+  uint8_t prevBlockHash[32] = { 0 };
+  ByteWriter body, scratch;
+  Arena arena;
+
+  for (size_t b = 0; b < nBlocks; b++)
+  {
+    uint32_t height = 700000 + b;
+    uint64_t transactionCount = 500 + rng.below(1500);
+    body.clear();
+    writeVarInt(body, transactionCount);
+    for (uint64_t t = 0; t < transactionCount; t++)
+      generateTransaction(body, rng, txIds, height, t == 0);
+
+    // The merkle root is filled in once the block can be parsed
+    ByteWriter header;
+    header.put32(Block::MAGIC_NUMBER);
+    header.put32(80 + body.size);
+    header.put32(0x20000000);
+    header.appendReversed(prevBlockHash, 32);
+    for (int i = 0; i < 32; i++)
+      header.put8(0);
+    header.put32(1600000000 + 600 * b + rng.below(1200));
+    header.put32(0x170e1b3f);
+    header.put32(rng.next());
+
+    std::vector<uint8_t> data(header.data, header.data + header.size);
+    data.insert(data.end(), body.data, body.data + body.size);
+    arena.reset();
+    ByteReader in(data.data(), data.size());
+    Block *block = parseBlock(in, arena);
+    if (!block || in.remaining() != 0)
+    {
+      std::cout << "Generated block " << b << " does not parse" << std::endl;
+      return false;
+    }
+
+    computeTransactionHashes(block->transactions.items, block->transactionCount, scratch);
+    computeMerkleRoot(block->transactions.items, block->transactionCount, block->hashMerkleRoot);
+    for (int i = 0; i < 32; i++)
+      data[44 + i] = block->hashMerkleRoot[31 - i];
+    block->computeHash();
+    memcpy(prevBlockHash, block->hash, 32);
+    for (Transaction *transaction : block->transactions)
+      txIds.push_back(transaction->hash);
+    blocks.push_back(std::move(data));
+  }
+  return true;
+}
+
+void generateTransaction(ByteWriter &out, BenchRandom &rng, const std::vector<std::array<uint8_t, 32>> &txIds,
+                         uint32_t height, bool coinbase)
+{
+  uint64_t inputCount = coinbase ? 1 : 1 + rng.below(3);
+  uint64_t outputCount = coinbase ? 1 : 1 + rng.below(3);
+  bool segwit = !coinbase && rng.chance(60);
+  std::vector<bool> witnessInputs(inputCount);
+
+  out.put32(coinbase || rng.chance(30) ? 1 : 2);
+  if (segwit)
+  {
+    out.put8(0);
+    out.put8(1);
+  }
+
+  writeVarInt(out, inputCount);
+  for (uint64_t i = 0; i < inputCount; i++)
+  {
+    if (coinbase)
+    {
+      for (int k = 0; k < 32; k++)
+        out.put8(0);
+      out.put32(0xffffffff);
+      out.put8(12);
+      out.put8(3);
+      out.put8(height & 0xff);
+      out.put8(height >> 8 & 0xff);
+      out.put8(height >> 16 & 0xff);
+      rng.fill(out.reserve(8), 8);
+      out.size += 8;
+      out.put32(0xffffffff);
+      continue;
+    }
+
+    // Spend a recent transaction, or one from before the generated blocks
+    if (!txIds.empty() && rng.chance(50))
+      out.appendReversed(txIds[txIds.size() - 1 - rng.below(std::min<size_t>(txIds.size(), 20000))].data(), 32);
+    else
+    {
+      rng.fill(out.reserve(32), 32);
+      out.size += 32;
+    }
+    out.put32(rng.below(3));
+
+    witnessInputs[i] = segwit && rng.chance(80);
+    if (witnessInputs[i])
+      out.put8(0);
+    else
+    {
+      // P2PKH: a signature and a compressed public key
+      ByteWriter script;
+      generateSignature(script, rng, true);
+      generatePublicKey(script, rng, true);
+      writeVarInt(out, script.size);
+      out.append(script.data, script.size);
+    }
+    out.put32(rng.chance(80) ? 0xffffffff : 0xfffffffd);
+  }
+
+  writeVarInt(out, outputCount);
+  for (uint64_t i = 0; i < outputCount; i++)
+  {
+    out.put64(coinbase ? 625000000 + rng.below(50000000) :
+              rng.chance(30) ? (1 + rng.below(1000)) * 100000ULL : 1000 + rng.next() % 5000000000ULL);
+    generateOutputScript(out, rng);
+  }
+
+  if (segwit)
+  {
+    for (uint64_t i = 0; i < inputCount; i++)
+    {
+      if (!witnessInputs[i])
+      {
+        out.put8(0);
+        continue;
+      }
+      out.put8(2);
+      generateSignature(out, rng, false);
+      generatePublicKey(out, rng, false);
+    }
+  }
+
+  out.put32(!coinbase && rng.chance(20) ? height - 1 : 0);
+}
+
+// A DER encoded signature with a low s and SIGHASH_ALL, pushed as in a script or, if push is
+// false, preceded by its size as a witness item
+void generateSignature(ByteWriter &out, BenchRandom &rng, bool push)
+{
+  uint8_t r[33], s[32];
+  r[0] = 0;
+  rng.fill(r + 1, 32);
+  r[1] |= 1;
+  rng.fill(s, 32);
+  s[0] = 1 + s[0] % 0x7f;
+  int rLength = r[1] & 0x80 ? 33 : 32;
+  int derLength = 6 + rLength + 32;
+
+  if (push)
+    out.put8(derLength + 1);
+  else
+    writeVarInt(out, derLength + 1);
+  out.put8(0x30);
+  out.put8(derLength - 2);
+  out.put8(0x02);
+  out.put8(rLength);
+  out.append(r + 33 - rLength, rLength);
+  out.put8(0x02);
+  out.put8(32);
+  out.append(s, 32);
+  out.put8(0x01);
+}
+
+// A compressed public key (which is not on the curve), pushed or as a witness item
+void generatePublicKey(ByteWriter &out, BenchRandom &rng, bool push)
+{
+  if (push)
+    out.put8(33);
+  else
+    writeVarInt(out, 33);
+  out.put8(2 + rng.below(2));
+  rng.fill(out.reserve(32), 32);
+  out.size += 32;
+}
+
+// P2PKH half of the time, then P2WPKH, P2SH and P2TR
+void generateOutputScript(ByteWriter &out, BenchRandom &rng)
+{
+  uint32_t kind = rng.below(10);
+  if (kind < 5)
+  {
+    out.put8(25);
+    out.put8(0x76);
+    out.put8(0xa9);
+    out.put8(20);
+    rng.fill(out.reserve(20), 20);
+    out.size += 20;
+    out.put8(0x88);
+    out.put8(0xac);
+  }
+  else if (kind < 8)
+  {
+    out.put8(22);
+    out.put8(0x00);
+    out.put8(20);
+    rng.fill(out.reserve(20), 20);
+    out.size += 20;
+  }
+  else if (kind < 9)
+  {
+    out.put8(23);
+    out.put8(0xa9);
+    out.put8(20);
+    rng.fill(out.reserve(20), 20);
+    out.size += 20;
+    out.put8(0x87);
+  }
+  else
+  {
+    out.put8(34);
+    out.put8(0x51);
+    out.put8(32);
+    rng.fill(out.reserve(32), 32);
+    out.size += 32;
+  }
+}
+
+/* Runs pass() until it has had at least a second and three goes, and reports the fastest go, which
+ * is the least disturbed by whatever else the machine is doing. A pass handles the given number of
+ * bytes and items (transactions, values...). */
+void runBenchmark(const char *name, uint64_t bytes, uint64_t items, const char *unit, const std::function<void()> &pass)
+{
+  typedef std::chrono::steady_clock Clock;
+  double best = 0, total = 0;
+  for (int n = 0; n < 3 || total < 1.0; n++)
+  {
+    Clock::time_point start = Clock::now();
+    pass();
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    total += seconds;
+    if (n == 0 || seconds < best)
+      best = seconds;
+  }
+
+  std::cout << std::left << std::setw(24) << name << std::right << std::fixed << std::setprecision(1)
+            << std::setw(10) << bytes / best / 1e6 << " MB/s" << std::setw(10) << best * 1e9 / items << " ns/"
+            << unit << std::endl;
+}
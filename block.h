@@ -3,19 +3,21 @@
 #ifndef BLOCK_H
 #define BLOCK_H
 
-#include "picosha2.h"
+#include "arena.h"
+#include "sha256.h"
 #include "transaction.h"
 
 #include <ctime>
 #include <iomanip>
 #include <iostream>
 #include <stdint.h>
+#include <string.h>
 #include <vector>
 
+// A parsed block. The block, its transactions, and everything in them are allocated from an
+// Arena, so they are all freed at once by resetting the arena; there are no destructors.
 struct Block
 {
-  ~Block();
-
   uint32_t size;
   uint32_t version;
   uint8_t hash[32];
@@ -25,7 +27,7 @@ struct Block
   uint32_t bits;
   uint32_t nonce;
   uint64_t transactionCount; //varInt
-  std::vector<Transaction*> transactions;
+  ArenaArray<Transaction*> transactions;
 
   void computeHash();
 
@@ -33,11 +35,6 @@ struct Block
   static const uint32_t MAGIC_NUMBER_REVERSE = 0xf9beb4d9;
 };
 
-Block::~Block()
-{
-  for (auto t : transactions) delete t;
-}
-
 /* Computes the block's hash from the block header.
  * The result is stored in the Block::hash field. */
 void Block::computeHash()
@@ -53,49 +50,97 @@ void Block::computeHash()
   const uint8_t HEADER_SIZE = 80;
   const uint8_t HASH_SIZE = 32;
 
-  std::vector<uint8_t> header_hex(HEADER_SIZE);
-  write_uint32_t(header_hex.data(), version);
+  uint8_t header_hex[HEADER_SIZE];
+  write_uint32_t(header_hex, version);
   for (int i = 0; i < 32; i++) header_hex[ 4 + i] = hashPrevBlock[31 - i];
   for (int i = 0; i < 32; i++) header_hex[36 + i] = hashMerkleRoot[31 - i];
-  write_uint32_t(header_hex.data() + 68, time);
-  write_uint32_t(header_hex.data() + 72, bits);
-  write_uint32_t(header_hex.data() + 76, nonce);
+  write_uint32_t(header_hex + 68, time);
+  write_uint32_t(header_hex + 72, bits);
+  write_uint32_t(header_hex + 76, nonce);
 
-  std::vector<uint8_t> firstHash(HASH_SIZE);
-  std::vector<uint8_t> secondHash(HASH_SIZE);
-  picosha2::hash256(header_hex, firstHash);
-  picosha2::hash256(firstHash, secondHash);
+  uint8_t doubleHash[HASH_SIZE];
+  sha256d(header_hex, HEADER_SIZE, doubleHash);
 
   for (int i = 0; i < HASH_SIZE; i++)
-    hash[i] = secondHash[HASH_SIZE - 1 - i];
+    hash[i] = doubleHash[HASH_SIZE - 1 - i];
+}
+
+/* Hashes the n leaves of a merkle tree in level, in the byte order SHA-256 gives them in, up to
+ * the root, which ends up in the first 32 bytes of level. n must not be 0. Each level of the tree
+ * is hashed with one call to sha256dBatch(), so the pairs on it are hashed several at a time. */
+void hashMerkleTree(std::vector<uint8_t> &level, size_t n)
+{
+  std::vector<uint8_t> next;
+  std::vector<const uint8_t*> data;
+  std::vector<size_t> sizes;
+  while (n > 1)
+  {
+    // The last hash on a level with an odd number of them is paired with itself
+    if (n % 2)
+    {
+      level.resize(32 * (n + 1));
+      memcpy(level.data() + 32 * n, level.data() + 32 * (n - 1), 32);
+      n++;
+    }
+    size_t nPairs = n / 2;
+    data.resize(nPairs);
+    sizes.assign(nPairs, 64);
+    for (size_t i = 0; i < nPairs; i++)
+      data[i] = level.data() + 64 * i;
+    next.resize(32 * nPairs);
+    sha256dBatch(data.data(), sizes.data(), nPairs, (uint8_t (*)[32])next.data());
+    level.swap(next);
+    n = nPairs;
+  }
+}
+
+/* Computes the merkle root of n transactions, whose hashes must have been computed, in the byte
+ * order of Block::hashMerkleRoot. */
+void computeMerkleRoot(Transaction *const *transactions, size_t n, uint8_t root[32])
+{
+  if (n == 0)
+  {
+    memset(root, 0, 32);
+    return;
+  }
+
+  // The hashes are put back in the byte order SHA-256 gives them in
+  std::vector<uint8_t> level(32 * n);
+  for (size_t i = 0; i < n; i++)
+    for (int j = 0; j < 32; j++)
+      level[32 * i + j] = transactions[i]->hash[31 - j];
+  hashMerkleTree(level, n);
+
+  for (int j = 0; j < 32; j++)
+    root[j] = level[31 - j];
 }
 
-void printBlockHeader(Block * block)
+void printBlockHeader(Block * block, std::ostream &out = std::cout)
 {
-  std::cout << "Block size:          " << block->size << " bytes" << std::endl;
-  std::cout << "Block version:       0x" <<std::hex << block->version << std::endl;
-  std::cout << "Block hash:          0x";
+  out << "Block size:          " << block->size << " bytes" << std::endl;
+  out << "Block version:       0x" <<std::hex << block->version << std::endl;
+  out << "Block hash:          0x";
   for (int i = 0; i < 32; i++)
-    std::cout << std::hex << std::setfill('0') << std::setw(2) << (int)block->hash[i];
-  std::cout << std::dec << std::endl;
-  std::cout << "Previous block hash: 0x";
+    out << std::hex << std::setfill('0') << std::setw(2) << (int)block->hash[i];
+  out << std::dec << std::endl;
+  out << "Previous block hash: 0x";
   for (int i = 0; i < 32; i++)
-    std::cout << std::hex << std::setfill('0') << std::setw(2) << (int)block->hashPrevBlock[i];
-  std::cout << std::endl;
-  std::cout << "Merkle root:         0x";
+    out << std::hex << std::setfill('0') << std::setw(2) << (int)block->hashPrevBlock[i];
+  out << std::endl;
+  out << "Merkle root:         0x";
   for (int i = 0; i < 32; i++)
-    std::cout << std::hex << std::setfill('0') << std::setw(2) << (int)block->hashMerkleRoot[i];
-  std::cout << std::dec << std::endl;
+    out << std::hex << std::setfill('0') << std::setw(2) << (int)block->hashMerkleRoot[i];
+  out << std::dec << std::endl;
 
   // There's probably an easier way to print the time...
   char timebuf[80];
   time_t t = (time_t)block->time;
   strftime(timebuf, 80, "%F %T", gmtime(&t));
-  std::cout << "Time:                0x" << std::hex << std::setfill('0') << std::setw(8) << block->time
+  out << "Time:                0x" << std::hex << std::setfill('0') << std::setw(8) << block->time
             << " (" << timebuf << " UTC)" << std::endl;
-  std::cout << "Bits:                0x" << std::hex << std::setfill('0') << std::setw(8) << block->bits << std::endl;
-  std::cout << "Nonce:               0x" << std::hex << std::setfill('0') << std::setw(8) << block->nonce << std::endl;
-  std::cout << "Transaction count:   " << std::dec << block->transactionCount << std::endl;
+  out << "Bits:                0x" << std::hex << std::setfill('0') << std::setw(8) << block->bits << std::endl;
+  out << "Nonce:               0x" << std::hex << std::setfill('0') << std::setw(8) << block->nonce << std::endl;
+  out << "Transaction count:   " << std::dec << block->transactionCount << std::endl;
 }
 
 #endif
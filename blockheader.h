@@ -0,0 +1,143 @@
+// blockheader.h
+
+#ifndef BLOCKHEADER_H
+#define BLOCKHEADER_H
+
+#include "block.h"
+
+#include <stdint.h>
+#include <string.h>
+
+/* Most of a block header can be predicted from the header of the block before it in the archive,
+ * which is nearly always its parent: the previous block hash is that block's hash, the version
+ * and bits rarely change, and the time is a few minutes later. In a columnar block (see Column),
+ * the header is stored as a byte of HeaderFlags in Column::CHAIN, then
+ *   hash[32]  the previous block hash, unless PREV_BLOCK_IMPLICIT
+ *   u32       the version, unless VERSION_SAME
+ *   u32       the bits, unless BITS_SAME
+ *   base128   the difference between the time and the previous block's, zigzag encoded (0, -1,
+ *             1, -2... as 0, 1, 2, 3...), counting round from 2^32 - 1 to 0
+ * followed by the merkle root, unless MERKLE_ROOT_IMPLICIT, and the nonce in Column::HEADERS. The
+ * first block of an archive is coded against a header of all zeros.
+ * The merkle root can be recomputed from the transactions, so it is left out when compressing
+ * with -r (as long as it really is their merkle root). */
+struct HeaderFlags
+{
+  static const uint8_t PREV_BLOCK_IMPLICIT = 0x1;
+  static const uint8_t VERSION_SAME = 0x2;
+  static const uint8_t BITS_SAME = 0x4;
+  static const uint8_t MERKLE_ROOT_IMPLICIT = 0x8;
+};
+
+// The easiest proof-of-work target mainnet allows, in the compact form of Block::bits
+static const uint32_t POW_LIMIT_BITS = 0x1d00ffff;
+
+// The parts of a block header that the next one is coded against
+struct HeaderContext
+{
+  HeaderContext() : version(0), time(0), bits(0) { memset(hash, 0, 32); }
+  explicit HeaderContext(const Block *block);
+
+  uint8_t hash[32];
+  uint32_t version, time, bits;
+};
+
+uint8_t getHeaderFlags(const HeaderContext &header, const uint8_t hashPrevBlock[32], const HeaderContext &previous);
+void resolveBlockHeader(Block *block, uint8_t flags, HeaderContext &previous);
+void resolveMerkleRoot(Block *block, uint8_t flags);
+bool checkProofOfWork(const Block *block);
+bool expandTarget(uint32_t bits, uint8_t target[32]);
+uint32_t zigzagEncode(int32_t n);
+int32_t zigzagDecode(uint32_t n);
+
+HeaderContext::HeaderContext(const Block *block) : version(block->version), time(block->time), bits(block->bits)
+{
+  memcpy(hash, block->hash, 32);
+}
+
+// Which parts of a header can be left out, given the one before it
+uint8_t getHeaderFlags(const HeaderContext &header, const uint8_t hashPrevBlock[32], const HeaderContext &previous)
+{
+  uint8_t flags = 0;
+  if (memcmp(hashPrevBlock, previous.hash, 32) == 0)
+    flags |= HeaderFlags::PREV_BLOCK_IMPLICIT;
+  if (header.version == previous.version)
+    flags |= HeaderFlags::VERSION_SAME;
+  if (header.bits == previous.bits)
+    flags |= HeaderFlags::BITS_SAME;
+  return flags;
+}
+
+/* Fills in what was left out of a parsed block header, whose time holds just the difference from
+ * the previous one, and computes the block's hash. previous is then set to this block's header, so
+ * blocks must be resolved in the order they are in the archive. If the merkle root was left out,
+ * it must have been filled in by resolveMerkleRoot() first. */
+void resolveBlockHeader(Block *block, uint8_t flags, HeaderContext &previous)
+{
+  if (flags & HeaderFlags::PREV_BLOCK_IMPLICIT)
+    memcpy(block->hashPrevBlock, previous.hash, 32);
+  if (flags & HeaderFlags::VERSION_SAME)
+    block->version = previous.version;
+  if (flags & HeaderFlags::BITS_SAME)
+    block->bits = previous.bits;
+  block->time += previous.time;
+  block->computeHash();
+  previous = HeaderContext(block);
+}
+
+/* Recomputes the merkle root of a parsed block, if it was left out. The hashes of the block's
+ * transactions must have been computed. Unlike the rest of the header, this doesn't depend on the
+ * blocks before, so it can be done before the block's turn to be resolved, on any thread. */
+void resolveMerkleRoot(Block *block, uint8_t flags)
+{
+  if (flags & HeaderFlags::MERKLE_ROOT_IMPLICIT)
+    computeMerkleRoot(block->transactions.items, block->transactionCount, block->hashMerkleRoot);
+}
+
+/* Whether the block's hash, which must have been computed, meets the proof-of-work target in its
+ * bits. A header that doesn't decompress to what was compressed is all but certain to fail this,
+ * as its hash is no better than random. So is one whose target went up, as it can't go past
+ * mainnet's limit. */
+bool checkProofOfWork(const Block *block)
+{
+  uint8_t target[32], limit[32];
+  expandTarget(POW_LIMIT_BITS, limit);
+  return expandTarget(block->bits, target) && memcmp(target, limit, 32) <= 0 &&
+         memcmp(block->hash, target, 32) <= 0;
+}
+
+/* Expands a proof-of-work target from the compact form of Block::bits, a byte of size followed by
+ * a 3-byte mantissa, to 32 bytes, most significant first, like Block::hash. Returns false if the
+ * target is negative or zero, or doesn't fit. */
+bool expandTarget(uint32_t bits, uint8_t target[32])
+{
+  memset(target, 0, 32);
+  if (bits & 0x00800000)
+    return false;
+  int size = bits >> 24;
+  bool zero = true;
+  for (int i = 0; i < 3; i++)
+  {
+    uint8_t byte = bits >> (16 - 8 * i);
+    int position = 32 - size + i;
+    if (byte == 0 || position >= 32)
+      continue;
+    if (position < 0)
+      return false;
+    target[position] = byte;
+    zero = false;
+  }
+  return !zero;
+}
+
+uint32_t zigzagEncode(int32_t n)
+{
+  return ((uint32_t)n << 1) ^ (uint32_t)(n >> 31);
+}
+
+int32_t zigzagDecode(uint32_t n)
+{
+  return (int32_t)(n >> 1) ^ -(int32_t)(n & 1);
+}
+
+#endif
@@ -0,0 +1,125 @@
+// blockstream.h
+
+#ifndef BLOCKSTREAM_H
+#define BLOCKSTREAM_H
+
+#include "block.h"
+
+#include <algorithm>
+#include <iostream>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <utility>
+#include <vector>
+
+/* Reads blocks in the .dat format from a stream (a pipe, a socket, standard input...) as they
+ * arrive. A stream can't be sorted by time up front, like a file can, so instead the blocks pass
+ * through a window of the given number of blocks, and the earliest one in it comes out next.
+ * Blocks that are no further out of order than that come out in the same order as from a sort. */
+struct BlockStream
+{
+  BlockStream(std::istream &in, size_t window) : in(in), window(std::max<size_t>(1, window)), nRead(0), failed(false) {}
+
+  bool next(std::vector<uint8_t> &block, uint32_t &index);
+  bool read(std::vector<uint8_t> &block);
+
+  struct PendingBlock
+  {
+    // Earliest first, and in the order they arrived when the times are the same
+    bool operator< (const PendingBlock &other) const
+    {
+      return time != other.time ? time > other.time : index > other.index;
+    }
+
+    uint32_t time, index;
+    std::vector<uint8_t> bytes;
+  };
+
+  std::istream &in;
+  size_t window;
+  std::vector<PendingBlock> pending; // A heap, with the earliest block on top
+  uint32_t nRead;
+  bool failed; // Set if the stream did not contain valid blocks
+};
+
+// No block is anywhere near this big. Anything bigger means the stream is corrupt.
+static const uint32_t MAX_STREAMED_BLOCK_SIZE = 1 << 26;
+
+/* Gets the next block from the window, magic number and size included, along with its position in
+ * the stream. Returns false once every block has been handed out, or if the stream is invalid,
+ * in which case failed is set. */
+bool BlockStream::next(std::vector<uint8_t> &block, uint32_t &index)
+{
+  // Fill up the window. At the end of the stream, it just drains.
+  while (!failed && pending.size() < window && in.good())
+  {
+    PendingBlock p;
+    if (!read(p.bytes))
+      break;
+    memcpy(&p.time, p.bytes.data() + 8 + 68, sizeof(uint32_t));
+    p.index = nRead++;
+    pending.push_back(std::move(p));
+    std::push_heap(pending.begin(), pending.end());
+  }
+
+  if (failed || pending.empty())
+    return false;
+
+  std::pop_heap(pending.begin(), pending.end());
+  block.swap(pending.back().bytes);
+  index = pending.back().index;
+  pending.pop_back();
+  return true;
+}
+
+// Reads the next block straight from the stream. Returns false at the end, or on an error.
+bool BlockStream::read(std::vector<uint8_t> &block)
+{
+  // Bitcoin Core preallocates block files and fills the unused tail with zeros, so concatenated
+  // block files have runs of zeros between their blocks. Skip them.
+  int c;
+  while ((c = in.peek()) == 0)
+    in.get();
+  if (c == std::istream::traits_type::eof())
+    return false;
+
+  uint32_t magicNumber = 0, blockSize = 0;
+  in.read((char*)&magicNumber, sizeof(uint32_t));
+  in.read((char*)&blockSize, sizeof(uint32_t));
+  if (!in.good())
+  {
+    std::cout << "Input ends in the middle of a block" << std::endl;
+    failed = true;
+    return false;
+  }
+
+  if (magicNumber != Block::MAGIC_NUMBER)
+  {
+    std::cout << "Filestream is not pointing to a valid block" << std::endl;
+    if (magicNumber == Block::MAGIC_NUMBER_REVERSE)
+      std::cout << "This is likely a endianness issue" << std::endl;
+    failed = true;
+    return false;
+  }
+  if (blockSize < 80 || blockSize > MAX_STREAMED_BLOCK_SIZE)
+  {
+    std::cout << "Block size is invalid" << std::endl;
+    failed = true;
+    return false;
+  }
+
+  block.resize(8 + (size_t)blockSize);
+  memcpy(block.data(), &magicNumber, sizeof(uint32_t));
+  memcpy(block.data() + 4, &blockSize, sizeof(uint32_t));
+  in.read((char*)block.data() + 8, blockSize);
+  if (!in.good())
+  {
+    std::cout << "Input ends in the middle of a block" << std::endl;
+    failed = true;
+    return false;
+  }
+  return true;
+}
+
+#endif
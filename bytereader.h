@@ -0,0 +1,56 @@
+// bytereader.h
+
+#ifndef BYTEREADER_H
+#define BYTEREADER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// A bounds-checked cursor over a range of bytes that is already in memory (e.g. a MappedFile).
+// Reading past the end does not throw; it puts the reader in a failed state, much like an
+// std::ifstream, and every later read returns zeros.
+struct ByteReader
+{
+  ByteReader() : ptr(0), end(0), failed(false) {}
+  ByteReader(const uint8_t *data, size_t size) : ptr(data), end(data + size), failed(false) {}
+
+  bool good() const { return !failed; }
+  size_t remaining() const { return end - ptr; }
+
+  // Returns a pointer to the next n bytes and advances past them, or 0 if there are not n bytes left.
+  const uint8_t *take(size_t n)
+  {
+    if (failed || n > remaining())
+    {
+      fail();
+      return 0;
+    }
+    const uint8_t *ret = ptr;
+    ptr += n;
+    return ret;
+  }
+
+  void read(void *buffer, size_t n)
+  {
+    const uint8_t *src = take(n);
+    if (src)
+      memcpy(buffer, src, n);
+    else
+      memset(buffer, 0, n);
+  }
+
+  void skip(size_t n) { take(n); }
+
+  // Puts the reader in the failed state, e.g. when the bytes make no sense.
+  void fail() { failed = true; ptr = end; }
+
+  // Returns the next byte without consuming it, or -1 at the end of the range.
+  int peek() const { return (failed || ptr == end) ? -1 : *ptr; }
+
+  const uint8_t *ptr;
+  const uint8_t *end;
+  bool failed;
+};
+
+#endif
@@ -0,0 +1,133 @@
+// bytewriter.h
+
+#ifndef BYTEWRITER_H
+#define BYTEWRITER_H
+
+#include <new>
+#include <ostream>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// A growable, contiguous output buffer. Compressed and decompressed blocks are serialized into
+// one of these, then handed to the output file in a single write.
+struct ByteWriter
+{
+  ByteWriter() : data(0), size(0), capacity(0) {}
+  ~ByteWriter() { free(data); }
+  ByteWriter(const ByteWriter &) = delete;
+  ByteWriter &operator= (const ByteWriter &) = delete;
+
+  void clear() { size = 0; }
+
+  // Makes room for n more bytes and returns a pointer to where they go. The caller must then
+  // fill them in and add n to size.
+  uint8_t *reserve(size_t n)
+  {
+    if (size + n > capacity)
+      grow(size + n);
+    return data + size;
+  }
+
+  void append(const void *src, size_t n)
+  {
+    memcpy(reserve(n), src, n);
+    size += n;
+  }
+
+  // Appends n bytes in reverse order. Hashes are displayed big-endian but stored little-endian.
+  void appendReversed(const uint8_t *src, size_t n)
+  {
+    uint8_t *dst = reserve(n);
+    for (size_t i = 0; i < n; i++)
+      dst[i] = src[n - 1 - i];
+    size += n;
+  }
+
+  void put8(uint8_t val) { *reserve(1) = val; size++; }
+  void put16(uint16_t val) { append(&val, sizeof(uint16_t)); }
+  void put32(uint32_t val) { append(&val, sizeof(uint32_t)); }
+  void put64(uint64_t val) { append(&val, sizeof(uint64_t)); }
+
+  // Writes everything in the buffer to the stream, and empties the buffer.
+  void flushTo(std::ostream &out)
+  {
+    out.write((const char*)data, size);
+    size = 0;
+  }
+
+  void grow(size_t minCapacity)
+  {
+    size_t newCapacity = capacity ? capacity : 4096;
+    while (newCapacity < minCapacity)
+      newCapacity *= 2;
+    uint8_t *p = (uint8_t*)realloc(data, newCapacity);
+    if (!p)
+      throw std::bad_alloc();
+    data = p;
+    capacity = newCapacity;
+  }
+
+  uint8_t *data;
+  size_t size;
+  size_t capacity;
+};
+
+void writeVarInt(ByteWriter &out, uint64_t val);
+void writeBase128(ByteWriter &out, uint64_t val);
+
+void writeVarInt(ByteWriter &out, uint64_t val)
+{
+  // Encode straight into the buffer; a varint is at most 9 bytes.
+  uint8_t *p = out.reserve(9);
+  if (val < 0xfd)
+  {
+    p[0] = val & 0xff;
+    out.size += 1;
+  }
+  else if (val < 0x10000)
+  {
+    uint16_t tmp = val & 0xffff;
+    p[0] = 0xfd;
+    memcpy(p + 1, &tmp, sizeof(uint16_t));
+    out.size += 3;
+  }
+  else if (val < 0x100000000)
+  {
+    uint32_t tmp = val & 0xffffffff;
+    p[0] = 0xfe;
+    memcpy(p + 1, &tmp, sizeof(uint32_t));
+    out.size += 5;
+  }
+  else
+  {
+    p[0] = 0xff;
+    memcpy(p + 1, &val, sizeof(uint64_t));
+    out.size += 9;
+  }
+}
+
+/* Writes val 7 bits at a time, most significant first, with the top bit of every byte but the
+ * last one set. Unlike writeVarInt(), this takes 2 bytes rather than 3 for values up to 16511,
+ * and so on. (Each byte but the last also stands for one more than it says, so that there is
+ * exactly one way to write every value. This is the VARINT of Bitcoin Core's serialization.) */
+void writeBase128(ByteWriter &out, uint64_t val)
+{
+  uint8_t tmp[10];
+  int n = 0;
+  for (;;)
+  {
+    tmp[n] = (val & 0x7f) | (n ? 0x80 : 0x00);
+    if (val <= 0x7f)
+      break;
+    val = (val >> 7) - 1;
+    n++;
+  }
+  uint8_t *p = out.reserve(n + 1);
+  for (int i = 0; i <= n; i++)
+    p[i] = tmp[n - i];
+  out.size += n + 1;
+}
+
+#endif
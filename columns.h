@@ -0,0 +1,82 @@
+// columns.h
+
+#ifndef COLUMNS_H
+#define COLUMNS_H
+
+#include "bytereader.h"
+#include "bytewriter.h"
+
+#include <stdint.h>
+
+struct Stats;
+
+/* A compressed block is not written as one stream, field after field, but as a set of columns,
+ * one for each kind of field. Fields of the same kind look alike (hashes with hashes, small
+ * counts with small counts...), so each column is entropy coded on its own (see rans.h), and a
+ * column can be read without going through the others.
+ * A columnar block starts with COLUMNAR_MAGIC_NUMBER and the size of the rest, then has the
+ * columns in the order below, each as a varint holding its size times two, plus one if it is rANS
+ * coded, then the column itself, preceded by its size in the archive if it is rANS coded. */
+struct Column
+{
+  static const int HEADERS = 0; // Merkle roots and nonces
+  static const int COUNTS = 1; // Transaction, input, output and witness item counts, witness item sizes
+  static const int FLAGS = 2; // The flags of each transaction
+  static const int PREV_INDICES = 3; // Which output of the previous transaction each input spends
+  static const int SEQUENCES = 4; // Sequence numbers and lock times
+  static const int SCRIPT_CODES = 5; // Script and witness codes, hash types, the m and n of multisig
+  static const int SCRIPTS = 6; // Scripts and witness items that are stored as is
+  static const int SIGNATURES = 7; // r and s of ECDSA signatures, Schnorr signatures
+  static const int KEYS = 8; // Public keys
+  static const int PAYLOADS = 9; // Output script payloads (hashes and keys)
+  static const int AMOUNTS = 10; // Output values
+  // The rest of the header and the previous transaction hash locations depend on the blocks
+  // before, so these three are only written when the block is committed, after the others.
+  static const int CHAIN = 11; // The rest of the block header (see HeaderFlags)
+  static const int LOCATIONS = 12; // Where the previous transaction hashes are
+  static const int TX_HASHES = 13; // Previous transaction hashes that are stored in full
+  static const int COUNT = 14;
+};
+
+static const uint32_t COLUMNAR_MAGIC_NUMBER = 0x4c4f4342; // "BCOL"
+// No block's columns add up to anywhere near this. Anything bigger means the archive is corrupt.
+static const uint64_t MAX_COLUMNS_SIZE = 1 << 26;
+
+// The columns of a block being compressed
+struct BlockColumns
+{
+  BlockColumns() : counts(0) {}
+  void clear()
+  {
+    for (int c = 0; c < Column::COUNT; c++)
+      columns[c].clear();
+  }
+  ByteWriter &operator[] (int c) { return columns[c]; }
+  size_t size() const
+  {
+    size_t total = 0;
+    for (int c = 0; c < Column::COUNT; c++)
+      total += columns[c].size;
+    return total;
+  }
+
+  ByteWriter columns[Column::COUNT];
+  Stats *counts; // Where to count what is written, for --stats, or 0
+};
+
+// The columns of a block being decompressed
+struct ColumnReaders
+{
+  bool good() const
+  {
+    for (int c = 0; c < Column::COUNT; c++)
+      if (!columns[c]->good())
+        return false;
+    return true;
+  }
+  ByteReader &operator[] (int c) { return *columns[c]; }
+
+  ByteReader *columns[Column::COUNT];
+};
+
+#endif
@@ -3,229 +3,863 @@
 #ifndef COMPRESS_H
 #define COMPRESS_H
 
+#include "amount.h"
+#include "archiveindex.h"
+#include "arena.h"
 #include "block.h"
+#include "blockheader.h"
+#include "blockstream.h"
+#include "bytereader.h"
+#include "bytewriter.h"
+#include "columns.h"
+#include "externaltxhashes.h"
+#include "inputscript.h"
+#include "log.h"
+#include "mappedfile.h"
+#include "options.h"
+#include "outputscript.h"
 #include "parse.h"
+#include "pipeline.h"
+#include "rans.h"
+#include "stats.h"
+#include "streams.h"
+#include "txhashlocation.h"
+#include "txhashmap.h"
+#include "witnessstack.h"
 
 #include <algorithm>
 #include <array>
+#include <atomic>
+#include <condition_variable>
+#include <ctype.h>
 #include <fstream>
+#include <functional>
 #include <iostream>
-#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
 #include <stdint.h>
+#include <string>
+#include <string.h>
+#include <thread>
 #include <utility>
 
-std::map<std::array<uint8_t, 32>, uint32_t> txHashes;
+#include <dirent.h>
+#include <sys/stat.h>
+
+// Where previous transaction hashes are found (see TxHashLocation). These grow as blocks are
+// committed, in archive order.
+TxHashMap txIdPositions; // The number of every transaction so far in the archive, by txid
+uint32_t nTransactions = 0;
+std::vector<uint32_t> blockFirstTx; // The number of each block's first transaction
+TxHashMap txHashes; // External hashes, numbered in the order they appear
 uint32_t nextTxHashIndex = 0;
+std::vector<uint32_t> blockFirstTxHash; // The number of the first external hash of each block
+// Used instead of txIdPositions and txHashes when compressing with a memory budget
+ExternalTxHashes *externalTxHashes = 0;
+// Collects the archive's index, if there is to be one
+ArchiveIndexBuilder *indexBuilder = 0;
+// The header of the last block committed, which the next one is coded against
+HeaderContext previousHeader;
+
+// Output is collected in memory and written to the file in pieces of about this size.
+static const size_t OUTPUT_BUFFER_SIZE = 1 << 20;
 
 struct BlockOrderData
 {
-  BlockOrderData(uint32_t t, uint32_t i, std::streampos o) : time(t), index(i), offset(o) {}
-  bool operator< (const BlockOrderData &other) const { return time < other.time; }
+  BlockOrderData(uint32_t t, uint32_t i, uint64_t o) : time(t), index(i), file(0), offset(o) {}
+  // Earliest first, and in the order they are in the files when the times are the same
+  bool operator< (const BlockOrderData &other) const
+  {
+    return time != other.time ? time < other.time : index < other.index;
+  }
 
   uint32_t time, index;
-  std::streampos offset;
+  uint32_t file; // Which of the input files the block is in
+  uint64_t offset;
 };
 
-void compress(const char *inputFile, const char *outputFile);
-std::vector<BlockOrderData> preprocessDatFile(std::ifstream &fin);
-void writeBlockOrderData(std::ofstream &fout, std::vector<BlockOrderData> &vec);
-void writeCompressedBlock(std::ofstream &fout, Block *block);
-void writeCompressedBlockHeader(std::ofstream &fout, Block *block);
-void writeCompressedTransaction(std::ofstream &fout, Transaction *transaction);
-uint8_t writeCompressedTransactionFlag(std::ofstream &fout, Transaction *transaction);
-void writeCompressedTransactionHash(std::ofstream &fout, std::array<uint8_t, 32> &hash);
-void writeCompressedTransactionInput(std::ofstream &fout, Input *input, uint8_t flags);
-void writeCompressedTransactionInputCount(std::ofstream &fout, uint64_t inputCount);
-void writeCompressedTransactionLockTime(std::ofstream &fout, uint32_t lockTime, uint8_t flags);
-void writeCompressedTransactionOutput(std::ofstream &fout, Output *output);
-void writeCompressedTransactionOutputCount(std::ofstream &fout, uint64_t outputCount);
-void writeCompressedTransactionVersion(std::ofstream &fout, uint32_t version);
-void writeCompressedTransactionWitnessData(std::ofstream &fout, std::vector<Witness*> &witnesses);
-void writeTransactionHashTable(std::ofstream &fout);
-void writeVarInt(std::ofstream &fout, uint64_t val);
+// A reference to a previous transaction hash from within a CompressedBlockBuffer, in input order.
+struct TxHashRef
+{
+  std::array<uint8_t, 32> hash;
+  uint32_t transaction; // Which of the block's transactions the input is in
+};
 
-void compress(const char *inputFile, const char *outputFile)
+// A block compressed into memory by writeCompressedBlock(), minus the magic number and size.
+// The locations of the previous transaction hashes are not in data yet; they depend on every
+// block that comes before this one, so they are only worked out by commitCompressedBlock(), and
+// their columns are written after the others.
+struct CompressedBlockBuffer
 {
-  std::cout << "Compressing \'" << inputFile << "\' as \'" << outputFile << "\'" << std::endl;
+  void clear()
+  {
+    columns.clear(); data.clear(); log.str(""); txHashRefs.clear(); txIds.clear(); arena.reset();
+    if (stats)
+      blockStats = Stats();
+    columns.counts = stats ? &blockStats : 0;
+  }
+
+  const uint8_t *input; // The block to compress, from its magic number on
+  size_t inputSize; // How much can be read from input
+  std::vector<uint8_t> raw; // Holds the block, when it was read from a stream
+  uint32_t originalIndex; // Where the block is in the input, or END_OF_ARCHIVE after the last one
+  uint32_t blockSize; // As in the input, without the magic number and size
+  BlockColumns columns;
+  ByteWriter data; // The encoded columns, up to Column::CHAIN
+  std::ostringstream log; // Console output, printed when the block is committed
+  std::vector<TxHashRef> txHashRefs;
+  std::vector<std::array<uint8_t, 32>> txIds; // Of the block's transactions, in order
+  HeaderContext header;
+  uint8_t prevBlockHash[32];
+  bool merkleRootImplicit; // Whether the merkle root was left out (see HeaderFlags)
+  ByteWriter scratch;
+  Arena arena; // Holds the parsed block while it is being compressed
+  Stats blockStats; // Added to stats when the block is committed
+};
 
-  // Open inputFile as read-only, binary file
-  std::ifstream fin(inputFile, std::ifstream::in | std::ifstream::binary);
-  if (!fin.is_open())
+// Gets block i of the input into the buffer (see CompressedBlockBuffer::input)
+typedef std::function<bool(size_t, CompressedBlockBuffer&)> BlockFetcher;
+
+bool compress(const char *inputFile, const char *outputFile, const Options &options);
+bool compressStream(const char *inputFile, std::ostream &fout, const Options &options);
+bool compressBlocks(std::ostream &fout, size_t nBlocks, uint64_t totalBytes, const BlockFetcher &fetch,
+                    const Options &options);
+bool isDirectory(const char *path);
+bool isStream(const char *path);
+std::vector<std::string> listDatFiles(const char *directory);
+bool preprocessDatFile(const MappedFile &datFile, uint32_t fileIndex, std::vector<BlockOrderData> &ret);
+bool preprocessDatFiles(const std::vector<MappedFile> &datFiles, const std::vector<std::string> &fileNames,
+                        std::vector<BlockOrderData> &ret);
+void writeArchiveHeader(ByteWriter &out);
+bool commitCompressedBlock(ByteWriter &out, CompressedBlockBuffer &buffer);
+bool locateTransactionHash(const std::array<uint8_t, 32> &hash, uint32_t currentBlock, TxHashLocation &location);
+void writeColumns(ByteWriter &out, BlockColumns &columns, int first, int last, ByteWriter &scratch);
+void collectTransactionHashes(CompressedBlockBuffer &buffer, Block *block);
+void writeCompressedBlock(CompressedBlockBuffer &buffer, Block *block, const Options &options);
+void writeCompressedBlockHeader(BlockColumns &out, Block *block, bool merkleRootImplicit);
+void writeCompressedBlockHeaderChain(BlockColumns &out, const CompressedBlockBuffer &buffer, const HeaderContext &previous);
+void writeCompressedInputScript(BlockColumns &out, const uint8_t *script, uint64_t scriptLength);
+void writeCompressedOutputScript(BlockColumns &out, const uint8_t *script, uint64_t scriptLength);
+void writeCompressedTransaction(BlockColumns &out, Transaction *transaction, std::vector<TxHashRef> &txHashRefs);
+uint8_t writeCompressedTransactionFlag(BlockColumns &out, Transaction *transaction);
+void writeCompressedTransactionHash(std::array<uint8_t, 32> &hash, std::vector<TxHashRef> &txHashRefs);
+void writeCompressedTransactionInput(BlockColumns &out, Input *input, uint8_t flags, std::vector<TxHashRef> &txHashRefs);
+void writeCompressedTransactionInputCount(BlockColumns &out, uint64_t inputCount);
+void writeCompressedTransactionLockTime(BlockColumns &out, uint32_t lockTime, uint8_t flags);
+void writeCompressedTransactionOutput(BlockColumns &out, Output *output);
+void writeCompressedTransactionOutputCount(BlockColumns &out, uint64_t outputCount);
+void writeCompressedTransactionVersion(BlockColumns &out, uint32_t version);
+void writeCompressedTransactionWitnessData(BlockColumns &out, const ArenaArray<Witness*> &witnesses);
+int writeCompressedWitnessTemplate(BlockColumns &out, const ArenaArray<Witness*> &witnesses);
+void writeTransactionHashLocation(BlockColumns &out, const TxHashLocation &location, const std::array<uint8_t, 32> &hash);
+
+bool compress(const char *inputFile, const char *outputFile, const Options &options)
+{
+  std::ofstream outputFileStream;
+  std::ostream *fout = openOutput(outputFile, outputFileStream);
+  logStream(LogLevel::INFO) << "Compressing \'" << inputFile << "\' as \'" << outputFile << "\'" << std::endl;
+  if (!fout)
   {
-    std::cout << "Could not open file \'" << inputFile << "\'" << std::endl << std::endl;
+    std::cout << std::endl;
+    return false;
   }
 
-  // Open outputFile as write-only binary file
-  std::ofstream fout(outputFile, std::ofstream::out | std::ofstream::binary);
-  if (!fout.is_open())
+  // Blocks coming from a pipe or a socket are compressed as they arrive
+  if (isStream(inputFile))
   {
-    std::cout << "Could not open file \'" << outputFile << "\'" << std::endl << std::endl;
+    return compressStream(inputFile, *fout, options);
   }
 
-  // Preprocess the file
+  // The input is either a single .dat file or a directory of them (e.g. Bitcoin Core's blocks/
+  // directory). In the latter case, every blk?????.dat file goes into the same archive, in file
+  // order, and transactions can refer to transactions in earlier files.
+  std::vector<std::string> inputFiles;
+  if (isDirectory(inputFile))
+  {
+    inputFiles = listDatFiles(inputFile);
+    logStream(LogLevel::INFO) << "Found " << inputFiles.size() << " block files in \'" << inputFile << "\'" << std::endl;
+    if (inputFiles.empty())
+    {
+      std::cout << std::endl;
+      return false;
+    }
+  }
+  else
+    inputFiles.push_back(inputFile);
+
+  // Map the input files into memory. Blocks are parsed straight out of the mappings.
+  // (The vector is never resized after this, so the MappedFiles don't need to be movable.)
+  std::vector<MappedFile> datFiles(inputFiles.size());
+  for (size_t i = 0; i < inputFiles.size(); i++)
+  {
+    if (!datFiles[i].open(inputFiles[i].c_str(), FileAccess::SEQUENTIAL))
+    {
+      std::cout << std::endl;
+      return false;
+    }
+  }
+
+  // Preprocess the files
   // Build a list of (timestamp, index pairs) and sort them
-  auto orderedBlocks = preprocessDatFile(fin);
-  writeBlockOrderData(fout, orderedBlocks);
+  std::vector<BlockOrderData> orderedBlocks;
+  if (!preprocessDatFiles(datFiles, inputFiles, orderedBlocks))
+  {
+    std::cout << std::endl;
+    return false;
+  }
+
+  uint64_t totalBytes = 0;
+  for (auto &datFile : datFiles)
+    totalBytes += datFile.size;
+
+  auto fetch = [&](size_t i, CompressedBlockBuffer &buffer) -> bool
+  {
+    const BlockOrderData &blockOrderData = orderedBlocks[i];
+    const MappedFile &datFile = datFiles[blockOrderData.file];
+    buffer.input = datFile.data + blockOrderData.offset;
+    buffer.inputSize = datFile.size - blockOrderData.offset;
+    buffer.originalIndex = blockOrderData.index;
+    return true;
+  };
+  return compressBlocks(*fout, orderedBlocks.size(), totalBytes, fetch, options);
+}
+
+/* Compresses blocks from a pipe, a socket or standard input in one pass, as they arrive. Instead of
+ * being sorted by time, they go through a window of options.reorderWindow blocks (see BlockStream). */
+bool compressStream(const char *inputFile, std::ostream &fout, const Options &options)
+{
+  if (options.memoryBudget)
+  {
+    // The first pass over the blocks would use them up
+    std::cout << "A memory budget can't be used when compressing a stream" << std::endl << std::endl;
+    return false;
+  }
+
+  std::ifstream inputFileStream;
+  std::istream *in = openInput(inputFile, inputFileStream);
+  if (!in)
+  {
+    std::cout << std::endl;
+    return false;
+  }
+  BlockStream stream(*in, options.reorderWindow);
+
+  // Blocks come out of the window in archive order, so worker threads take turns getting them.
+  std::mutex readMutex;
+  std::condition_variable readTurn;
+  size_t nextRead = 0;
 
-  int nTransactions = 0;
-  int nHashes = 0;
-  // While file is still open, read a block and compress it.
-  for (auto blockOrderData : orderedBlocks)
-  //while (fin.good())
+  auto fetch = [&](size_t i, CompressedBlockBuffer &buffer) -> bool
   {
-    fin.seekg(blockOrderData.offset, std::ios_base::beg);
+    std::unique_lock<std::mutex> lock(readMutex);
+    readTurn.wait(lock, [&]() { return nextRead == i; });
+    if (!stream.next(buffer.raw, buffer.originalIndex))
+      buffer.originalIndex = END_OF_ARCHIVE;
+    buffer.input = buffer.raw.data();
+    buffer.inputSize = buffer.raw.size();
+    nextRead++;
+    readTurn.notify_all();
+    return !stream.failed;
+  };
+  return compressBlocks(fout, SIZE_MAX, 0, fetch, options);
+}
 
-    Block *block = parseBlock(fin);
+/* Compresses nBlocks blocks, in the order fetch() gets them, and writes them to fout as an archive.
+ * If there turn out to be fewer, fetch() sets the buffer's originalIndex to END_OF_ARCHIVE after
+ * the last one. */
+bool compressBlocks(std::ostream &fout, size_t nBlocks, uint64_t totalBytes, const BlockFetcher &fetch,
+                    const Options &options)
+{
+  // Parse and compress blocks on worker threads, each into a buffer of its own. The buffers are
+  // written out here, strictly in order, and that is also where the previous transaction hashes
+  // are located. This way the output is the same no matter how many threads are used.
+  size_t window = 4 * options.nThreads;
+  std::vector<CompressedBlockBuffer> buffers(window);
+
+  // Gets block i and parses it. Then it is compressed or, in the first pass over the blocks with a
+  // memory budget, only hashed (see collectTransactionHashes()).
+  auto prepare = [&](size_t i, bool encode) -> bool
+  {
+    CompressedBlockBuffer &buffer = buffers[i % window];
+    buffer.clear();
+    auto start = statsStart();
+    if (!fetch(i, buffer))
+      return false;
+    statsStop(buffer.blockStats, StatsStage::READ, start);
+    if (buffer.originalIndex == END_OF_ARCHIVE)
+      return true;
+
+    start = statsStart();
+    ByteReader in(buffer.input, buffer.inputSize);
+    Block *block = parseBlock(in, buffer.arena);
+    statsStop(buffer.blockStats, StatsStage::PARSE, start);
 
     if (!block)
     {
       std::cout << "Could not parse block. Aborting." << std::endl;
-      break;
+      return false;
     }
 
-    // Do stuff with block.
-    printBlockHeader(block);
-    std::cout << std::endl;
+    buffer.blockSize = block->size;
+    if (!encode)
+    {
+      collectTransactionHashes(buffer, block);
+      buffer.arena.reset();
+      return true;
+    }
+    if (logEnabled(LogLevel::DEBUG))
+    {
+      printBlockHeader(block, buffer.log);
+      buffer.log << std::endl;
+    }
 
-    writeCompressedBlock(fout, block);
+    if (stats)
+      countBlockFields(buffer.blockStats, block);
+    start = statsStart();
+    writeCompressedBlock(buffer, block, options);
+    statsStop(buffer.blockStats, StatsStage::ENCODE, start);
 
     // When we're done with the block, free up memory.
-    delete block;
+    buffer.arena.reset();
+    return true;
+  };
+  auto work = [&](size_t i) { return prepare(i, true); };
+
+  std::unique_ptr<ExternalTxHashes> external;
+  if (options.memoryBudget)
+  {
+    // The txids would not fit in memory. Go over the blocks once first, just to collect the
+    // txids and the hashes they reference, and work out the hashes' locations on disk.
+    logStream(LogLevel::INFO) << "Collecting transaction hashes" << std::endl;
+    external.reset(new ExternalTxHashes(options.tempDirectory, options.memoryBudget));
+    Progress hashed("Hashed", totalBytes);
+    auto hash = [&](size_t i) { return prepare(i, false); };
+    auto collect = [&](size_t i) -> bool
+    {
+      CompressedBlockBuffer &buffer = buffers[i % window];
+      hashed.update(8 + (uint64_t)buffer.blockSize);
+      size_t r = 0;
+      for (uint32_t t = 0; t < buffer.txIds.size(); t++)
+      {
+        for (; r < buffer.txHashRefs.size() && buffer.txHashRefs[r].transaction == t; r++)
+          if (!external->addReference(buffer.txHashRefs[r].hash, i))
+            return false;
+        if (!external->addTransaction(buffer.txIds[t], i))
+          return false;
+      }
+      return true;
+    };
+    if (!runOrderedPipeline(nBlocks, options.nThreads, window, hash, collect) || !external->finish())
+    {
+      std::cout << std::endl;
+      return false;
+    }
+    hashed.finish();
+    externalTxHashes = external.get();
+  }
+
+  ArchiveIndexBuilder index;
+  if (options.writeIndex)
+  {
+    if (!index.open(options.tempDirectory))
+    {
+      std::cout << std::endl;
+      return false;
+    }
+    indexBuilder = &index;
+  }
+
+  ByteWriter out;
+  writeArchiveHeader(out);
+  uint64_t bytesWritten = 0;
+  bool reachedEnd = false;
+  Progress progress("Compressed", totalBytes);
+  auto commit = [&](size_t i) -> bool
+  {
+    CompressedBlockBuffer &buffer = buffers[i % window];
+    if (buffer.originalIndex == END_OF_ARCHIVE)
+    {
+      reachedEnd = true;
+      return false;
+    }
+
+    std::cout << buffer.log.str();
+    out.put32(buffer.originalIndex);
+    if (indexBuilder)
+      indexBuilder->addBlock(bytesWritten + out.size, buffer.header, buffer.prevBlockHash);
+    auto start = statsStart();
+    if (!commitCompressedBlock(out, buffer))
+      return false;
+    statsStop(buffer.blockStats, StatsStage::COMMIT, start);
+    if (out.size >= OUTPUT_BUFFER_SIZE)
+    {
+      start = statsStart();
+      bytesWritten += out.size;
+      out.flushTo(fout);
+      statsStop(buffer.blockStats, StatsStage::WRITE, start);
+    }
+    if (stats)
+      stats->add(buffer.blockStats);
+    progress.update(8 + (uint64_t)buffer.blockSize);
+    return true;
+  };
+
+  bool ok = runOrderedPipeline(nBlocks, options.nThreads, window, work, commit) || reachedEnd;
+  if (ok)
+    out.put32(END_OF_ARCHIVE);
+  auto start = statsStart();
+  bytesWritten += out.size;
+  out.flushTo(fout);
+
+  // The index goes after the last block
+  if (ok && indexBuilder && !indexBuilder->write(fout, bytesWritten))
+  {
+    std::cout << "Could not write index" << std::endl;
+    ok = false;
   }
+  fout.flush();
+  if (ok && !fout.good())
+  {
+    std::cout << "Could not write the archive" << std::endl;
+    ok = false;
+  }
+  if (ok)
+    progress.finish();
+  if (stats)
+  {
+    statsStop(*stats, StatsStage::WRITE, start);
+    stats->indexBytes = indexBuilder ? indexBuilder->bytesWritten : 0;
+    stats->bytesOut = bytesWritten + stats->indexBytes;
+  }
+
+  externalTxHashes = 0;
+  indexBuilder = 0;
+  return ok;
+}
 
-  writeTransactionHashTable(fout);
+bool isDirectory(const char *path)
+{
+  struct stat st;
+  return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+// Whether blocks have to be read from path as they come, rather than from a file or directory
+bool isStream(const char *path)
+{
+  struct stat st;
+  return strcmp(path, "-") == 0 || (stat(path, &st) == 0 && !S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode));
 }
 
-std::vector<BlockOrderData> preprocessDatFile(std::ifstream &fin)
+std::vector<std::string> listDatFiles(const char *directory)
 {
-  std::vector<BlockOrderData> ret;
-  std::streampos startPos = fin.tellg();
-  fin.seekg(0, std::ios_base::end);
-  std::streampos endPos = fin.tellg();
-  fin.seekg(startPos, std::ios_base::beg);
+  // Bitcoin Core names its block files blk00000.dat, blk00001.dat, ...
+  // Because the numbers are zero-padded, sorting by name puts them in the order they were written.
+  std::vector<std::string> ret;
+  DIR *dir = opendir(directory);
+  if (!dir)
+  {
+    std::cout << "Could not open directory \'" << directory << "\'" << std::endl;
+    return ret;
+  }
+
+  while (struct dirent *entry = readdir(dir))
+  {
+    std::string name = entry->d_name;
+    if (name.size() == 12 && name.compare(0, 3, "blk") == 0 && name.compare(8, 4, ".dat") == 0 &&
+        std::all_of(name.begin() + 3, name.begin() + 8, ::isdigit))
+      ret.push_back(std::string(directory) + "/" + name);
+  }
+  closedir(dir);
+
+  std::sort(ret.begin(), ret.end());
+  return ret;
+}
 
-  int index = 0;
-  while (fin.tellg() < endPos)
+bool preprocessDatFile(const MappedFile &datFile, uint32_t fileIndex, std::vector<BlockOrderData> &ret)
+{
+  uint64_t pos = 0;
+  while (pos < datFile.size)
   {
-    BlockOrderData blockOrderData(0, index++, fin.tellg());
-    uint32_t magicNumber, blockSize, timestamp;
+    BlockOrderData blockOrderData(0, ret.size(), pos);
+    blockOrderData.file = fileIndex;
+    uint32_t magicNumber, blockSize;
 
     // Make sure we are pointing to the beginning of a block
-    fin.read((char*)&magicNumber, sizeof(uint32_t));
+    if (datFile.size - pos < 4)
+      memset(&magicNumber, 0, sizeof(uint32_t));
+    else
+      memcpy(&magicNumber, datFile.data + pos, sizeof(uint32_t));
+
+    // Bitcoin Core preallocates block files and fills the unused tail with zeros. That is where
+    // the blocks end.
+    if (magicNumber == 0)
+      break;
 
     if (magicNumber != Block::MAGIC_NUMBER)
     {
       std::cout << "Filestream is not pointing to a valid block" << std::endl;
       if (magicNumber == Block::MAGIC_NUMBER_REVERSE)
         std::cout << "This is likely a endianness issue" << std::endl;
-      return {};
+      return false;
     }
 
-    // Read in the size of the block
-    fin.read((char*)&blockSize, sizeof(uint32_t));
+    // Each block starts with the magic number and the size of the block, and the time stamp
+    // sits 68 bytes into the block header.
+    if (datFile.size - pos < 88)
+    {
+      std::cout << "File ends in the middle of a block" << std::endl;
+      return false;
+    }
 
-    // Skip 68 bytes, read time stamp, then skip to next block
-    fin.seekg(68, std::ios_base::cur);
-    fin.read((char*)&blockOrderData.time, sizeof(uint32_t));
-    fin.seekg(blockSize-72, std::ios_base::cur);
+    // Read in the size of the block, and its time stamp, then skip to next block
+    memcpy(&blockSize, datFile.data + pos + 4, sizeof(uint32_t));
+    memcpy(&blockOrderData.time, datFile.data + pos + 76, sizeof(uint32_t));
+    if (blockSize < 80 || blockSize > datFile.size - pos - 8)
+    {
+      std::cout << "Block size is invalid" << std::endl;
+      return false;
+    }
+    pos += 8 + (uint64_t)blockSize;
 
     ret.push_back(blockOrderData);
   }
 
+  return true;
+}
+
+bool preprocessDatFiles(const std::vector<MappedFile> &datFiles, const std::vector<std::string> &fileNames,
+                        std::vector<BlockOrderData> &ret)
+{
+  // Scanning a file only touches its block headers, so the files are scanned in parallel.
+  std::vector<std::vector<BlockOrderData>> perFile(datFiles.size());
+  std::vector<char> ok(datFiles.size(), 0);
+  std::atomic<size_t> nextFile(0);
+
+  unsigned nThreads = std::max(1u, std::min<unsigned>(std::thread::hardware_concurrency(), datFiles.size()));
+  std::vector<std::thread> threads;
+  for (unsigned t = 0; t < nThreads; t++)
+    threads.emplace_back([&]()
+    {
+      for (size_t i = nextFile++; i < datFiles.size(); i = nextFile++)
+        ok[i] = preprocessDatFile(datFiles[i], i, perFile[i]);
+    });
+  for (auto &t : threads)
+    t.join();
+
+  // Concatenate the per-file lists. A block's index is its position across all the files,
+  // i.e. its position in the files concatenated together.
+  ret.clear();
+  for (size_t i = 0; i < datFiles.size(); i++)
+  {
+    if (!ok[i])
+    {
+      std::cout << "Could not preprocess file \'" << fileNames[i] << "\'" << std::endl;
+      return false;
+    }
+    for (auto &data : perFile[i])
+    {
+      data.index = ret.size();
+      ret.push_back(data);
+    }
+  }
+
   // Sort the list of pairs
   std::sort(ret.begin(), ret.end());
 
-  // Reset ifstream
-  fin.seekg(startPos, std::ios_base::beg);
+  return true;
+}
 
-  return ret;
+// See ARCHIVE_VERSION
+void writeArchiveHeader(ByteWriter &out)
+{
+  out.put32(ARCHIVE_MAGIC_NUMBER);
+  out.put32(ARCHIVE_VERSION);
+}
+
+bool commitCompressedBlock(ByteWriter &out, CompressedBlockBuffer &buffer)
+{
+  std::vector<TxHashRef> &refs = buffer.txHashRefs;
+
+  // Locate the previous transaction hashes, one transaction after another, so that inputs can
+  // refer to earlier transactions in the same block. The worker is done with the columns, so the
+  // locations are written to theirs.
+  uint32_t currentBlock = blockFirstTx.size();
+  blockFirstTx.push_back(nTransactions);
+  blockFirstTxHash.push_back(nextTxHashIndex);
+  if (currentBlock + 1 >= TX_ID_HORIZON)
+  {
+    txIdPositions.minIndex = blockFirstTx[currentBlock + 1 - TX_ID_HORIZON];
+    txHashes.minIndex = blockFirstTxHash[currentBlock + 1 - TX_ID_HORIZON];
+  }
+  size_t r = 0;
+  for (uint32_t t = 0; t < buffer.txIds.size(); t++)
+  {
+    for (; r < refs.size() && refs[r].transaction == t; r++)
+    {
+      TxHashLocation location;
+      if (!locateTransactionHash(refs[r].hash, currentBlock, location))
+        return false;
+      writeTransactionHashLocation(buffer.columns, location, refs[r].hash);
+      if (indexBuilder && location.kind == TxHashLocation::NEW_EXTERNAL && !indexBuilder->addExternalHash(refs[r].hash))
+        return false;
+    }
+
+    // With duplicate txids, later references go to the first transaction that is still in reach.
+    bool inserted;
+    if (!externalTxHashes)
+      txIdPositions.findOrInsert(buffer.txIds[t], nTransactions, inserted);
+    nTransactions++;
+    if (indexBuilder && !indexBuilder->addTransaction(buffer.txIds[t]))
+      return false;
+  }
+
+  writeCompressedBlockHeaderChain(buffer.columns, buffer, previousHeader);
+  previousHeader = buffer.header;
+
+  // Write block header. The size is filled in once the last columns have been written.
+  out.put32(COLUMNAR_MAGIC_NUMBER);
+  size_t sizePos = out.size;
+  out.put32(0);
+  out.append(buffer.data.data, buffer.data.size);
+  writeColumns(out, buffer.columns, Column::CHAIN, Column::COUNT, buffer.scratch);
+  uint32_t size = out.size - sizePos - sizeof(uint32_t);
+  memcpy(out.data + sizePos, &size, sizeof(uint32_t));
+  return true;
 }
 
-void writeBlockOrderData(std::ofstream &fout, std::vector<BlockOrderData> &vec)
+/* Works out where a previous transaction hash can be found by the decompressor (see
+ * TxHashLocation). Hashes must be located in the order they are written. */
+bool locateTransactionHash(const std::array<uint8_t, 32> &hash, uint32_t currentBlock, TxHashLocation &location)
 {
-  // Write the number of blocks
-  uint32_t tmp = vec.size();
-  fout.write((char*)&tmp, sizeof(uint32_t));
+  uint32_t value;
+  if (externalTxHashes)
+  {
+    if (!externalTxHashes->nextReference(location.kind, value))
+    {
+      // The blocks are not the same as in the first pass
+      std::cout << "Ran out of transaction hash locations" << std::endl;
+      return false;
+    }
+  }
+  else if ((value = txIdPositions.find(hash)) != TxHashMap::EMPTY)
+    location.kind = TxHashLocation::INTERNAL;
+  else
+  {
+    // If hash is in the table of external hashes, fetch its index.
+    // Otherwise, add it to the table and assign it an index.
+    bool inserted;
+    value = txHashes.findOrInsert(hash, nextTxHashIndex, inserted);
+    if (inserted)
+      nextTxHashIndex++;
+    location.kind = inserted ? TxHashLocation::NEW_EXTERNAL : TxHashLocation::EXTERNAL;
+  }
 
-  // For each block, write the order in which they were originally encountered.
-  for (auto data : vec)
+  location.value = value;
+  location.position = 0;
+  if (location.kind == TxHashLocation::INTERNAL)
   {
-    fout.write((char*)&data.index, sizeof(uint32_t));
-    //fout.write((char*)&data.offset, sizeof(uint32_t));
+    // Find the block the transaction is in
+    uint32_t b = std::upper_bound(blockFirstTx.begin(), blockFirstTx.end(), value) - blockFirstTx.begin() - 1;
+    location.value = currentBlock - b;
+    location.position = value - blockFirstTx[b];
   }
+  return true;
 }
 
-void writeCompressedBlock(std::ofstream &fout, Block *block)
+/* Writes columns first to last - 1 (see Column). Each one is rANS coded if that makes it smaller,
+ * which it does for most columns but those of hashes, keys and signatures. */
+void writeColumns(ByteWriter &out, BlockColumns &columns, int first, int last, ByteWriter &scratch)
 {
-  std::streampos sizePos, endPos;
-  uint32_t compressedBlockSize;
+  for (int c = first; c < last; c++)
+  {
+    const ByteWriter &column = columns[c];
+    if (column.size == 0)
+    {
+      writeVarInt(out, 0);
+      continue;
+    }
+
+    // A rANS coded column is also preceded by its size in the archive, which takes up to 5 bytes
+    scratch.clear();
+    ransEncode(scratch, column.data, column.size);
+    size_t start = out.size;
+    if (scratch.size + 5 < column.size)
+    {
+      writeVarInt(out, 2 * column.size + 1);
+      writeVarInt(out, scratch.size);
+      out.append(scratch.data, scratch.size);
+    }
+    else
+    {
+      writeVarInt(out, 2 * column.size);
+      out.append(column.data, column.size);
+    }
+    if (columns.counts)
+    {
+      columns.counts->columnBytes[c] += column.size;
+      columns.counts->columnArchiveBytes[c] += out.size - start;
+    }
+  }
+}
 
-  // Write block header
-  uint32_t magicNumber = Block::MAGIC_NUMBER;
-  fout.write((char*)&magicNumber, sizeof(uint32_t));
+/* Notes the txids of the block's transactions, and the previous transaction hashes of their
+ * inputs, just as writeCompressedBlock() does, but without compressing anything. That is all the
+ * first pass over the blocks with a memory budget needs. */
+void collectTransactionHashes(CompressedBlockBuffer &buffer, Block *block)
+{
+  computeTransactionHashes(block->transactions.items, block->transactionCount, buffer.scratch);
+  for (uint32_t t = 0; t < block->transactionCount; t++)
+  {
+    Transaction *transaction = block->transactions[t];
+    for (Input *input : transaction->inputs)
+    {
+      TxHashRef ref;
+      ref.hash = input->prevTransactionHash;
+      ref.transaction = t;
+      buffer.txHashRefs.push_back(ref);
+    }
+    buffer.txIds.push_back(transaction->hash);
+  }
+}
 
-  // We would write the size of the compressed block next, but we don't know how big it is yet.
-  // Skip the next 4 bytes for now and come back later.
-  sizePos = fout.tellp();
-  fout.seekp(4, std::ios_base::cur);
+void writeCompressedBlock(CompressedBlockBuffer &buffer, Block *block, const Options &options)
+{
+  // Later transactions may refer to these by their position, so the committer needs their txids.
+  // They also give the merkle root, which is only left out if it is right.
+  computeTransactionHashes(block->transactions.items, block->transactionCount, buffer.scratch);
+  buffer.merkleRootImplicit = false;
+  if (options.dropMerkleRoots)
+  {
+    uint8_t merkleRoot[32];
+    computeMerkleRoot(block->transactions.items, block->transactionCount, merkleRoot);
+    buffer.merkleRootImplicit = memcmp(merkleRoot, block->hashMerkleRoot, 32) == 0;
+  }
 
-  writeCompressedBlockHeader(fout, block);
+  // The magic number, the size of the compressed block and the columns that depend on the blocks
+  // before are written by commitCompressedBlock().
+  BlockColumns &out = buffer.columns;
+  writeCompressedBlockHeader(out, block, buffer.merkleRootImplicit);
 
-  writeVarInt(fout, block->transactionCount);
+  writeVarInt(out[Column::COUNTS], block->transactionCount);
 
   for (Transaction * transaction : block->transactions)
   {
     // Write compressed transaction
-    writeCompressedTransaction(fout, transaction);
-  }
-  endPos = fout.tellp();
-  compressedBlockSize = (uint32_t)(endPos - sizePos) - 4;
-  // std::cout << "compressed block size = " << compressedBlockSize << std::endl;
-  fout.seekp(sizePos, std::ios_base::beg);
-  fout.write((char*)&compressedBlockSize, sizeof(uint32_t));
-  fout.seekp(endPos, std::ios_base::beg);
+    size_t firstRef = buffer.txHashRefs.size();
+    writeCompressedTransaction(out, transaction, buffer.txHashRefs);
+    for (size_t r = firstRef; r < buffer.txHashRefs.size(); r++)
+      buffer.txHashRefs[r].transaction = buffer.txIds.size();
+    buffer.txIds.push_back(std::array<uint8_t, 32>());
+  }
+  writeColumns(buffer.data, out, 0, Column::CHAIN, buffer.scratch);
+
+  buffer.header = HeaderContext(block);
+  memcpy(buffer.prevBlockHash, block->hashPrevBlock, 32);
+  for (size_t t = 0; t < buffer.txIds.size(); t++)
+    buffer.txIds[t] = block->transactions[t]->hash;
 }
 
-void writeCompressedBlockHeader(std::ofstream &fout, Block *block)
+void writeCompressedBlockHeader(BlockColumns &out, Block *block, bool merkleRootImplicit)
 {
   // The block header consists of the version number, previous block hash, merkle root, timestamp,
-  // 'bits', and nonce. There is no actual compression happening here. This is just writing the
-  // block header in the same format as in the original .dat file
-  fout.write((char*)&block->version, sizeof(uint32_t));
-
-  for (int i = 0; i < 32; i++)
-    fout.write((char*)&block->hashPrevBlock[31-i], 1);
-  for (int i = 0; i < 32; i++)
-    fout.write((char*)&block->hashMerkleRoot[31-i], 1);
-
-  fout.write((char*)&block->time, sizeof(uint32_t));
-  fout.write((char*)&block->bits, sizeof(uint32_t));
-  fout.write((char*)&block->nonce, sizeof(uint32_t));
+  // 'bits', and nonce. The merkle root and the nonce can't be predicted, so they are written as
+  // they are, unless the merkle root is to be recomputed. The rest is written by
+  // writeCompressedBlockHeaderChain().
+  if (!merkleRootImplicit)
+    out[Column::HEADERS].appendReversed(block->hashMerkleRoot, 32);
+  out[Column::HEADERS].put32(block->nonce);
+}
+
+// Writes the parts of the header that depend on the one before (see HeaderFlags).
+void writeCompressedBlockHeaderChain(BlockColumns &out, const CompressedBlockBuffer &buffer, const HeaderContext &previous)
+{
+  const HeaderContext &header = buffer.header;
+  const uint8_t *hashPrevBlock = buffer.prevBlockHash;
+  ByteWriter &chain = out[Column::CHAIN];
+  uint8_t flags = getHeaderFlags(header, hashPrevBlock, previous);
+  if (buffer.merkleRootImplicit)
+    flags |= HeaderFlags::MERKLE_ROOT_IMPLICIT;
+  chain.put8(flags);
+  if (!(flags & HeaderFlags::PREV_BLOCK_IMPLICIT))
+    chain.appendReversed(hashPrevBlock, 32);
+  if (!(flags & HeaderFlags::VERSION_SAME))
+    chain.put32(header.version);
+  if (!(flags & HeaderFlags::BITS_SAME))
+    chain.put32(header.bits);
+  writeBase128(chain, zigzagEncode(header.time - previous.time));
+}
+
+void writeCompressedInputScript(BlockColumns &out, const uint8_t *script, uint64_t scriptLength)
+{
+  // Signatures and public keys are stored as their parts, anything else as its length and the
+  // script itself (see InputScriptType).
+  size_t start = out.counts ? out.size() : 0;
+  SignatureScript parts;
+  bool matched = matchInputScript(parts, script, scriptLength);
+  if (matched)
+  {
+    writeVarInt(out[Column::SCRIPT_CODES], 2 * parts.type + (parts.hashType != SIGHASH_ALL));
+    if (parts.hashType != SIGHASH_ALL)
+      out[Column::SCRIPT_CODES].put8(parts.hashType);
+    out[Column::SIGNATURES].append(parts.rs, 64);
+    if (parts.type != InputScriptType::P2PK)
+      out[Column::KEYS].append(parts.publicKey, 33);
+  }
+  else
+  {
+    writeVarInt(out[Column::SCRIPT_CODES], N_INPUT_SCRIPT_CODES + scriptLength);
+    out[Column::SCRIPTS].append(script, scriptLength);
+  }
+  if (out.counts)
+    out.counts->inputScripts[matched ? parts.type : N_INPUT_SCRIPT_STATS - 1].add(varIntSize(scriptLength) + scriptLength, out.size() - start);
+}
+
+void writeCompressedOutputScript(BlockColumns &out, const uint8_t *script, uint64_t scriptLength)
+{
+  // Standard scripts are stored as the number of their template and their payload, anything else
+  // as its length and the script itself (see OutputScriptTemplate).
+  size_t start = out.counts ? out.size() : 0;
+  int n = findOutputScriptTemplate(script, scriptLength);
+  if (n >= 0)
+  {
+    const OutputScriptTemplate &t = OUTPUT_SCRIPT_TEMPLATES[n];
+    writeVarInt(out[Column::SCRIPT_CODES], n);
+    out[Column::PAYLOADS].append(script + t.prefixLength, t.payloadLength);
+  }
+  else
+  {
+    writeVarInt(out[Column::SCRIPT_CODES], N_OUTPUT_SCRIPT_TEMPLATES + scriptLength);
+    out[Column::SCRIPTS].append(script, scriptLength);
+  }
+  if (out.counts)
+    out.counts->outputScripts[n >= 0 ? n : N_OUTPUT_SCRIPT_TEMPLATES].add(varIntSize(scriptLength) + scriptLength,
+                                                                         out.size() - start);
 }
 
-void writeCompressedTransaction(std::ofstream &fout, Transaction *transaction)
+void writeCompressedTransaction(BlockColumns &out, Transaction *transaction, std::vector<TxHashRef> &txHashRefs)
 {
   // Write compressed version and flag info.
   // This also includes information about the lock time and sequence numbers, so we do some calculations
-  //writeCompressedTransactionVersion(fout, transaction->version);
-  uint8_t flags = writeCompressedTransactionFlag(fout, transaction);
+  //writeCompressedTransactionVersion(out, transaction->version);
+  uint8_t flags = writeCompressedTransactionFlag(out, transaction);
 
-  writeCompressedTransactionInputCount(fout, transaction->inputCount);
+  writeCompressedTransactionInputCount(out, transaction->inputCount);
   for (Input *input : transaction->inputs)
-    writeCompressedTransactionInput(fout, input, flags);
+    writeCompressedTransactionInput(out, input, flags, txHashRefs);
 
-  writeCompressedTransactionOutputCount(fout, transaction->outputCount);
+  writeCompressedTransactionOutputCount(out, transaction->outputCount);
   for (Output *output : transaction->outputs)
-    writeCompressedTransactionOutput(fout, output);
+    writeCompressedTransactionOutput(out, output);
 
   if (transaction->flag)
     for (Input *input : transaction->inputs)
-      writeCompressedTransactionWitnessData(fout, input->witnesses);
+      writeCompressedTransactionWitnessData(out, input->witnesses);
 
-  writeCompressedTransactionLockTime(fout, transaction->lockTime, flags);
+  writeCompressedTransactionLockTime(out, transaction->lockTime, flags);
 }
 
-uint8_t writeCompressedTransactionFlag(std::ofstream &fout, Transaction *transaction)
+uint8_t writeCompressedTransactionFlag(BlockColumns &out, Transaction *transaction)
 {
   // This writes not only the original flag, but also the version number and some informations
   // about the lock time and sequence numbers. The compressed flag's value is returned.
@@ -248,45 +882,34 @@ uint8_t writeCompressedTransactionFlag(std::ofstream &fout, Transaction *transac
   if (sequenceNumbers == 0xffffffff)
     flags |= SEQUENCE_NUMBERS_DEFAULT;
 
-  fout.write((char*)&flags, sizeof(uint8_t));
+  out[Column::FLAGS].put8(flags);
 
   return flags;
 }
 
-void writeCompressedTransactionHash(std::ofstream &fout, std::array<uint8_t, 32> &hash)
+void writeCompressedTransactionHash(std::array<uint8_t, 32> &hash, std::vector<TxHashRef> &txHashRefs)
 {
-  // If hash is in the table of transactions hashes, fetch its index.
-  // Otherwise, add it to the table and assign it an index.
-  uint32_t index;
-  if (txHashes.count(hash))
-    index = txHashes[hash];
-  else
-    index = txHashes[hash] = nextTxHashIndex++;
-
-  //char *start = (char*)hash.data();
-  //char *ptr = start + 32;
-  //while (ptr > start)
-  //  fout.write(--ptr, sizeof(uint8_t));
-
-  fout.write((char*)&index, sizeof(uint32_t));
+  // Where this hash can be found depends on the blocks before this one, which may still be in the
+  // middle of being compressed. Just note it; commitCompressedBlock() works out its location and
+  // writes it.
+  TxHashRef ref;
+  ref.hash = hash;
+  txHashRefs.push_back(ref);
 }
 
-void writeCompressedTransactionInput(std::ofstream &fout, Input *input, uint8_t flags)
+void writeCompressedTransactionInput(BlockColumns &out, Input *input, uint8_t flags, std::vector<TxHashRef> &txHashRefs)
 {
   static const uint8_t SEQUENCE_NUMBERS_DEFAULT = 0x8;
 
   // Compress and write previous transaction hash
-  writeCompressedTransactionHash(fout, input->prevTransactionHash);
+  writeCompressedTransactionHash(input->prevTransactionHash, txHashRefs);
 
   // Compress and write previous transaction index
   // This was originally a 32-bit integer. Now we use a varint
-  writeVarInt(fout, input->prevTransactionIndex);
-  //fout.write((char*)&input->prevTransactionIndex, sizeof(uint32_t));
+  writeVarInt(out[Column::PREV_INDICES], input->prevTransactionIndex);
 
   // Compress and write script length + script
-  writeVarInt(fout, input->scriptLength);
-  for (int i = 0; i < input->scriptLength; i++)
-    fout.write((char*)&input->script[i], 1);
+  writeCompressedInputScript(out, input->script, input->scriptLength);
 
   // Compress and write sequence number
   // Because the difference between the sequence numbers and 0xffffffff is usually small,
@@ -294,106 +917,150 @@ void writeCompressedTransactionInput(std::ofstream &fout, Input *input, uint8_t
   if (!(flags & SEQUENCE_NUMBERS_DEFAULT))
   {
     uint64_t tmp = input->sequenceNumber ^ 0xffffffff;
-    writeVarInt(fout, tmp);
+    writeVarInt(out[Column::SEQUENCES], tmp);
   }
 }
 
-void writeCompressedTransactionInputCount(std::ofstream &fout, uint64_t inputCount)
+void writeCompressedTransactionInputCount(BlockColumns &out, uint64_t inputCount)
 {
   // This was originally stored as a varint, which is probably good enough for us
-  writeVarInt(fout, inputCount);
+  writeVarInt(out[Column::COUNTS], inputCount);
 }
 
-void writeCompressedTransactionLockTime(std::ofstream &fout, uint32_t lockTime, uint8_t flags)
+void writeCompressedTransactionLockTime(BlockColumns &out, uint32_t lockTime, uint8_t flags)
 {
   static const uint8_t LOCK_TIME_DEFAULT = 0x4;
   if (!(flags & LOCK_TIME_DEFAULT))
-    fout.write((char*)&lockTime, sizeof(uint32_t));
+    out[Column::SEQUENCES].put32(lockTime);
 }
 
-void writeCompressedTransactionOutput(std::ofstream &fout, Output *output)
+void writeCompressedTransactionOutput(BlockColumns &out, Output *output)
 {
   // Compress and write value (number of Satoshis/BTC to be sent)
-  //fout.write((char*)&output->value, sizeof(uint64_t));
-  writeVarInt(fout, output->value);
+  // The compressed amount is written one higher, so that 0 can stand for a value that is too big
+  // to be compressed. Those are written in full. (They are not valid, but are still kept intact.)
+  if (output->value <= MAX_MONEY)
+    writeBase128(out[Column::AMOUNTS], 1 + compressAmount(output->value));
+  else
+  {
+    writeBase128(out[Column::AMOUNTS], 0);
+    out[Column::AMOUNTS].put64(output->value);
+  }
 
   // Compress and write script length + script.
-  writeVarInt(fout, output->scriptLength);
-  for (int i = 0; i < output->scriptLength; i++)
-    fout.write((char*)&output->script[i], 1);
+  writeCompressedOutputScript(out, output->script, output->scriptLength);
 }
 
-void writeCompressedTransactionOutputCount(std::ofstream &fout, uint64_t outputCount)
+void writeCompressedTransactionOutputCount(BlockColumns &out, uint64_t outputCount)
 {
   // This was originally stored as a varint, which is probably good enough for us
-  writeVarInt(fout, outputCount);
+  writeVarInt(out[Column::COUNTS], outputCount);
 }
 
-void writeCompressedTransactionVersion(std::ofstream &fout, uint32_t version)
+void writeCompressedTransactionVersion(BlockColumns &out, uint32_t version)
 {
   // Originally stored as a 32-bit integer.
   // A single byte is probably enough.
-  uint8_t cVersion = (uint8_t)version;
-  fout.write((char*)&cVersion, sizeof(uint8_t));
+  out[Column::FLAGS].put8((uint8_t)version);
 
   // This could even be combined with the transaction flag.
 }
 
-void writeCompressedTransactionWitnessData(std::ofstream &fout, std::vector<Witness*> &witnesses)
+void writeCompressedTransactionWitnessData(BlockColumns &out, const ArenaArray<Witness*> &witnesses)
 {
-  writeVarInt(fout, witnesses.size());
-  for (Witness *w : witnesses)
+  // Witnesses of the common shapes are stored as their parts, anything else item by item (see
+  // WitnessStackType).
+  size_t start = out.counts ? out.size() : 0;
+  int type = writeCompressedWitnessTemplate(out, witnesses);
+  if (type < 0)
+  {
+    writeVarInt(out[Column::SCRIPT_CODES], N_WITNESS_CODES + witnesses.size());
+    for (Witness *w : witnesses)
+    {
+      writeVarInt(out[Column::COUNTS], w->size);
+      out[Column::SCRIPTS].append(w->data, w->size);
+    }
+  }
+
+  if (out.counts)
   {
-    writeVarInt(fout, w->size);
-    for (uint8_t byte : w->data)
-      fout.write((char*)&byte, 1);
+    uint64_t bytesIn = varIntSize(witnesses.size());
+    for (Witness *w : witnesses)
+      bytesIn += varIntSize(w->size) + w->size;
+    out.counts->witnesses[type < 0 ? N_WITNESS_STATS - 1 : type / 2].add(bytesIn, out.size() - start);
   }
 }
 
-void writeTransactionHashTable(std::ofstream &fout)
+// Writes the witness if it has one of the shapes in WitnessStackType, and returns which one, or -1
+// if it has none of them.
+int writeCompressedWitnessTemplate(BlockColumns &out, const ArenaArray<Witness*> &witnesses)
 {
-  // Put hashes into a vector of index-hash pairs
-  std::vector<std::pair<uint32_t, std::array<uint8_t, 32>>> vec;
-  for (auto pr : txHashes)
-    vec.push_back(std::make_pair(pr.second, pr.first));
-  std::sort(vec.begin(), vec.end());
+  size_t nItems = witnesses.size();
+  uint8_t rs[16][64], hashTypes[16];
 
-  // Write number of hashes
-  uint32_t nTxHashes = vec.size();
-  fout.write((char*)&nTxHashes, sizeof(uint32_t));
+  if (nItems == 2 && witnesses[1]->size == 33 && splitWitnessSignature(witnesses[0], rs[0], hashTypes[0]))
+  {
+    writeVarInt(out[Column::SCRIPT_CODES], WitnessStackType::P2WPKH + (hashTypes[0] != SIGHASH_ALL));
+    if (hashTypes[0] != SIGHASH_ALL)
+      out[Column::SCRIPT_CODES].put8(hashTypes[0]);
+    out[Column::SIGNATURES].append(rs[0], 64);
+    out[Column::KEYS].append(witnesses[1]->data, 33);
+    return WitnessStackType::P2WPKH;
+  }
 
-  // Write hashes
-  for (auto pr : vec)
-    for (int i = 31; i >= 0; i--)
-      fout.write((char*)(pr.second.data() + i), sizeof(uint8_t));
-}
+  if (nItems == 1 && (witnesses[0]->size == 64 || witnesses[0]->size == 65))
+  {
+    writeVarInt(out[Column::SCRIPT_CODES], WitnessStackType::TAPROOT + (witnesses[0]->size == 65));
+    out[Column::SIGNATURES].append(witnesses[0]->data, witnesses[0]->size);
+    return WitnessStackType::TAPROOT;
+  }
 
-void writeVarInt(std::ofstream &fout, uint64_t val)
-{
-  if (val < 0xfd)
+  int m, n;
+  if (nItems >= 3 && witnesses[0]->size == 0 && matchMultisigScript(witnesses[nItems - 1], m, n) && nItems == (size_t)m + 2)
   {
-    uint8_t tmp = val & 0xff;
-    fout.write((char*)&tmp, sizeof(uint8_t));
+    // Every signature has to be split up before anything is written
+    bool allDefault = true;
+    for (int k = 0; k < m; k++)
+    {
+      if (!splitWitnessSignature(witnesses[1 + k], rs[k], hashTypes[k]))
+        return -1;
+      allDefault = allDefault && hashTypes[k] == SIGHASH_ALL;
+    }
+
+    writeVarInt(out[Column::SCRIPT_CODES], WitnessStackType::MULTISIG + !allDefault);
+    out[Column::SCRIPT_CODES].put8((m - 1) << 4 | (n - 1));
+    for (int k = 0; k < m; k++)
+    {
+      if (!allDefault)
+        out[Column::SCRIPT_CODES].put8(hashTypes[k]);
+      out[Column::SIGNATURES].append(rs[k], 64);
+    }
+    const Witness *script = witnesses[nItems - 1];
+    for (int k = 0; k < n; k++)
+      out[Column::KEYS].append(script->data + 2 + 34 * k, 33);
+    return WitnessStackType::MULTISIG;
   }
-  else if (val < 0x10000)
+
+  return -1;
+}
+
+void writeTransactionHashLocation(BlockColumns &out, const TxHashLocation &location, const std::array<uint8_t, 32> &hash)
+{
+  ByteWriter &locations = out[Column::LOCATIONS];
+  if (location.kind == TxHashLocation::NEW_EXTERNAL)
   {
-    uint8_t byte = 0xfd;
-    uint16_t tmp = val & 0xffff;
-    fout.write((char*)&byte, sizeof(uint8_t));
-    fout.write((char*)&tmp, sizeof(uint16_t));
+    writeVarInt(locations, TxHashLocation::NEW_EXTERNAL);
+    out[Column::TX_HASHES].appendReversed(hash.data(), 32);
   }
-  else if (val < 0x100000000)
+  else if (location.kind == TxHashLocation::EXTERNAL)
   {
-    uint8_t byte = 0xfe;
-    uint32_t tmp = val & 0xffffffff;
-    fout.write((char*)&byte, sizeof(uint8_t));
-    fout.write((char*)&tmp, sizeof(uint32_t));
+    writeVarInt(locations, TxHashLocation::EXTERNAL);
+    writeVarInt(locations, location.value);
   }
   else
   {
-    uint8_t byte = 0xff;
-    fout.write((char*)&byte, sizeof(uint8_t));
-    fout.write((char*)&val, sizeof(uint64_t));
+    writeVarInt(locations, TxHashLocation::INTERNAL + location.value);
+    writeVarInt(locations, location.position);
   }
 }
 
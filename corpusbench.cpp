@@ -0,0 +1,383 @@
+// corpusbench.cpp
+
+#include "compress.h"
+#include "mappedfile.h"
+#include "options.h"
+
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <string.h>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* Benchmarks btcompress end to end over a corpus of block files. Each file or directory given is
+ * compressed and decompressed by running btcompress, the way it is run by hand, and the result
+ * must come back byte for byte. (A directory goes into a single archive, and comes back as its
+ * blk?????.dat files one after another, without the zeros at their ends.) The report has a row
+ * for each one, and a total, as CSV or JSON, so that reports from different builds or settings
+ * can be diffed. Built by `make corpusbench`. */
+
+// What was measured for one file or directory
+struct CorpusRun
+{
+  CorpusRun() : blocks(0), transactions(0), inputBytes(0), compressedBytes(0), compressSeconds(0),
+                decompressSeconds(0), compressPeakRss(0), decompressPeakRss(0), roundTrip(false) {}
+
+  std::string name;
+  uint64_t blocks, transactions;
+  uint64_t inputBytes; // Of blocks, not counting the zeros that end a block file
+  uint64_t compressedBytes;
+  double compressSeconds, decompressSeconds; // Wall clock
+  long compressPeakRss, decompressPeakRss; // In kilobytes
+  bool roundTrip; // Whether decompressing gave back exactly the input
+};
+
+bool benchmarkCorpus(const std::string &input, const std::string &btcompress, const std::vector<std::string> &args,
+                     const std::string &tempDirectory, CorpusRun &run);
+bool runBtcompress(const std::vector<std::string> &argv, double &seconds, long &peakRss);
+bool scanDatFile(const MappedFile &datFile, uint64_t &end, uint64_t &blocks, uint64_t &transactions);
+bool compareOutput(const std::vector<std::string> &inputFiles, const std::string &outputFile);
+uint64_t fileSize(const std::string &file);
+void writeReport(std::ostream &out, const std::vector<CorpusRun> &runs, bool json);
+std::string quoteField(const std::string &value, bool json);
+void printUsage();
+
+int main(int argc, char *argv[])
+{
+  std::string btcompress = "./btcompress", reportFile;
+  std::vector<std::string> args;
+  bool json = false;
+  Options options; // Only for the temporary directory
+
+  int i = 1;
+  for (; i < argc; i++)
+  {
+    if (strcmp(argv[i], "-b") == 0 && i + 1 < argc)
+      btcompress = argv[++i];
+    else if (strcmp(argv[i], "-a") == 0 && i + 1 < argc)
+    {
+      // Options for btcompress, as one argument
+      std::istringstream words(argv[++i]);
+      std::string word;
+      while (words >> word)
+        args.push_back(word);
+    }
+    else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+      reportFile = argv[++i];
+    else if (strcmp(argv[i], "-json") == 0)
+      json = true;
+    else if (strcmp(argv[i], "-T") == 0 && i + 1 < argc)
+      options.tempDirectory = argv[++i];
+    else
+      break;
+  }
+  if (i == argc)
+  {
+    printUsage();
+    return 1;
+  }
+
+  std::vector<CorpusRun> runs;
+  bool ok = true;
+  for (; i < argc; i++)
+  {
+    CorpusRun run;
+    if (!benchmarkCorpus(argv[i], btcompress, args, options.tempDirectory, run))
+      return 1;
+    ok = ok && run.roundTrip;
+    runs.push_back(run);
+  }
+
+  if (reportFile.empty())
+    writeReport(std::cout, runs, json);
+  else
+  {
+    std::ofstream out(reportFile.c_str());
+    writeReport(out, runs, json);
+    if (!out.good())
+    {
+      std::cout << "Could not write \'" << reportFile << "\'" << std::endl;
+      return 1;
+    }
+  }
+  return ok ? 0 : 2;
+}
+
+// Compresses input and decompresses it again, in the temporary directory.
+bool benchmarkCorpus(const std::string &input, const std::string &btcompress, const std::vector<std::string> &args,
+                     const std::string &tempDirectory, CorpusRun &run)
+{
+  run.name = input;
+  std::vector<std::string> inputFiles;
+  if (isDirectory(input.c_str()))
+    inputFiles = listDatFiles(input.c_str());
+  else
+    inputFiles.push_back(input);
+  if (inputFiles.empty())
+  {
+    std::cout << "No block files in \'" << input << "\'" << std::endl;
+    return false;
+  }
+
+  for (auto &inputFile : inputFiles)
+  {
+    MappedFile datFile;
+    uint64_t end;
+    if (!datFile.open(inputFile.c_str(), FileAccess::SEQUENTIAL) || !scanDatFile(datFile, end, run.blocks, run.transactions))
+    {
+      std::cout << "Could not read blocks from \'" << inputFile << "\'" << std::endl;
+      return false;
+    }
+    run.inputBytes += end;
+  }
+
+  std::string base = tempDirectory + "/btcompress-corpusbench-" + std::to_string(getpid());
+  std::string archive = base + ".btc", output = base + ".out";
+
+  std::vector<std::string> argv(1, btcompress);
+  argv.push_back("-c");
+  argv.insert(argv.end(), args.begin(), args.end());
+  argv.push_back(input);
+  argv.push_back(archive);
+  bool ok = runBtcompress(argv, run.compressSeconds, run.compressPeakRss);
+  run.compressedBytes = fileSize(archive);
+
+  argv.assign(1, btcompress);
+  argv.push_back("-d");
+  argv.push_back(archive);
+  argv.push_back(output);
+  ok = ok && runBtcompress(argv, run.decompressSeconds, run.decompressPeakRss);
+  run.roundTrip = ok && compareOutput(inputFiles, output);
+  if (!run.roundTrip)
+    std::cout << "\'" << input << "\' did not survive the round trip" << std::endl;
+
+  remove(archive.c_str());
+  remove(output.c_str());
+  return true;
+}
+
+// Runs btcompress, with its console output and progress line thrown away, and measures it.
+// Returns false if it couldn't be run or didn't exit normally.
+bool runBtcompress(const std::vector<std::string> &argv, double &seconds, long &peakRss)
+{
+  std::vector<char*> cArgv;
+  for (auto &arg : argv)
+    cArgv.push_back((char*)arg.c_str());
+  cArgv.push_back(0);
+
+  typedef std::chrono::steady_clock Clock;
+  Clock::time_point start = Clock::now();
+  pid_t pid = fork();
+  if (pid < 0)
+  {
+    std::cout << "Could not start \'" << argv[0] << "\'" << std::endl;
+    return false;
+  }
+  if (pid == 0)
+  {
+    int devNull = open("/dev/null", O_WRONLY);
+    dup2(devNull, STDOUT_FILENO);
+    dup2(devNull, STDERR_FILENO);
+    execv(cArgv[0], cArgv.data());
+    _exit(127);
+  }
+
+  int status;
+  struct rusage usage;
+  if (wait4(pid, &status, 0, &usage) != pid)
+    return false;
+  seconds = std::chrono::duration<double>(Clock::now() - start).count();
+  peakRss = usage.ru_maxrss;
+  if (!WIFEXITED(status) || WEXITSTATUS(status) == 127)
+  {
+    std::cout << "\'" << argv[0] << "\' failed" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// Counts the blocks and transactions in a block file, and finds where its blocks end
+bool scanDatFile(const MappedFile &datFile, uint64_t &end, uint64_t &blocks, uint64_t &transactions)
+{
+  uint64_t pos = 0;
+  while (datFile.size - pos >= 4)
+  {
+    uint32_t magicNumber, blockSize;
+    memcpy(&magicNumber, datFile.data + pos, sizeof(uint32_t));
+    if (magicNumber == 0)
+      break;
+    if (magicNumber != Block::MAGIC_NUMBER || datFile.size - pos < 89)
+      return false;
+    memcpy(&blockSize, datFile.data + pos + 4, sizeof(uint32_t));
+    if (blockSize < 81 || blockSize > datFile.size - pos - 8)
+      return false;
+
+    ByteReader in(datFile.data + pos + 88, blockSize - 80);
+    transactions += readVarInt(in);
+    blocks++;
+    pos += 8 + (uint64_t)blockSize;
+  }
+  end = pos;
+  return true;
+}
+
+// Whether outputFile holds the blocks of inputFiles, one file after another
+bool compareOutput(const std::vector<std::string> &inputFiles, const std::string &outputFile)
+{
+  MappedFile output;
+  if (!output.open(outputFile.c_str(), FileAccess::SEQUENTIAL))
+    return false;
+
+  uint64_t pos = 0;
+  for (auto &inputFile : inputFiles)
+  {
+    MappedFile datFile;
+    uint64_t end, blocks = 0, transactions = 0;
+    if (!datFile.open(inputFile.c_str(), FileAccess::SEQUENTIAL) || !scanDatFile(datFile, end, blocks, transactions))
+      return false;
+    if (output.size - pos < end || memcmp(output.data + pos, datFile.data, end) != 0)
+      return false;
+    pos += end;
+  }
+  return pos == output.size;
+}
+
+uint64_t fileSize(const std::string &file)
+{
+  struct stat st;
+  return stat(file.c_str(), &st) == 0 ? st.st_size : 0;
+}
+
+void writeReport(std::ostream &out, const std::vector<CorpusRun> &runs, bool json)
+{
+  // The total is a run of its own, with the peak of the peaks
+  std::vector<CorpusRun> rows = runs;
+  CorpusRun total;
+  total.name = "total";
+  total.roundTrip = true;
+  for (auto &run : runs)
+  {
+    total.blocks += run.blocks;
+    total.transactions += run.transactions;
+    total.inputBytes += run.inputBytes;
+    total.compressedBytes += run.compressedBytes;
+    total.compressSeconds += run.compressSeconds;
+    total.decompressSeconds += run.decompressSeconds;
+    total.compressPeakRss = std::max(total.compressPeakRss, run.compressPeakRss);
+    total.decompressPeakRss = std::max(total.decompressPeakRss, run.decompressPeakRss);
+    total.roundTrip = total.roundTrip && run.roundTrip;
+  }
+  rows.push_back(total);
+
+  static const char *fields[] = { "name", "blocks", "transactions", "input_bytes", "compressed_bytes", "ratio",
+                                  "bytes_per_tx", "compress_seconds", "compress_mb_per_s", "compress_peak_rss_kb",
+                                  "decompress_seconds", "decompress_mb_per_s", "decompress_peak_rss_kb",
+                                  "round_trip" };
+  static const int nFields = sizeof(fields) / sizeof(fields[0]);
+
+  out << std::fixed;
+  if (json)
+    out << "[" << std::endl;
+  else
+  {
+    for (int f = 0; f < nFields; f++)
+      out << (f ? "," : "") << fields[f];
+    out << std::endl;
+  }
+
+  for (size_t r = 0; r < rows.size(); r++)
+  {
+    const CorpusRun &run = rows[r];
+    std::ostringstream values[nFields];
+    for (int f = 0; f < nFields; f++)
+      values[f] << std::fixed;
+    values[0] << quoteField(run.name, json);
+    values[1] << run.blocks;
+    values[2] << run.transactions;
+    values[3] << run.inputBytes;
+    values[4] << run.compressedBytes;
+    values[5] << std::setprecision(4) << (run.compressedBytes ? (double)run.inputBytes / run.compressedBytes : 0);
+    values[6] << std::setprecision(2) << (run.transactions ? (double)run.compressedBytes / run.transactions : 0);
+    values[7] << std::setprecision(3) << run.compressSeconds;
+    values[8] << std::setprecision(2) << (run.compressSeconds ? run.inputBytes / run.compressSeconds / 1e6 : 0);
+    values[9] << run.compressPeakRss;
+    values[10] << std::setprecision(3) << run.decompressSeconds;
+    values[11] << std::setprecision(2) << (run.decompressSeconds ? run.inputBytes / run.decompressSeconds / 1e6 : 0);
+    values[12] << run.decompressPeakRss;
+    values[13] << (run.roundTrip ? "true" : "false");
+
+    if (json)
+    {
+      out << "  {";
+      for (int f = 0; f < nFields; f++)
+        out << (f ? ", " : "") << "\"" << fields[f] << "\": " << values[f].str();
+      out << "}" << (r + 1 < rows.size() ? "," : "") << std::endl;
+    }
+    else
+    {
+      for (int f = 0; f < nFields; f++)
+        out << (f ? "," : "") << values[f].str();
+      out << std::endl;
+    }
+  }
+
+  if (json)
+    out << "]" << std::endl;
+}
+
+/* Names are paths, which may have anything in them. For JSON, a name is a string, with quotes,
+ * backslashes and control characters escaped. For CSV, a name with a comma, a quote or a line break
+ * in it is put in quotes, with its quotes doubled (as in RFC 4180). */
+std::string quoteField(const std::string &value, bool json)
+{
+  std::string quoted;
+  if (json)
+  {
+    quoted = "\"";
+    for (unsigned char c : value)
+    {
+      if (c == '"' || c == '\\')
+        quoted += std::string("\\") + (char)c;
+      else if (c < 0x20)
+      {
+        char escape[8];
+        snprintf(escape, sizeof(escape), "\\u%04x", c);
+        quoted += escape;
+      }
+      else
+        quoted += c;
+    }
+    return quoted + "\"";
+  }
+
+  if (value.find_first_of(",\"\r\n") == std::string::npos)
+    return value;
+  quoted = "\"";
+  for (char c : value)
+    quoted += c == '"' ? std::string("\"\"") : std::string(1, c);
+  return quoted + "\"";
+}
+
+void printUsage()
+{
+  std::cout << "Usage: btcompress-corpusbench [options] input [input...]" << std::endl;
+  std::cout << "Each input is a block file, or a directory of them that is compressed as one archive." << std::endl;
+  std::cout << "Exits with 2 if any input does not come back exactly as it was." << std::endl;
+  std::cout << std::endl;
+  std::cout << "Options:" << std::endl;
+  std::cout << "\t-b path\t\tThe btcompress to run (./btcompress by default)" << std::endl;
+  std::cout << "\t-a \"args\"\tOptions to compress with, e.g. \"-r -j 4\"" << std::endl;
+  std::cout << "\t-o file\t\tWrite the report to file instead of the console" << std::endl;
+  std::cout << "\t-json\t\tWrite the report as JSON instead of CSV" << std::endl;
+  std::cout << "\t-T dir\t\tPut the archive and the decompressed blocks in dir (default $TMPDIR, or /tmp)" << std::endl;
+}
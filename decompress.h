@@ -3,274 +3,834 @@
 #ifndef DECOMPRESS_H
 #define DECOMPRESS_H
 
+#include "arena.h"
 #include "block.h"
+#include "blockheader.h"
+#include "bytereader.h"
+#include "bytewriter.h"
+#include "log.h"
+#include "options.h"
 #include "parse.h"
-#include "compress.h" // writeVarInt
+#include "pendingblocks.h"
+#include "pipeline.h"
+#include "spillfile.h"
+#include "stats.h"
+#include "streams.h"
 
 #include <algorithm>
+#include <condition_variable>
+#include <deque>
 #include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
 #include <stdint.h>
+#include <string>
+#include <string.h>
 #include <utility>
 
-std::vector<std::array<uint8_t, 32>> txHashTable;
+#include <sys/stat.h>
 
-struct CompressedBlockOrderData
+typedef std::vector<std::array<uint8_t, 32>> HashList;
+
+// The txids of a block that has been (or is being) decompressed, and the external hashes stored in it
+struct DecodedBlock
 {
-  bool operator< (const CompressedBlockOrderData &other) const { return index < other.index; }
-  uint32_t compressedIndex; // The index of the block in the compressed file
-  uint32_t index; // The index of the block in the original .dat file
-  std::streampos offset; // The offset in bytes of the block from the beginning of the compressed file.
+  std::shared_ptr<HashList> hashes; // The txids, in order, then the external hashes, or 0 if spilled
+  uint64_t nTransactions;
+  size_t nHashed; // How many of the txids have been computed so far
+  uint64_t firstExternal; // The number of the first external hash stored in the block
+  uint64_t nExternal;
+  uint64_t offset; // Where the hashes are in decodedSpillFile, once they have been spilled
 };
 
-void decompress(const char *inputFile, const char *outputFile);
-std::vector<CompressedBlockOrderData> preprocessCompressedFile(std::ifstream &fin);
-void writeDecompressedBlock(std::ofstream &fout, Block *block);
-void writeDecompressedBlockHeader(std::ofstream &fout, Block *block);
-void writeDecompressedTransaction(std::ofstream &fout, Transaction *transaction);
-void writeDecompressedTransactionFlag(std::ofstream &fout, bool flag);
-void writeDecompressedTransactionInput(std::ofstream &fout, Input *input);
-void writeDecompressedTransactionInputCount(std::ofstream &fout, uint64_t inputCount);
-void writeDecompressedTransactionLockTime(std::ofstream &fout, uint32_t lockTime);
-void writeDecompressedTransactionOutput(std::ofstream &fout, Output *output);
-void writeDecompressedTransactionOutputCount(std::ofstream &fout, uint64_t outputCount);
-void writeDecompressedTransactionVersion(std::ofstream &fout, uint32_t version);
-void writeDecompressedTransactionWitnessData(std::ofstream &fout, std::vector<Witness*> &witnesses);
-
-void decompress(const char *inputFile, const char *outputFile)
+/* What previous transaction hashes are resolved against (see TxHashLocation). Blocks are added in
+ * the order they are in the archive, but are hashed by whichever worker thread decompresses them,
+ * at the same time as other blocks. So all of this is guarded by decodedMutex, except the hashes
+ * of a block, which can be read without it once nHashed says they have been computed.
+ * Blocks that are out of reach of the ones still to come (see TX_ID_HORIZON) are dropped from the
+ * front. With -m, the hashes of the oldest blocks that have been written out are moved to
+ * decodedSpillFile once those of all the blocks take more than decodedMemoryLimit. */
+std::deque<DecodedBlock> decodedBlocks; // Elements stay put as more are added
+uint64_t firstDecodedBlock = 0; // The index in the archive of the first of decodedBlocks
+uint64_t firstUnspilledBlock = 0; // The index in the archive of the first block whose hashes are in memory
+uint64_t nDecodedExternal = 0; // The number of external hashes so far
+SpillFile *decodedSpillFile = 0;
+size_t decodedMemoryLimit = SIZE_MAX;
+size_t decodedMemoryUsed = 0; // By the hashes that are in memory
+std::mutex decodedMutex;
+std::condition_variable decodedChanged; // Notified when a block is added, or more of it is hashed
+bool decodeFailed = false; // Set when a block can't be decompressed, so nothing waits for it
+HeaderContext decodedPreviousHeader; // What the next block's header is coded against
+
+// No block is anywhere near this big. Anything bigger means the archive is corrupt.
+static const uint32_t MAX_COMPRESSED_BLOCK_SIZE = 1 << 26;
+
+// A block decompressed into memory by a worker thread, waiting to be written out.
+struct DecompressedBlockBuffer
 {
-  std::cout << "Decompressing \'" << inputFile << "\' as \'" << outputFile << "\'" << std::endl;
-
-  // Open inputFile as read-only, binary file
-  std::ifstream fin(inputFile, std::ifstream::in | std::ifstream::binary);
-  if (!fin.is_open())
+  void clear()
   {
-    std::cout << "Could not open file \'" << inputFile << "\'" << std::endl << std::endl;
+    block = 0; problem = 0; locations.clear(); data.clear(); log.str(""); arena.reset();
+    if (stats)
+      blockStats = Stats();
   }
 
-  // Open outputFile as write-only binary file
-  std::ofstream fout(outputFile, std::ofstream::out | std::ofstream::binary);
-  if (!fout.is_open())
+  uint32_t originalIndex; // Where the block was in the original input, or END_OF_ARCHIVE
+  std::vector<uint8_t> compressed; // The compressed block, which the parsed block points into
+  Block *block;
+  uint8_t headerFlags; // What is missing from the block header (see resolveBlockHeader())
+  const char *problem; // When verifying, what verifyTransactions() found wrong with the block, or 0
+  std::vector<TxHashLocation> locations; // Where to find the previous transaction hash of each input
+  ByteWriter data;
+  std::ostringstream log; // Console output, printed when the block is written
+  Arena arena; // Holds the parsed block while it is being decompressed
+  Stats blockStats; // Added to stats when the block is written
+};
+
+bool decompress(const char *inputFile, const char *outputFile, const Options &options);
+bool verify(const char *inputFile, const Options &options);
+bool decompressBlocks(std::istream &in, std::ostream *out, uint64_t totalBytes, const Options &options);
+uint64_t archiveSize(const char *inputFile);
+const char *verifyTransactions(Block *block, uint8_t headerFlags, ByteWriter &scratch);
+bool readCompressedBlock(std::istream &in, std::vector<uint8_t> &compressed);
+bool addDecodedBlock(uint64_t index, Block *block, const std::vector<TxHashLocation> &locations);
+bool resolveTransactionHashes(uint64_t index, Block *block, const std::vector<TxHashLocation> &locations, ByteWriter &scratch);
+bool readDecodedHash(const HashList *hashes, uint64_t offset, uint64_t n, std::array<uint8_t, 32> &hash);
+void abandonDecodedBlocks();
+void evictDecodedBlocks(uint64_t end);
+bool spillDecodedBlocks(uint64_t end);
+void writeDecompressedBlock(ByteWriter &out, Block *block);
+void writeDecompressedBlockHeader(ByteWriter &out, Block *block);
+void writeDecompressedTransaction(ByteWriter &out, Transaction *transaction);
+void writeDecompressedTransactionFlag(ByteWriter &out, bool flag);
+void writeDecompressedTransactionInput(ByteWriter &out, Input *input);
+void writeDecompressedTransactionInputCount(ByteWriter &out, uint64_t inputCount);
+void writeDecompressedTransactionLockTime(ByteWriter &out, uint32_t lockTime);
+void writeDecompressedTransactionOutput(ByteWriter &out, Output *output);
+void writeDecompressedTransactionOutputCount(ByteWriter &out, uint64_t outputCount);
+void writeDecompressedTransactionVersion(ByteWriter &out, uint32_t version);
+void writeDecompressedTransactionWitnessData(ByteWriter &out, const ArenaArray<Witness*> &witnesses);
+
+bool decompress(const char *inputFile, const char *outputFile, const Options &options)
+{
+  std::ifstream inputFileStream;
+  std::ofstream outputFileStream;
+  std::istream *in = openInput(inputFile, inputFileStream);
+  std::ostream *out = in ? openOutput(outputFile, outputFileStream) : 0;
+  logStream(LogLevel::INFO) << "Decompressing \'" << inputFile << "\' as \'" << outputFile << "\'" << std::endl;
+  if (!in || !out)
   {
-    std::cout << "Could not open file \'" << outputFile << "\'" << std::endl << std::endl;
+    std::cout << std::endl;
+    return false;
   }
+  return decompressBlocks(*in, out, archiveSize(inputFile), options);
+}
 
-  // Preprocess the file
-  auto orderedBlocks = preprocessCompressedFile(fin);
+/* Checks that an archive decompresses, without writing anything: every block is decompressed in
+ * memory, its header has to meet its proof-of-work target (see checkProofOfWork()), and its
+ * transactions are checked by verifyTransactions(). Returns whether they all pass. */
+bool verify(const char *inputFile, const Options &options)
+{
+  std::ifstream inputFileStream;
+  std::istream *in = openInput(inputFile, inputFileStream);
+  logStream(LogLevel::INFO) << "Verifying \'" << inputFile << "\'" << std::endl;
+  if (!in)
+  {
+    std::cout << std::endl;
+    return false;
+  }
+  if (!decompressBlocks(*in, 0, archiveSize(inputFile), options))
+  {
+    std::cout << "\'" << inputFile << "\' failed verification" << std::endl;
+    return false;
+  }
+  logStream(LogLevel::INFO) << "\'" << inputFile << "\' is intact" << std::endl;
+  return true;
+}
 
-  // While file is still open, read a block and compress it.
-  for (auto blockOrderData : orderedBlocks)
+/* Decompresses an archive to out, or, if out is 0, checks each block as verify() says instead.
+ * totalBytes is the size of the archive, if it is known, or 0. Returns whether every block made it.
+ * The archive is read strictly from front to back, and the output is written the same way, so
+ * either can be a pipe. Worker threads take turns reading the blocks, then parse them into
+ * buffers of their own, in archive order. Inputs refer to earlier transactions by their position
+ * in the archive, so a worker fills in their hashes as the blocks they are in get hashed by other
+ * workers, then hashes and serializes its own block. Only the block header is left for when the
+ * block is committed, as it is coded against the one before it, which is cheap. Then the block is
+ * written out once every block before it in the original file has been. */
+bool decompressBlocks(std::istream &in, std::ostream *out, uint64_t totalBytes, const Options &options)
+{
+  // How many blocks there are is only known once END_OF_ARCHIVE is read.
+  size_t window = 4 * options.nThreads;
+  std::vector<DecompressedBlockBuffer> buffers(window);
+  // With -m, the blocks waiting to be written out and the hashes of the blocks in reach share it
+  PendingBlocks pending(options.tempDirectory, options.memoryBudget ? options.memoryBudget / 2 : DEFAULT_PENDING_MEMORY);
+  SpillFile spillFile(options.tempDirectory);
+  if (options.memoryBudget)
   {
-    fin.seekg(blockOrderData.offset, std::ios_base::beg);
+    decodedSpillFile = &spillFile;
+    decodedMemoryLimit = options.memoryBudget / 2;
+  }
+  uint32_t nextIndex = 0;
+  bool reachedEnd = false;
+  Progress progress(out ? "Decompressed" : "Verified", totalBytes);
+
+  uint8_t header[8];
+  in.read((char*)header, sizeof(header));
+  ByteReader headerReader(header, in.gcount());
+  if (!parseArchiveHeader(headerReader))
+    return false;
+
+  std::mutex readMutex;
+  std::condition_variable readTurn;
+  size_t nextRead = 0;
+  bool readFailed = false, readEnd = false;
+
+  auto work = [&](size_t i) -> bool
+  {
+    DecompressedBlockBuffer &buffer = buffers[i % window];
+    buffer.clear();
+
+    {
+      std::unique_lock<std::mutex> lock(readMutex);
+      readTurn.wait(lock, [&]() { return nextRead == i || readFailed; });
+      if (readFailed)
+        return false;
+      auto start = statsStart();
+      buffer.originalIndex = END_OF_ARCHIVE;
+      if (!readEnd)
+      {
+        in.read((char*)&buffer.originalIndex, sizeof(uint32_t));
+        readFailed = !in.good();
+        if (readFailed)
+          std::cout << "Compressed file is truncated" << std::endl;
+        else if (buffer.originalIndex == END_OF_ARCHIVE)
+          readEnd = true;
+        else
+          readFailed = !readCompressedBlock(in, buffer.compressed);
+      }
+      statsStop(buffer.blockStats, StatsStage::READ, start);
+      nextRead++;
+      readTurn.notify_all();
+      if (readFailed)
+        return false;
+      if (buffer.originalIndex == END_OF_ARCHIVE)
+        return true;
+    }
 
-    Block *block = parseCompressedBlock(fin);
+    auto start = statsStart();
+    ByteReader blockReader(buffer.compressed.data(), buffer.compressed.size());
+    buffer.block = parseCompressedBlock(blockReader, buffer.arena, buffer.locations, buffer.headerFlags);
+    statsStop(buffer.blockStats, StatsStage::PARSE, start);
 
-    if (!block)
+    if (!buffer.block)
     {
       std::cout << "Could not parse block. Aborting." << std::endl;
-      break;
+      abandonDecodedBlocks();
+      return false;
     }
 
-    // Do stuff with block.
-    printBlockHeader(block);
-    std::cout << std::endl;
+    // The block's buffer isn't needed until it is serialized, so it is used to hash transactions
+    start = statsStart();
+    if (!addDecodedBlock(i, buffer.block, buffer.locations) ||
+        !resolveTransactionHashes(i, buffer.block, buffer.locations, buffer.data))
+    {
+      abandonDecodedBlocks();
+      return false;
+    }
+    resolveMerkleRoot(buffer.block, buffer.headerFlags);
+    if (!out)
+      buffer.problem = verifyTransactions(buffer.block, buffer.headerFlags, buffer.data);
+    statsStop(buffer.blockStats, StatsStage::RESOLVE, start);
+
+    // The header is rewritten when the block is committed (see resolveBlockHeader())
+    start = statsStart();
+    buffer.data.clear();
+    if (out)
+      writeDecompressedBlock(buffer.data, buffer.block);
+    statsStop(buffer.blockStats, StatsStage::SERIALIZE, start);
+    return true;
+  };
+
+  auto commit = [&](size_t i) -> bool
+  {
+    DecompressedBlockBuffer &buffer = buffers[i % window];
+    if (buffer.originalIndex == END_OF_ARCHIVE)
+    {
+      reachedEnd = true;
+      return false;
+    }
+
+    // Each block's index in the original file. They must all be different, or some blocks would
+    // never get written.
+    uint32_t index = buffer.originalIndex;
+    if (index < nextIndex || pending.contains(index))
+    {
+      std::cout << "Invalid block order" << std::endl;
+      return false;
+    }
 
-    writeDecompressedBlock(fout, block);
+    // The header is only complete once the one before it is
+    auto start = statsStart();
+    resolveBlockHeader(buffer.block, buffer.headerFlags, decodedPreviousHeader);
+    if (!out && !buffer.problem && !checkProofOfWork(buffer.block))
+      buffer.problem = "header does not meet its proof-of-work target";
+    statsStop(buffer.blockStats, StatsStage::RESOLVE, start);
+    if (logEnabled(LogLevel::DEBUG))
+    {
+      printBlockHeader(buffer.block, buffer.log);
+      buffer.log << std::endl;
+      std::cout << buffer.log.str();
+    }
+    if (buffer.problem)
+    {
+      std::cout << "Block ";
+      for (int j = 0; j < 32; j++)
+        std::cout << std::hex << std::setfill('0') << std::setw(2) << (int)buffer.block->hash[j];
+      std::cout << std::dec << ": " << buffer.problem << std::endl;
+      return false;
+    }
+    // The header comes after the magic number and the size, and is always 80 bytes, so it is
+    // written over the one the block was serialized with.
+    start = statsStart();
+    if (out)
+    {
+      size_t size = buffer.data.size;
+      buffer.data.size = 8;
+      writeDecompressedBlockHeader(buffer.data, buffer.block);
+      buffer.data.size = size;
+    }
+    statsStop(buffer.blockStats, StatsStage::SERIALIZE, start);
+    if (stats)
+    {
+      buffer.blockStats.blocks++;
+      buffer.blockStats.transactions += buffer.block->transactionCount;
+      buffer.blockStats.bytesIn += sizeof(uint32_t) + buffer.compressed.size();
+      buffer.blockStats.bytesOut += buffer.data.size;
+    }
 
-    // When we're done with the block, free up memory.
-    delete block;
+    // When we're done with the block, free up memory. The blocks after it can't refer to anything
+    // more than TX_ID_HORIZON blocks back from the next one.
+    if (out)
+      buffer.arena.reset();
+    if (i + 2 > TX_ID_HORIZON)
+      evictDecodedBlocks(i + 2 - TX_ID_HORIZON);
+    if (!spillDecodedBlocks(i + 1))
+      return false;
+
+    // When verifying, there is nothing to write, but the order is still checked.
+    start = statsStart();
+    if (index != nextIndex)
+    {
+      if (!pending.add(index, buffer.data.data, buffer.data.size))
+        return false;
+    }
+    else
+    {
+      if (out)
+        buffer.data.flushTo(*out);
+      for (nextIndex++; !pending.empty() && pending.first() == nextIndex; nextIndex++)
+        if (!pending.popFirst(out))
+          return false;
+    }
+    statsStop(buffer.blockStats, StatsStage::WRITE, start);
+    if (stats)
+      stats->add(buffer.blockStats);
+    progress.update(sizeof(uint32_t) + buffer.compressed.size());
+    return true;
+  };
+
+  runOrderedPipeline(SIZE_MAX, options.nThreads, window, work, commit);
+  decodedSpillFile = 0;
+  bool ok = reachedEnd && pending.empty();
+  if (reachedEnd && !pending.empty())
+    std::cout << "Invalid block order" << std::endl;
+
+  if (out)
+    out->flush();
+  if (ok && out && !out->good())
+  {
+    std::cout << "Could not write the decompressed blocks" << std::endl;
+    ok = false;
   }
+  if (ok)
+    progress.finish();
+  return ok;
 }
 
-std::vector<CompressedBlockOrderData> preprocessCompressedFile(std::ifstream &fin)
+// The size of the archive, or 0 if it isn't a file
+uint64_t archiveSize(const char *inputFile)
 {
-  uint32_t nBlocks;
-  fin.read((char*)&nBlocks, sizeof(uint32_t));
-  std::vector<CompressedBlockOrderData> ret(nBlocks);
+  struct stat st;
+  bool isFile = strcmp(inputFile, "-") != 0 && stat(inputFile, &st) == 0 && S_ISREG(st.st_mode);
+  return isFile ? st.st_size : 0;
+}
 
-  for (auto &t : ret)
+/* Checks what the header of a decompressed block doesn't cover by itself (see checkProofOfWork()):
+ * that its merkle root, unless it was recomputed, is that of its transactions, which covers their
+ * txids, and that their witnesses match the witness commitment in the coinbase (BIP 141). Returns
+ * what is wrong with the block, or 0. Its transactions must have been hashed. */
+const char *verifyTransactions(Block *block, uint8_t headerFlags, ByteWriter &scratch)
+{
+  size_t n = block->transactionCount;
+  if (n == 0)
+    return "block has no transactions";
+  if (!(headerFlags & HeaderFlags::MERKLE_ROOT_IMPLICIT))
   {
-    uint32_t index;
-    fin.read((char*)&index, sizeof(uint32_t));
-    t.index = index;
+    uint8_t merkleRoot[32];
+    computeMerkleRoot(block->transactions.items, n, merkleRoot);
+    if (memcmp(merkleRoot, block->hashMerkleRoot, 32) != 0)
+      return "merkle root does not match its transactions";
   }
 
-  for (int i = 0; i < nBlocks; i++)
+  // The commitment is the last coinbase output that starts like one
+  static const uint8_t COMMITMENT_START[6] = { 0x6a, 0x24, 0xaa, 0x21, 0xa9, 0xed };
+  Transaction *coinbase = block->transactions[0];
+  const Output *commitment = 0;
+  for (Output *output : coinbase->outputs)
+    if (output->scriptLength >= 38 && memcmp(output->script, COMMITMENT_START, 6) == 0)
+      commitment = output;
+  if (!commitment)
   {
-    uint32_t magicNumber, blockSize;
+    for (Transaction *transaction : block->transactions)
+      if (transaction->flag)
+        return "witnesses are not committed to";
+    return 0;
+  }
 
-    // Make sure we are pointing to the beginning of a block
-    fin.read((char*)&magicNumber, sizeof(uint32_t));
+  // It is made with a reserved value, which is the coinbase's witness
+  if (coinbase->inputCount == 0 || coinbase->inputs[0]->witnesses.size() != 1 ||
+      coinbase->inputs[0]->witnesses[0]->size != 32)
+    return "coinbase has no witness reserved value";
 
-    if (magicNumber != Block::MAGIC_NUMBER)
+  // The wtxids are hashed like the txids, but with the witnesses, and the coinbase's is all zeros
+  std::vector<size_t> offsets(n);
+  scratch.clear();
+  for (size_t t = 1; t < n; t++)
+  {
+    offsets[t - 1] = scratch.size;
+    writeDecompressedTransaction(scratch, block->transactions[t]);
+  }
+  offsets[n - 1] = scratch.size;
+  std::vector<const uint8_t*> data(n - 1);
+  std::vector<size_t> sizes(n - 1);
+  for (size_t t = 0; t + 1 < n; t++)
+  {
+    data[t] = scratch.data + offsets[t];
+    sizes[t] = offsets[t + 1] - offsets[t];
+  }
+  std::vector<uint8_t> level(32 * n, 0);
+  sha256dBatch(data.data(), sizes.data(), n - 1, (uint8_t (*)[32])(level.data() + 32));
+  hashMerkleTree(level, n);
+
+  uint8_t message[64], hash[32];
+  memcpy(message, level.data(), 32);
+  memcpy(message + 32, coinbase->inputs[0]->witnesses[0]->data, 32);
+  sha256d(message, 64, hash);
+  if (memcmp(hash, commitment->script + 6, 32) != 0)
+    return "witnesses do not match the witness commitment";
+  return 0;
+}
+
+// Reads the next block from the archive, including its magic number and size.
+bool readCompressedBlock(std::istream &in, std::vector<uint8_t> &compressed)
+{
+  uint32_t magicNumber = 0, blockSize = 0;
+  in.read((char*)&magicNumber, sizeof(uint32_t));
+  in.read((char*)&blockSize, sizeof(uint32_t));
+  if (!in.good())
+  {
+    std::cout << "Compressed file is truncated" << std::endl;
+    return false;
+  }
+
+  // Make sure we are pointing to the beginning of a block (see Column)
+  if (magicNumber != COLUMNAR_MAGIC_NUMBER)
+  {
+    std::cout << "Filestream is not pointing to a valid block" << std::endl;
+    return false;
+  }
+  if (blockSize > MAX_COMPRESSED_BLOCK_SIZE)
+  {
+    std::cout << "Block size is invalid" << std::endl;
+    return false;
+  }
+
+  compressed.resize(8 + (size_t)blockSize);
+  memcpy(compressed.data(), &magicNumber, sizeof(uint32_t));
+  memcpy(compressed.data() + 4, &blockSize, sizeof(uint32_t));
+  in.read((char*)compressed.data() + 8, blockSize);
+  if (!in.good())
+  {
+    std::cout << "Compressed file is truncated" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+/* Adds the block with the given index in the archive to decodedBlocks, once the block before it
+ * has been, and numbers the previous transaction hashes it stores in full. The inputs that refer
+ * to those by number are filled in. The rest are left to resolveTransactionHashes(). The block may
+ * only refer to the last TX_ID_HORIZON blocks. */
+bool addDecodedBlock(uint64_t index, Block *block, const std::vector<TxHashLocation> &locations)
+{
+  std::unique_lock<std::mutex> lock(decodedMutex);
+  decodedChanged.wait(lock, [&]() { return firstDecodedBlock + decodedBlocks.size() == index || decodeFailed; });
+  if (decodeFailed)
+    return false;
+
+  // The blocks that are out of reach haven't necessarily been dropped yet
+  uint64_t firstExternal = 0;
+  if (index + 1 > TX_ID_HORIZON)
+    firstExternal = decodedBlocks[index + 1 - TX_ID_HORIZON - firstDecodedBlock].firstExternal;
+
+  // The txids are filled in as the block is hashed. The block's own external hashes follow them.
+  uint64_t nTransactions = block->transactionCount;
+  std::shared_ptr<HashList> hashes = std::make_shared<HashList>(nTransactions);
+  size_t k = 0;
+  for (Transaction *transaction : block->transactions)
+    for (Input *input : transaction->inputs)
     {
-      std::cout << "Filestream is not pointing to a valid block" << std::endl;
-      if (magicNumber == Block::MAGIC_NUMBER_REVERSE)
-        std::cout << "This is likely a endianness issue" << std::endl;
-      return {};
+      const TxHashLocation &location = locations[k++];
+      if (location.kind == TxHashLocation::NEW_EXTERNAL)
+        hashes->push_back(input->prevTransactionHash);
+      else if (location.kind == TxHashLocation::EXTERNAL)
+      {
+        uint64_t n = location.value;
+        if (n < firstExternal || n >= nDecodedExternal + (hashes->size() - nTransactions))
+        {
+          std::cout << "Invalid external transaction hash index. Aborting." << std::endl;
+          return false;
+        }
+        if (n >= nDecodedExternal)
+        {
+          input->prevTransactionHash = (*hashes)[nTransactions + n - nDecodedExternal];
+          continue;
+        }
+
+        // It is in the last block whose external hashes start at or before it
+        auto it = std::upper_bound(decodedBlocks.begin(), decodedBlocks.end(), n,
+                                   [](uint64_t n, const DecodedBlock &b) { return n < b.firstExternal; });
+        const DecodedBlock &stored = *(it - 1);
+        if (!readDecodedHash(stored.hashes.get(), stored.offset, stored.nTransactions + n - stored.firstExternal,
+                             input->prevTransactionHash))
+          return false;
+      }
+      else if (location.value >= TX_ID_HORIZON)
+      {
+        std::cout << "Invalid transaction location. Aborting." << std::endl;
+        return false;
+      }
     }
 
-    ret[i].offset = fin.tellg() - (std::streampos)4;
-    ret[i].compressedIndex = i;
+  decodedBlocks.emplace_back();
+  DecodedBlock &decoded = decodedBlocks.back();
+  decoded.hashes = hashes;
+  decoded.nTransactions = nTransactions;
+  decoded.nHashed = 0;
+  decoded.firstExternal = nDecodedExternal;
+  decoded.nExternal = hashes->size() - nTransactions;
+  decoded.offset = 0;
+  nDecodedExternal += decoded.nExternal;
+  decodedMemoryUsed += 32 * hashes->size();
+  decodedChanged.notify_all();
+  return true;
+}
 
-    // Read in the size of the block. Skip that many bytes to the next block
-    fin.read((char*)&blockSize, sizeof(uint32_t));
-    fin.seekg(blockSize, std::ios_base::cur);
+/* Fills in the previous transaction hashes of the block's inputs that refer to transactions in the
+ * archive, waiting for those to be hashed if they haven't been yet, and computes the txids of the
+ * block's own transactions, which other blocks may be waiting for. The block must have been added
+ * by addDecodedBlock(). */
+bool resolveTransactionHashes(uint64_t index, Block *block, const std::vector<TxHashLocation> &locations, ByteWriter &scratch)
+{
+  // The block's hashes aren't spilled before it is written out, so they stay put
+  DecodedBlock *decoded;
+  HashList *hashes;
+  {
+    std::unique_lock<std::mutex> lock(decodedMutex);
+    decoded = &decodedBlocks[index - firstDecodedBlock];
+    hashes = decoded->hashes.get();
   }
 
-  std::sort(ret.begin(), ret.end());
+  // Transactions are hashed in batches. A batch has to be hashed early when a transaction spends
+  // from one in it.
+  uint64_t batchStart = 0;
+  auto hashBatch = [&](uint64_t end)
+  {
+    computeTransactionHashes(block->transactions.items + batchStart, end - batchStart, scratch);
+    for (; batchStart < end; batchStart++)
+      (*hashes)[batchStart] = block->transactions[batchStart]->hash;
+    std::unique_lock<std::mutex> lock(decodedMutex);
+    decoded->nHashed = end;
+    decodedChanged.notify_all();
+  };
+
+  // The earlier block referred to last, and how much of it was hashed when last checked, so that
+  // the lock is only taken when that may not be enough. Its hashes are held on to, as they may be
+  // spilled in the meantime.
+  uint64_t lastBlock = UINT64_MAX;
+  const DecodedBlock *last = 0;
+  std::shared_ptr<HashList> lastHashes;
+  uint64_t lastOffset = 0, lastCount = 0;
+  size_t lastHashed = 0;
+
+  size_t k = 0;
+  for (uint64_t t = 0; t < block->transactionCount; t++)
+  {
+    Transaction *transaction = block->transactions[t];
+    for (uint64_t j = 0; j < transaction->inputCount; j++)
+    {
+      const TxHashLocation &location = locations[k + j];
+      if (location.kind == TxHashLocation::INTERNAL && location.value == 0 &&
+          location.position >= batchStart && location.position < t)
+      {
+        hashBatch(t);
+        break;
+      }
+    }
+
+    for (Input *input : transaction->inputs)
+    {
+      const TxHashLocation &location = locations[k++];
+      if (location.kind != TxHashLocation::INTERNAL)
+        continue;
+
+      // Transactions in this block only count if they have been hashed already.
+      if (location.value == 0)
+      {
+        if (location.position >= batchStart)
+        {
+          std::cout << "Invalid transaction location. Aborting." << std::endl;
+          return false;
+        }
+        input->prevTransactionHash = (*hashes)[location.position];
+        continue;
+      }
+
+      // The block may have been dropped, if it is out of reach (see TX_ID_HORIZON)
+      uint64_t b = index - std::min(location.value, index);
+      if (b != lastBlock)
+      {
+        std::unique_lock<std::mutex> lock(decodedMutex);
+        if (location.value > index || b < firstDecodedBlock)
+        {
+          std::cout << "Invalid transaction location. Aborting." << std::endl;
+          return false;
+        }
+        last = &decodedBlocks[b - firstDecodedBlock];
+        lastHashes = last->hashes;
+        lastOffset = last->offset;
+        lastCount = last->nTransactions;
+        lastHashed = last->nHashed;
+        lastBlock = b;
+      }
+      if (location.position >= lastCount)
+      {
+        std::cout << "Invalid transaction location. Aborting." << std::endl;
+        return false;
+      }
+      if (location.position >= lastHashed)
+      {
+        std::unique_lock<std::mutex> lock(decodedMutex);
+        decodedChanged.wait(lock, [&]() { return last->nHashed > location.position || decodeFailed; });
+        if (decodeFailed)
+          return false;
+        lastHashed = last->nHashed;
+      }
+      // Only blocks that have been hashed in full are spilled
+      if (!readDecodedHash(lastHashes.get(), lastOffset, location.position, input->prevTransactionHash))
+        return false;
+    }
+  }
+  hashBatch(block->transactionCount);
+  return true;
+}
 
-  // Read in txHashIndex data
-  uint32_t nTxHashes;
-  fin.read((char*)&nTxHashes, sizeof(uint32_t));
-  txHashTable.resize(nTxHashes);
-  for (auto &h : txHashTable)
+// Gets hash n of a decoded block (see DecodedBlock), from hashes, or from offset in decodedSpillFile
+// if the block has been spilled.
+bool readDecodedHash(const HashList *hashes, uint64_t offset, uint64_t n, std::array<uint8_t, 32> &hash)
+{
+  if (hashes)
   {
-    for (int i = 31; i >= 0; i--)
-      fin.read((char*)(h.data() + i), sizeof(uint8_t));
+    hash = (*hashes)[n];
+    return true;
   }
+  return decodedSpillFile->read(offset + 32 * n, hash.data(), 32);
+}
 
-  for (int i = 0; i < 32; i++)
-    std::cout << std::hex << std::setw(2) << std::setfill('0') << (int)txHashTable[2][i];
-  std::cout << std::dec << std::endl;
-  return ret;
+// Drops the blocks before the one with the given index in the archive from decodedBlocks.
+void evictDecodedBlocks(uint64_t end)
+{
+  std::unique_lock<std::mutex> lock(decodedMutex);
+  for (; firstDecodedBlock < end && decodedBlocks.size() > 1; firstDecodedBlock++)
+  {
+    DecodedBlock &decoded = decodedBlocks.front();
+    uint64_t size = 32 * (decoded.nTransactions + decoded.nExternal);
+    if (decoded.hashes)
+      decodedMemoryUsed -= size;
+    else
+      decodedSpillFile->release(decoded.offset, size);
+    decodedBlocks.pop_front();
+  }
 }
 
-void writeDecompressedBlock(std::ofstream &fout, Block *block)
+/* Moves the hashes of the oldest blocks before the one with the given index in the archive, which
+ * must all have been written out, to decodedSpillFile, until the rest fit in decodedMemoryLimit.
+ * Only the thread that writes the blocks out may call this. */
+bool spillDecodedBlocks(uint64_t end)
 {
-  std::streampos sizePos, endPos;
-  uint32_t decompressedBlockSize;
+  for (;;)
+  {
+    std::shared_ptr<HashList> hashes;
+    {
+      std::unique_lock<std::mutex> lock(decodedMutex);
+      firstUnspilledBlock = std::max(firstUnspilledBlock, firstDecodedBlock);
+      if (decodedMemoryUsed <= decodedMemoryLimit || firstUnspilledBlock >= end)
+        return true;
+      hashes = decodedBlocks[firstUnspilledBlock - firstDecodedBlock].hashes;
+    }
 
+    // Nothing writes to the hashes any more, so they are written out without the lock
+    uint64_t offset;
+    if (!decodedSpillFile->write(hashes->data(), 32 * hashes->size(), offset))
+      return false;
+
+    std::unique_lock<std::mutex> lock(decodedMutex);
+    DecodedBlock &decoded = decodedBlocks[firstUnspilledBlock - firstDecodedBlock];
+    decoded.offset = offset;
+    decoded.hashes.reset();
+    decodedMemoryUsed -= 32 * hashes->size();
+    firstUnspilledBlock++;
+  }
+}
 
+// Stops every worker that is waiting for blocks to be added or hashed, after one has failed.
+void abandonDecodedBlocks()
+{
+  std::unique_lock<std::mutex> lock(decodedMutex);
+  decodeFailed = true;
+  decodedChanged.notify_all();
+}
+
+void writeDecompressedBlock(ByteWriter &out, Block *block)
+{
   // Write block header
-  uint32_t magicNumber = Block::MAGIC_NUMBER;
-  fout.write((char*)&magicNumber, sizeof(uint32_t));
+  out.put32(Block::MAGIC_NUMBER);
 
   // We would write the size of the decompressed block next, but we don't know how big it is yet.
-  // Skip the next 4 bytes for now and come back later.
-  sizePos = fout.tellp();
-  fout.seekp(4, std::ios_base::cur);
+  // Leave 4 bytes for it for now and come back later.
+  size_t sizePos = out.size;
+  out.put32(0);
 
-  writeDecompressedBlockHeader(fout, block);
+  writeDecompressedBlockHeader(out, block);
 
-  writeVarInt(fout, block->transactionCount);
+  writeVarInt(out, block->transactionCount);
 
   for (Transaction * transaction : block->transactions)
   {
     // Write decompressed transaction
-    writeDecompressedTransaction(fout, transaction);
+    writeDecompressedTransaction(out, transaction);
   }
-  endPos = fout.tellp();
-  decompressedBlockSize = (uint32_t)(endPos - sizePos) - 4;
-  fout.seekp(sizePos, std::ios_base::beg);
-  fout.write((char*)&decompressedBlockSize, sizeof(uint32_t));
-  fout.seekp(endPos, std::ios_base::beg);
+  uint32_t decompressedBlockSize = out.size - sizePos - 4;
+  memcpy(out.data + sizePos, &decompressedBlockSize, sizeof(uint32_t));
 }
 
-void writeDecompressedBlockHeader(std::ofstream &fout, Block *block)
+void writeDecompressedBlockHeader(ByteWriter &out, Block *block)
 {
   // The block header consists of the version number, previous block hash,
   // merkle root, timestamp, 'bits', and nonce.
-  fout.write((char*)&block->version, sizeof(uint32_t));
-
-  for (int i = 0; i < 32; i++)
-    fout.write((char*)&block->hashPrevBlock[31-i], 1);
-  for (int i = 0; i < 32; i++)
-    fout.write((char*)&block->hashMerkleRoot[31-i], 1);
-
-  fout.write((char*)&block->time, sizeof(uint32_t));
-  fout.write((char*)&block->bits, sizeof(uint32_t));
-  fout.write((char*)&block->nonce, sizeof(uint32_t));
+  out.put32(block->version);
+  out.appendReversed(block->hashPrevBlock, 32);
+  out.appendReversed(block->hashMerkleRoot, 32);
+  out.put32(block->time);
+  out.put32(block->bits);
+  out.put32(block->nonce);
 }
 
-void writeDecompressedTransaction(std::ofstream &fout, Transaction *transaction)
+void writeDecompressedTransaction(ByteWriter &out, Transaction *transaction)
 {
-  writeDecompressedTransactionVersion(fout, transaction->version);
-  writeDecompressedTransactionFlag(fout, transaction->flag);
+  writeDecompressedTransactionVersion(out, transaction->version);
+  writeDecompressedTransactionFlag(out, transaction->flag);
 
-  writeDecompressedTransactionInputCount(fout, transaction->inputCount);
+  writeDecompressedTransactionInputCount(out, transaction->inputCount);
   for (Input *input : transaction->inputs)
-    writeDecompressedTransactionInput(fout, input);
+    writeDecompressedTransactionInput(out, input);
 
-  writeDecompressedTransactionOutputCount(fout, transaction->outputCount);
+  writeDecompressedTransactionOutputCount(out, transaction->outputCount);
   for (Output *output : transaction->outputs)
-    writeDecompressedTransactionOutput(fout, output);
+    writeDecompressedTransactionOutput(out, output);
 
   if (transaction->flag)
     for (Input *input : transaction->inputs)
-      writeDecompressedTransactionWitnessData(fout, input->witnesses);
+      writeDecompressedTransactionWitnessData(out, input->witnesses);
 
-  writeDecompressedTransactionLockTime(fout, transaction->lockTime);
+  writeDecompressedTransactionLockTime(out, transaction->lockTime);
 }
 
-void writeDecompressedTransactionFlag(std::ofstream &fout, bool flag)
+void writeDecompressedTransactionFlag(ByteWriter &out, bool flag)
 {
   if (flag)
   {
-    uint8_t tmp = 0x00;
-    fout.write((char*)&tmp, sizeof(uint8_t));
-    tmp = 0x01;
-    fout.write((char*)&tmp, sizeof(uint8_t));
+    out.put8(0x00);
+    out.put8(0x01);
   }
 }
 
-void writeDecompressedTransactionInput(std::ofstream &fout, Input *input)
+void writeDecompressedTransactionInput(ByteWriter &out, Input *input)
 {
   // Decompress and write previous transaction hash
-  for (int i = 0; i < 32; i++)
-    fout.write((char*)&input->prevTransactionHash[31-i], 1);
+  out.appendReversed(input->prevTransactionHash.data(), 32);
 
   // Decompress and write previous transaction index
-  fout.write((char*)&input->prevTransactionIndex, sizeof(uint32_t));
+  out.put32(input->prevTransactionIndex);
 
   // Decompress and write script length + script
-  writeVarInt(fout, input->scriptLength);
-  for (int i = 0; i < input->scriptLength; i++)
-    fout.write((char*)&input->script[i], 1);
+  writeVarInt(out, input->scriptLength);
+  out.append(input->script, input->scriptLength);
 
   // Decompress and write sequence number
-  fout.write((char*)&input->sequenceNumber, sizeof(uint32_t));
+  out.put32(input->sequenceNumber);
 }
 
-void writeDecompressedTransactionInputCount(std::ofstream &fout, uint64_t inputCount)
+void writeDecompressedTransactionInputCount(ByteWriter &out, uint64_t inputCount)
 {
-  writeVarInt(fout, inputCount);
+  writeVarInt(out, inputCount);
 }
 
-void writeDecompressedTransactionLockTime(std::ofstream &fout, uint32_t lockTime)
+void writeDecompressedTransactionLockTime(ByteWriter &out, uint32_t lockTime)
 {
-  fout.write((char*)&lockTime, sizeof(uint32_t));
+  out.put32(lockTime);
 }
 
-void writeDecompressedTransactionOutput(std::ofstream &fout, Output *output)
+void writeDecompressedTransactionOutput(ByteWriter &out, Output *output)
 {
   // Decompress and write value (number of Satoshis/BTC to be sent)
-  fout.write((char*)&output->value, sizeof(uint64_t));
+  out.put64(output->value);
 
   // Decompress and write script length + script.
-  writeVarInt(fout, output->scriptLength);
-  for (int i = 0; i < output->scriptLength; i++)
-    fout.write((char*)&output->script[i], 1);
+  writeVarInt(out, output->scriptLength);
+  out.append(output->script, output->scriptLength);
 }
 
-void writeDecompressedTransactionOutputCount(std::ofstream &fout, uint64_t outputCount)
+void writeDecompressedTransactionOutputCount(ByteWriter &out, uint64_t outputCount)
 {
-  writeVarInt(fout, outputCount);
+  writeVarInt(out, outputCount);
 }
 
-void writeDecompressedTransactionVersion(std::ofstream &fout, uint32_t version)
+void writeDecompressedTransactionVersion(ByteWriter &out, uint32_t version)
 {
-  fout.write((char*)&version, sizeof(uint32_t));
+  out.put32(version);
 }
 
-void writeDecompressedTransactionWitnessData(std::ofstream &fout, std::vector<Witness*> &witnesses)
+void writeDecompressedTransactionWitnessData(ByteWriter &out, const ArenaArray<Witness*> &witnesses)
 {
-  writeVarInt(fout, witnesses.size());
+  writeVarInt(out, witnesses.size());
   for (Witness *w : witnesses)
   {
-    writeVarInt(fout, w->size);
-    for (uint8_t byte : w->data)
-      fout.write((char*)&byte, 1);
+    writeVarInt(out, w->size);
+    out.append(w->data, w->size);
   }
 }
 
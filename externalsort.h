@@ -0,0 +1,207 @@
+// externalsort.h
+
+#ifndef EXTERNALSORT_H
+#define EXTERNALSORT_H
+
+#include <algorithm>
+#include <iostream>
+#include <queue>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include <stdlib.h>
+#include <unistd.h>
+
+FILE *createTempFile(const std::string &directory);
+
+/* Sorts more fixed-size records than fit in memory. Records are collected in a buffer of at most
+ * memoryBudget bytes; whenever it fills up, it is sorted and spilled to a temporary file as a
+ * "run". finish() then merges the runs, and next() returns the records in sorted order.
+ * If everything fits in the buffer, nothing touches the disk.
+ * Record must be trivially copyable and have an operator<. */
+template<typename Record>
+struct ExternalSorter
+{
+  ExternalSorter(const std::string &tempDirectory, size_t memoryBudget);
+  ~ExternalSorter();
+  ExternalSorter(const ExternalSorter &) = delete;
+  ExternalSorter &operator= (const ExternalSorter &) = delete;
+
+  bool add(const Record &record);
+  bool finish();
+  bool next(Record &record);
+
+  struct Run
+  {
+    FILE *file;
+    uint64_t remaining; // Records in the file that have not been read into buf yet
+    std::vector<Record> buf;
+    size_t pos;
+  };
+
+  struct Head
+  {
+    Record record;
+    size_t run;
+    bool operator< (const Head &other) const { return other.record < record; } // Smallest first
+  };
+
+  bool spill();
+  bool refill(Run &run);
+
+  std::string tempDirectory;
+  size_t maxRecords;
+  std::vector<Record> buffer;
+  size_t bufferPos; // Position in buffer, when nothing was spilled
+  std::vector<Run> runs;
+  std::priority_queue<Head> heads;
+  bool failed;
+};
+
+template<typename Record>
+ExternalSorter<Record>::ExternalSorter(const std::string &tempDirectory, size_t memoryBudget)
+  : tempDirectory(tempDirectory), bufferPos(0), failed(false)
+{
+  maxRecords = std::max<size_t>(1024, memoryBudget / sizeof(Record));
+}
+
+template<typename Record>
+ExternalSorter<Record>::~ExternalSorter()
+{
+  for (Run &run : runs)
+    fclose(run.file);
+}
+
+template<typename Record>
+bool ExternalSorter<Record>::add(const Record &record)
+{
+  buffer.push_back(record);
+  if (buffer.size() >= maxRecords)
+    return spill();
+  return !failed;
+}
+
+// Sorts the buffer and writes it out as a new run.
+template<typename Record>
+bool ExternalSorter<Record>::spill()
+{
+  std::sort(buffer.begin(), buffer.end());
+
+  Run run;
+  run.file = createTempFile(tempDirectory);
+  run.remaining = buffer.size();
+  run.pos = 0;
+  if (!run.file || fwrite(buffer.data(), sizeof(Record), buffer.size(), run.file) != buffer.size())
+  {
+    std::cout << "Could not write temporary file in \'" << tempDirectory << "\'" << std::endl;
+    if (run.file)
+      fclose(run.file);
+    failed = true;
+    return false;
+  }
+  runs.push_back(run);
+  buffer.clear();
+  return true;
+}
+
+// Reads the next piece of a run into its buffer.
+template<typename Record>
+bool ExternalSorter<Record>::refill(Run &run)
+{
+  size_t n = std::min<uint64_t>(run.remaining, run.buf.capacity());
+  run.buf.resize(n);
+  if (fread(run.buf.data(), sizeof(Record), n, run.file) != n)
+  {
+    std::cout << "Could not read temporary file" << std::endl;
+    failed = true;
+    return false;
+  }
+  run.remaining -= n;
+  run.pos = 0;
+  return n > 0;
+}
+
+template<typename Record>
+bool ExternalSorter<Record>::finish()
+{
+  if (failed)
+    return false;
+
+  // Everything fit in memory
+  if (runs.empty())
+  {
+    std::sort(buffer.begin(), buffer.end());
+    return true;
+  }
+
+  if (!buffer.empty() && !spill())
+    return false;
+  std::vector<Record>().swap(buffer);
+
+  // Merge the runs. Between them, their read buffers get half the memory the sort buffer had.
+  size_t readRecords = std::max<size_t>(256, maxRecords / 2 / runs.size());
+  for (size_t i = 0; i < runs.size(); i++)
+  {
+    Run &run = runs[i];
+    run.buf.reserve(readRecords);
+    rewind(run.file);
+    if (refill(run))
+    {
+      Head head = { run.buf[0], i };
+      heads.push(head);
+      run.pos = 1;
+    }
+  }
+  return !failed;
+}
+
+// Gets the next record in sorted order. Returns false when there are none left.
+template<typename Record>
+bool ExternalSorter<Record>::next(Record &record)
+{
+  if (runs.empty())
+  {
+    if (bufferPos == buffer.size())
+      return false;
+    record = buffer[bufferPos++];
+    return true;
+  }
+
+  if (heads.empty())
+    return false;
+  Head head = heads.top();
+  heads.pop();
+  record = head.record;
+
+  Run &run = runs[head.run];
+  if (run.pos < run.buf.size() || refill(run))
+  {
+    head.record = run.buf[run.pos++];
+    heads.push(head);
+  }
+  return true;
+}
+
+// Creates a temporary file that is deleted as soon as it is closed.
+FILE *createTempFile(const std::string &directory)
+{
+  std::string pattern = directory + "/btcompress-XXXXXX";
+  std::vector<char> path(pattern.begin(), pattern.end());
+  path.push_back(0);
+
+  int fd = mkstemp(path.data());
+  if (fd < 0)
+    return 0;
+  // Unlinking right away means the file is cleaned up even if we crash.
+  unlink(path.data());
+
+  FILE *file = fdopen(fd, "w+b");
+  if (!file)
+    close(fd);
+  return file;
+}
+
+#endif
@@ -0,0 +1,210 @@
+// externaltxhashes.h
+
+#ifndef EXTERNALTXHASHES_H
+#define EXTERNALTXHASHES_H
+
+#include "externalsort.h"
+#include "txhashlocation.h"
+
+#include <array>
+#include <iostream>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+
+/* Works out where previous transaction hashes are found (see TxHashLocation) without holding every
+ * txid in memory at once, for archives too big for the in-memory tables. The answers are the same
+ * ones compress() would get from them.
+ *
+ * This takes two passes over the blocks. In the first, each transaction's inputs are passed to
+ * addReference(), followed by the transaction itself to addTransaction(), in archive order.
+ * finish() then resolves the references with a few external sorts:
+ *   1. Sort transactions and references together by hash, keeping their order otherwise. A
+ *      reference that comes after a transaction with its hash, less than TX_ID_HORIZON blocks
+ *      later, refers to that transaction; the rest are external.
+ *   2. Sort the external references by the first reference to the same hash that is in reach of
+ *      them. External hashes are numbered in order of those first references.
+ *   3. Sort the answers back into reference order.
+ * In the second pass, nextReference() hands out the answers in reference order. */
+struct ExternalTxHashes
+{
+  ExternalTxHashes(const std::string &tempDirectory, size_t memoryBudget);
+
+  bool addReference(const std::array<uint8_t, 32> &hash, uint32_t block);
+  bool addTransaction(const std::array<uint8_t, 32> &txId, uint32_t block);
+  bool finish();
+  bool nextReference(uint8_t &kind, uint32_t &value);
+
+  // A transaction or a reference. seq numbers them in the order they were added.
+  struct HashEvent
+  {
+    bool operator< (const HashEvent &other) const
+    {
+      int c = memcmp(hash.data(), other.hash.data(), 32);
+      return c < 0 || (c == 0 && seq < other.seq);
+    }
+    std::array<uint8_t, 32> hash;
+    uint64_t seq;
+    uint32_t transaction; // The transaction's number in the archive, or EMPTY for a reference
+    uint32_t block; // The number of the block it is in, in the archive
+  };
+
+  // An external reference, and the first external reference to the same hash in reach of it
+  struct FirstRef
+  {
+    bool operator< (const FirstRef &other) const
+    {
+      return first < other.first || (first == other.first && seq < other.seq);
+    }
+    uint64_t first, seq;
+  };
+
+  struct Answer
+  {
+    bool operator< (const Answer &other) const { return seq < other.seq; }
+    uint64_t seq;
+    uint32_t value; // An external hash's index, or a transaction's number in the archive
+    uint8_t kind;
+  };
+
+  static const uint32_t EMPTY = 0xffffffff;
+
+  // Only a couple of the sorts hold data at any time, so the budget is split between them.
+  ExternalSorter<HashEvent> events;
+  ExternalSorter<FirstRef> externalRefs;
+  ExternalSorter<Answer> answers;
+  uint64_t nEvents;
+  uint32_t nTransactions;
+};
+
+ExternalTxHashes::ExternalTxHashes(const std::string &tempDirectory, size_t memoryBudget)
+  : events(tempDirectory, memoryBudget / 2),
+    externalRefs(tempDirectory, memoryBudget / 4),
+    answers(tempDirectory, memoryBudget / 4),
+    nEvents(0), nTransactions(0)
+{
+}
+
+bool ExternalTxHashes::addReference(const std::array<uint8_t, 32> &hash, uint32_t block)
+{
+  HashEvent e;
+  e.hash = hash;
+  e.seq = nEvents++;
+  e.transaction = EMPTY;
+  e.block = block;
+  return events.add(e);
+}
+
+bool ExternalTxHashes::addTransaction(const std::array<uint8_t, 32> &txId, uint32_t block)
+{
+  if (nTransactions == EMPTY)
+  {
+    std::cout << "Too many transactions" << std::endl;
+    return false;
+  }
+  HashEvent e;
+  e.hash = txId;
+  e.seq = nEvents++;
+  e.transaction = nTransactions++;
+  e.block = block;
+  return events.add(e);
+}
+
+bool ExternalTxHashes::finish()
+{
+  if (!events.finish())
+    return false;
+
+  // Go through each hash's transactions and references in order.
+  HashEvent e;
+  bool haveGroup = false;
+  std::array<uint8_t, 32> groupHash;
+  uint32_t transaction = EMPTY; // The first transaction with the hash that is still in reach
+  uint32_t transactionBlock = 0;
+  uint64_t firstExternal = 0; // The first external reference that is still in reach
+  uint32_t externalBlock = 0;
+  bool haveExternal = false;
+  while (events.next(e))
+  {
+    if (!haveGroup || e.hash != groupHash)
+    {
+      haveGroup = true;
+      groupHash = e.hash;
+      transaction = EMPTY;
+      haveExternal = false;
+    }
+
+    if (e.transaction != EMPTY)
+    {
+      // With duplicate txids, references go to the first transaction that is still in reach
+      if (transaction == EMPTY || e.block - transactionBlock >= TX_ID_HORIZON)
+      {
+        transaction = e.transaction;
+        transactionBlock = e.block;
+      }
+    }
+    else if (transaction != EMPTY && e.block - transactionBlock < TX_ID_HORIZON)
+    {
+      Answer a;
+      a.seq = e.seq;
+      a.kind = TxHashLocation::INTERNAL;
+      a.value = transaction;
+      if (!answers.add(a))
+        return false;
+    }
+    else
+    {
+      // A hash that was numbered too far back is numbered again
+      if (!haveExternal || e.block - externalBlock >= TX_ID_HORIZON)
+      {
+        haveExternal = true;
+        firstExternal = e.seq;
+        externalBlock = e.block;
+      }
+      FirstRef r;
+      r.first = firstExternal;
+      r.seq = e.seq;
+      if (!externalRefs.add(r))
+        return false;
+    }
+  }
+
+  // Number the external hashes in order of their first references.
+  if (!externalRefs.finish())
+    return false;
+  FirstRef r;
+  Answer a;
+  a.value = 0;
+  bool first = true;
+  uint64_t lastFirst = 0;
+  while (externalRefs.next(r))
+  {
+    if (!first && r.first != lastFirst)
+      a.value++;
+    first = false;
+    lastFirst = r.first;
+
+    a.seq = r.seq;
+    a.kind = r.seq == r.first ? TxHashLocation::NEW_EXTERNAL : TxHashLocation::EXTERNAL;
+    if (!answers.add(a))
+      return false;
+  }
+
+  return answers.finish();
+}
+
+/* Gets where the next reference's hash is found, in the order the references were added.
+ * For an internal reference, value is the number of the transaction in the archive (counting
+ * from 0, in the order they were added); otherwise it is the external hash's index. */
+bool ExternalTxHashes::nextReference(uint8_t &kind, uint32_t &value)
+{
+  Answer a;
+  if (!answers.next(a))
+    return false;
+  kind = a.kind;
+  value = a.value;
+  return true;
+}
+
+#endif
@@ -0,0 +1,177 @@
+// extract.h
+
+#ifndef EXTRACT_H
+#define EXTRACT_H
+
+#include "archiveindex.h"
+#include "arena.h"
+#include "block.h"
+#include "bytereader.h"
+#include "bytewriter.h"
+#include "decompress.h"
+#include "log.h"
+#include "mappedfile.h"
+#include "options.h"
+#include "parse.h"
+#include "pipeline.h"
+#include "streams.h"
+
+#include <array>
+#include <ctype.h>
+#include <fstream>
+#include <iostream>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+bool extract(const char *inputFile, const char *outputFile, const Options &options);
+bool decompressIndexedBlock(const ArchiveIndex &index, uint32_t block, DecompressedBlockBuffer &buffer);
+bool parseHashString(const std::string &str, std::array<uint8_t, 32> &hash);
+
+/* Decompresses just the blocks asked for in options (a block hash, or a range of heights), using
+ * the archive's index. Only those blocks, and the parts of the index that refer to them, are
+ * read. They are written in the same format as the original .dat files, in height order. Returns
+ * whether they all were. */
+bool extract(const char *inputFile, const char *outputFile, const Options &options)
+{
+  std::ofstream outputFileStream;
+  std::ostream *out = openOutput(outputFile, outputFileStream);
+  logStream(LogLevel::INFO) << "Extracting blocks from \'" << inputFile << "\' as \'" << outputFile << "\'" << std::endl;
+  if (!out)
+  {
+    std::cout << std::endl;
+    return false;
+  }
+
+  // The index is read where it is, at the end of the archive, so this needs a real file. Only a
+  // few parts of it, and of the blocks, are read.
+  MappedFile archive;
+  if (!archive.open(inputFile, FileAccess::RANDOM))
+  {
+    std::cout << std::endl;
+    return false;
+  }
+
+  ByteReader headerReader(archive.data, archive.size);
+  ArchiveIndex index;
+  if (!parseArchiveHeader(headerReader) || !index.open(archive))
+  {
+    std::cout << std::endl;
+    return false;
+  }
+
+  std::vector<uint32_t> blocks;
+  if (!options.blockHash.empty())
+  {
+    std::array<uint8_t, 32> hash;
+    int64_t block = parseHashString(options.blockHash, hash) ? index.findHash(hash) : -1;
+    if (block < 0)
+    {
+      std::cout << "No block with hash " << options.blockHash << std::endl << std::endl;
+      return false;
+    }
+    blocks.push_back(block);
+  }
+  else
+  {
+    for (uint64_t height = options.firstHeight; height <= options.lastHeight; height++)
+    {
+      int64_t block = index.findHeight(height);
+      if (block < 0)
+      {
+        std::cout << "No block at height " << height << std::endl << std::endl;
+        return false;
+      }
+      blocks.push_back(block);
+    }
+  }
+
+  // With the index, the blocks don't depend on each other, so they are decompressed in parallel.
+  size_t window = 4 * options.nThreads;
+  std::vector<DecompressedBlockBuffer> buffers(window);
+
+  auto work = [&](size_t i) -> bool
+  {
+    DecompressedBlockBuffer &buffer = buffers[i % window];
+    buffer.clear();
+    return decompressIndexedBlock(index, blocks[i], buffer);
+  };
+
+  auto commit = [&](size_t i) -> bool
+  {
+    DecompressedBlockBuffer &buffer = buffers[i % window];
+    std::cout << buffer.log.str();
+    buffer.data.flushTo(*out);
+    return true;
+  };
+
+  bool ok = runOrderedPipeline(blocks.size(), options.nThreads, window, work, commit);
+  out->flush();
+  if (ok && !out->good())
+  {
+    std::cout << "Could not write \'" << outputFile << "\'" << std::endl;
+    ok = false;
+  }
+  return ok;
+}
+
+// Decompresses the given block (numbered in archive order) into buffer.
+bool decompressIndexedBlock(const ArchiveIndex &index, uint32_t block, DecompressedBlockBuffer &buffer)
+{
+  uint64_t offset = index.blockOffset(block);
+  if (offset > index.footerOffset)
+  {
+    std::cout << "Invalid block offset" << std::endl;
+    return false;
+  }
+
+  ByteReader in(index.archive->data + offset, index.footerOffset - offset);
+  buffer.block = parseCompressedBlock(in, buffer.arena, buffer.locations, buffer.headerFlags);
+  if (!buffer.block)
+  {
+    std::cout << "Could not parse block. Aborting." << std::endl;
+    return false;
+  }
+  if (!index.resolveTransactionHashes(block, buffer.block, buffer.locations))
+    return false;
+
+  // A merkle root that was left out is recomputed from the txids. (The block isn't serialized
+  // yet, so its buffer can be used to hash them.)
+  if (buffer.headerFlags & HeaderFlags::MERKLE_ROOT_IMPLICIT)
+  {
+    computeTransactionHashes(buffer.block->transactions.items, buffer.block->transactionCount, buffer.data);
+    buffer.data.clear();
+  }
+  resolveMerkleRoot(buffer.block, buffer.headerFlags);
+  HeaderContext previous = index.previousHeader(block);
+  resolveBlockHeader(buffer.block, buffer.headerFlags, previous);
+  if (logEnabled(LogLevel::DEBUG))
+  {
+    printBlockHeader(buffer.block, buffer.log);
+    buffer.log << std::endl;
+  }
+
+  writeDecompressedBlock(buffer.data, buffer.block);
+
+  // When we're done with the block, free up memory.
+  buffer.arena.reset();
+  return true;
+}
+
+// Parses a hash written in hex, as block explorers show them.
+bool parseHashString(const std::string &str, std::array<uint8_t, 32> &hash)
+{
+  if (str.size() != 64)
+    return false;
+  for (int i = 0; i < 32; i++)
+  {
+    int hi = str[2 * i], lo = str[2 * i + 1];
+    if (!isxdigit(hi) || !isxdigit(lo))
+      return false;
+    auto value = [](int c) { return isdigit(c) ? c - '0' : tolower(c) - 'a' + 10; };
+    hash[i] = value(hi) * 16 + value(lo);
+  }
+  return true;
+}
+
+#endif
@@ -3,6 +3,7 @@
 #ifndef INPUT_H
 #define INPUT_H
 
+#include "arena.h"
 #include "witness.h"
 
 #include <iomanip>
@@ -10,28 +11,18 @@
 
 #include <array>
 #include <stdint.h>
-#include <vector>
 
 struct Input
 {
-  ~Input();
   std::array<uint8_t, 32> prevTransactionHash;
   uint32_t prevTransactionIndex;
   uint64_t scriptLength; // varInt
-  uint8_t *script;
+  const uint8_t *script; // Points into the mapped input file, or into the block's arena
   uint32_t sequenceNumber;
   uint64_t witnessCount; // varInt
-  std::vector<Witness*> witnesses;
+  ArenaArray<Witness*> witnesses;
 };
 
-Input::~Input()
-{
-  if (script)
-    delete[] script;
-  for (auto p : witnesses)
-    delete p;
-}
-
 void printInput(Input * input)
 {
   std::cout << "Previous transaction hash: 0x";
@@ -0,0 +1,94 @@
+// inputscript.h
+
+#ifndef INPUTSCRIPT_H
+#define INPUTSCRIPT_H
+
+#include "signature.h"
+
+#include <stdint.h>
+#include <string.h>
+
+/* Most input scripts from before SegWit spend a P2PK output, with just a signature, or a P2PKH
+ * output, with a signature and a public key. A compressed input stores its script as a varint code:
+ *   2 * type + h                    the script follows one of the InputScriptTypes below
+ *   N_INPUT_SCRIPT_CODES + k        any other script, k bytes long. The script follows as is.
+ * h is 1 if the signature's hash type follows as a byte, and 0 if it is SIGHASH_ALL, as nearly
+ * all are. Then come r and s (see compressSignature()), then, except for P2PK, the public key
+ * as 33 bytes, even if it was uncompressed in the script. */
+struct InputScriptType
+{
+  static const uint8_t P2PK = 0; // <signature>
+  static const uint8_t P2PKH = 1; // <signature> <33-byte public key>
+  static const uint8_t P2PKH_UNCOMPRESSED = 2; // <signature> <65-byte public key>
+};
+
+static const uint8_t N_INPUT_SCRIPT_CODES = 6;
+static const uint8_t SIGHASH_ALL = 1;
+// Longest script that follows a template: both pushes, a signature and its hash type, and a key
+static const size_t MAX_TEMPLATED_INPUT_SCRIPT_SIZE = 1 + MAX_DER_SIGNATURE_SIZE + 1 + 1 + 65;
+
+// The parts of an input script that follows one of the templates
+struct SignatureScript
+{
+  uint8_t type;
+  uint8_t hashType;
+  uint8_t rs[64];
+  uint8_t publicKey[33];
+};
+
+bool matchInputScript(SignatureScript &parts, const uint8_t *script, uint64_t scriptLength);
+size_t buildInputScript(uint8_t *script, const SignatureScript &parts);
+
+// Splits an input script into its parts. Returns false if it doesn't follow a template.
+bool matchInputScript(SignatureScript &parts, const uint8_t *script, uint64_t scriptLength)
+{
+  // The signature and its hash type are pushed first, and are never longer than 73 bytes
+  if (scriptLength < 2 || script[0] < 9 || script[0] > MAX_DER_SIGNATURE_SIZE + 1 || script[0] + 1u > scriptLength)
+    return false;
+  size_t sigLength = script[0] - 1;
+  const uint8_t *signature = script + 1;
+  const uint8_t *rest = signature + sigLength + 1;
+  uint64_t restLength = scriptLength - (sigLength + 2);
+
+  if (restLength == 0)
+    parts.type = InputScriptType::P2PK;
+  else if (restLength == 34 && rest[0] == 33)
+  {
+    parts.type = InputScriptType::P2PKH;
+    memcpy(parts.publicKey, rest + 1, 33);
+  }
+  else if (restLength == 66 && rest[0] == 65 && compressPublicKey(parts.publicKey, rest + 1))
+    parts.type = InputScriptType::P2PKH_UNCOMPRESSED;
+  else
+    return false;
+
+  parts.hashType = signature[sigLength];
+  return compressSignature(parts.rs, signature, sigLength);
+}
+
+/* Puts an input script back together from its parts, and returns its length, or 0 if that can't
+ * be done. script must have room for MAX_TEMPLATED_INPUT_SCRIPT_SIZE bytes. */
+size_t buildInputScript(uint8_t *script, const SignatureScript &parts)
+{
+  size_t sigLength = expandSignature(script + 1, parts.rs);
+  script[0] = sigLength + 1;
+  script[sigLength + 1] = parts.hashType;
+  size_t n = sigLength + 2;
+
+  if (parts.type == InputScriptType::P2PKH)
+  {
+    script[n] = 33;
+    memcpy(script + n + 1, parts.publicKey, 33);
+    n += 34;
+  }
+  else if (parts.type == InputScriptType::P2PKH_UNCOMPRESSED)
+  {
+    script[n] = 65;
+    if (!decompressPublicKey(script + n + 1, parts.publicKey))
+      return 0;
+    n += 66;
+  }
+  return n;
+}
+
+#endif
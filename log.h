@@ -0,0 +1,113 @@
+// log.h
+
+#ifndef LOG_H
+#define LOG_H
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <unistd.h>
+
+/* Console output comes in levels. Errors are always printed. By default, so is what is being done,
+ * with a line of progress (see Progress); -q leaves those out, and -v adds the header of every
+ * block. Anything that costs something to format, like a block header, is only formatted once
+ * logEnabled() says its level is on, so a level that is off costs just that check. */
+struct LogLevel
+{
+  static const int ERROR = 0;
+  static const int INFO = 1; // What is being done, and how far along it is
+  static const int DEBUG = 2; // Every block's header
+};
+
+int logLevel = LogLevel::INFO;
+
+// How often the progress line is printed, in seconds, on a terminal and otherwise
+static const double PROGRESS_INTERVAL_TERMINAL = 1;
+static const double PROGRESS_INTERVAL = 10;
+
+/* A line saying how many blocks have been done, how fast, and, if the total is known, how long the
+ * rest will take. It goes to standard error, so that it doesn't end up in output going to standard
+ * output. On a terminal, it is redrawn in place. */
+struct Progress
+{
+  Progress(const char *action, uint64_t totalBytes);
+
+  void update(uint64_t blockBytes);
+  void finish();
+  void print(bool final);
+
+  const char *action; // e.g. "Compressed"
+  uint64_t totalBytes; // The bytes of input there are, or 0 if that isn't known
+  uint64_t blocks, bytes; // Done so far
+  std::chrono::steady_clock::time_point start, lastPrint;
+  bool terminal;
+};
+
+bool logEnabled(int level);
+std::ostream &logStream(int level);
+
+bool logEnabled(int level)
+{
+  return level <= logLevel;
+}
+
+// Where messages of the given level go. Those of a level that is off go nowhere, but are still
+// formatted; check logEnabled() first for anything that is done for every block.
+std::ostream &logStream(int level)
+{
+  static std::ostream nowhere(0);
+  return logEnabled(level) ? std::cout : nowhere;
+}
+
+Progress::Progress(const char *action, uint64_t totalBytes) : action(action), totalBytes(totalBytes), blocks(0),
+                                                              bytes(0), terminal(isatty(fileno(stderr)))
+{
+  start = lastPrint = std::chrono::steady_clock::now();
+}
+
+// Counts a block of blockBytes bytes of input as done, and prints the line if it is time to
+void Progress::update(uint64_t blockBytes)
+{
+  blocks++;
+  bytes += blockBytes;
+  if (!logEnabled(LogLevel::INFO))
+    return;
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  if (std::chrono::duration<double>(now - lastPrint).count() >= (terminal ? PROGRESS_INTERVAL_TERMINAL : PROGRESS_INTERVAL))
+  {
+    lastPrint = now;
+    print(false);
+  }
+}
+
+// Prints the line one last time, with the totals
+void Progress::finish()
+{
+  if (logEnabled(LogLevel::INFO))
+    print(true);
+}
+
+void Progress::print(bool final)
+{
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  double rate = seconds > 0 ? bytes / seconds : 0;
+
+  std::cerr << (terminal ? "\r" : "") << action << " " << blocks << " blocks, " << std::fixed << std::setprecision(1)
+            << bytes / 1e6 << " MB in " << seconds << " s (" << blocks / std::max(seconds, 1e-9) << " blocks/s, "
+            << rate / 1e6 << " MB/s)";
+  if (!final && totalBytes && rate > 0 && bytes <= totalBytes)
+  {
+    uint64_t eta = (totalBytes - bytes) / rate;
+    std::cerr << ", " << std::setprecision(0) << 100.0 * bytes / totalBytes << "%, " << eta / 3600 << ":"
+              << std::setfill('0') << std::setw(2) << eta / 60 % 60 << ":" << std::setw(2) << eta % 60
+              << std::setfill(' ') << " left";
+  }
+  // Pad over whatever was left of a longer line
+  std::cerr << (terminal ? "          " : "") << (final || !terminal ? "\n" : "") << std::flush;
+}
+
+#endif
@@ -2,38 +2,121 @@
 
 #include "compress.h"
 #include "decompress.h"
+#include "extract.h"
+#include "options.h"
 
 #include <iostream>
+#include <stdlib.h>
 #include <string.h>
 
 void printUsage();
 
 int main(int argc, char *argv[])
 {
-  bool compressMode = true;
+  char mode;
+  bool haveBlocks = false; // Whether the blocks to extract were given
+  Options options;
+  // Input and output may go through std::cin and std::cout. This makes them faster.
+  std::ios::sync_with_stdio(false);
+
   // Parse arguments
   // It would be nice to use getopt() here, but that is Unix-only.
-  // For now, we will require arguments to be specified in a particular way
-  if (argc != 4)
+  // For now, we will require arguments to be specified in a particular way:
+  // the mode first, then any options, then the input and output files.
+  // Verifying (-t) takes only an input file.
+  if (argc < 3)
   {
     printUsage();
     return 0;
   }
 
-  if (strcmp(argv[1], "-d") == 0)
-    compressMode = false;
-  else if (strcmp(argv[1], "-c") != 0)
+  if (strcmp(argv[1], "-c") == 0 || strcmp(argv[1], "-d") == 0 || strcmp(argv[1], "-x") == 0 ||
+      strcmp(argv[1], "-t") == 0)
+    mode = argv[1][1];
+  else
+  {
+    printUsage();
+    return 0;
+  }
+  int nFiles = mode == 't' ? 1 : 2;
+  if (argc < 2 + nFiles)
   {
     printUsage();
     return 0;
   }
 
-  if (compressMode)
-    compress(argv[2], argv[3]);
+  int i = 2;
+  for (; i < argc - nFiles; i++)
+  {
+    if (strcmp(argv[i], "-j") == 0 && i + 1 < argc - nFiles && atoi(argv[i + 1]) > 0)
+      options.nThreads = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc - nFiles && atof(argv[i + 1]) > 0)
+      options.memoryBudget = atof(argv[++i]) * 1024 * 1024;
+    else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc - nFiles && atoi(argv[i + 1]) > 0)
+      options.reorderWindow = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-T") == 0 && i + 1 < argc - nFiles)
+      options.tempDirectory = argv[++i];
+    else if (strcmp(argv[i], "-i") == 0)
+      options.writeIndex = true;
+    else if (strcmp(argv[i], "-r") == 0)
+      options.dropMerkleRoots = true;
+    else if (strcmp(argv[i], "--stats") == 0)
+      options.collectStats = true;
+    else if (strcmp(argv[i], "-v") == 0)
+      options.logLevel = LogLevel::DEBUG;
+    else if (strcmp(argv[i], "-q") == 0)
+      options.logLevel = LogLevel::ERROR;
+    else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc - nFiles)
+    {
+      // Either a single height, or first:last
+      char *end;
+      options.firstHeight = options.lastHeight = strtoull(argv[++i], &end, 10);
+      if (*end == ':')
+        options.lastHeight = strtoull(end + 1, &end, 10);
+      if (*end != 0 || options.lastHeight < options.firstHeight)
+      {
+        printUsage();
+        return 0;
+      }
+      haveBlocks = true;
+    }
+    else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc - nFiles)
+    {
+      options.blockHash = argv[++i];
+      haveBlocks = true;
+    }
+    else
+    {
+      printUsage();
+      return 0;
+    }
+  }
+
+  if (mode == 'x' && !haveBlocks)
+  {
+    printUsage();
+    return 0;
+  }
+
+  logLevel = options.logLevel;
+  Stats totals;
+  if (options.collectStats && mode != 'x')
+    stats = &totals;
+
+  bool ok;
+  if (mode == 'c')
+    ok = compress(argv[i], argv[i + 1], options);
+  else if (mode == 'd')
+    ok = decompress(argv[i], argv[i + 1], options);
+  else if (mode == 't')
+    ok = verify(argv[i], options);
   else
-    decompress(argv[2], argv[3]);
+    ok = extract(argv[i], argv[i + 1], options);
 
-  return 0;
+  if (stats)
+    printStats(*stats, std::cout);
+  // So that scripts can tell when something went wrong
+  return ok ? 0 : 1;
 }
 
 void printUsage()
@@ -41,6 +124,38 @@ void printUsage()
   std::cout << "Program usage:" << std::endl;
   std::cout << "To compress," << std::endl;
   std::cout << "\tbtcompress -c input_file output_file" << std::endl;
+  std::cout << "To compress every blk?????.dat file in a directory into one archive," << std::endl;
+  std::cout << "\tbtcompress -c blocks_directory output_file" << std::endl;
+  std::cout << "(Such an archive decompresses to the block files concatenated in order.)" << std::endl;
   std::cout << "To decompress," << std::endl;
   std::cout << "\tbtcompress -d input_file output_file" << std::endl;
+  std::cout << "To decompress only some blocks, from an archive compressed with -i," << std::endl;
+  std::cout << "\tbtcompress -x -n height input_file output_file" << std::endl;
+  std::cout << "\tbtcompress -x -n first_height:last_height input_file output_file" << std::endl;
+  std::cout << "\tbtcompress -x -b block_hash input_file output_file" << std::endl;
+  std::cout << "(Heights count from the first block in the archive.)" << std::endl;
+  std::cout << "To check that an archive decompresses, without writing anything," << std::endl;
+  std::cout << "\tbtcompress -t input_file" << std::endl;
+  std::cout << "(Every block is decompressed in memory. Its header must meet mainnet's proof of" << std::endl;
+  std::cout << "work, and its transactions must match its merkle root and witness commitment.)" << std::endl;
+  std::cout << "A file name of - means standard input or output. Blocks from standard input, a pipe" << std::endl;
+  std::cout << "or a socket are compressed in one pass, as they arrive." << std::endl;
+  std::cout << "The exit status is 1 if any block could not be compressed, decompressed or checked." << std::endl;
+  std::cout << "Options (between the mode and the file names):" << std::endl;
+  std::cout << "\t-j threads\tNumber of worker threads (default: one per core)" << std::endl;
+  std::cout << "\t-m megabytes\tKeep the transaction hashes within this much memory, using" << std::endl;
+  std::cout << "\t\t\ttemporary files (default: no limit, which for mainnet means the" << std::endl;
+  std::cout << "\t\t\thashes of the last 65536 blocks, several GB). When decompressing," << std::endl;
+  std::cout << "\t\t\thalf of it goes to the hashes, and half to blocks waiting to be" << std::endl;
+  std::cout << "\t\t\twritten out in their original order (default: 256 for those)" << std::endl;
+  std::cout << "\t-w blocks\tWhen compressing a stream, hold back this many blocks to put them" << std::endl;
+  std::cout << "\t\t\tin order of time (default: 64)" << std::endl;
+  std::cout << "\t-T directory\tWhere to put temporary files (default: $TMPDIR or /tmp)" << std::endl;
+  std::cout << "\t-i\t\tWhen compressing, add an index for decompressing single blocks with -x" << std::endl;
+  std::cout << "\t-r\t\tWhen compressing, leave out merkle roots. They are recomputed from the" << std::endl;
+  std::cout << "\t\t\ttransactions when decompressing." << std::endl;
+  std::cout << "\t-v\t\tPrint the header of every block" << std::endl;
+  std::cout << "\t-q\t\tPrint nothing but errors" << std::endl;
+  std::cout << "\t--stats\t\tWhen compressing, decompressing or verifying, print where the bytes and the time" << std::endl;
+  std::cout << "\t\t\twent at the end" << std::endl;
 }
@@ -0,0 +1,88 @@
+// mappedfile.h
+
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include <iostream>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// How a MappedFile is going to be read, so that the kernel can read ahead (or not) to match
+struct FileAccess
+{
+  static const int SEQUENTIAL = 0; // Roughly front to back, like blocks in a .dat file
+  static const int RANDOM = 1; // Here and there, like single blocks out of an archive
+};
+
+// A read-only view of an entire file, mapped into memory.
+// This uses mmap(), so, unlike the rest of the program, it is Unix-only.
+struct MappedFile
+{
+  MappedFile() : data(0), size(0) {}
+  ~MappedFile() { close(); }
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator= (const MappedFile &) = delete;
+
+  bool open(const char *fileName, int access);
+  void close();
+
+  const uint8_t *data;
+  size_t size;
+};
+
+bool MappedFile::open(const char *fileName, int access)
+{
+  close();
+
+  int fd = ::open(fileName, O_RDONLY);
+  if (fd < 0)
+  {
+    std::cout << "Could not open file \'" << fileName << "\'" << std::endl;
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0)
+  {
+    std::cout << "Could not stat file \'" << fileName << "\'" << std::endl;
+    ::close(fd);
+    return false;
+  }
+
+  // mmap() refuses zero-length mappings, but an empty file is still a valid (empty) input.
+  size = st.st_size;
+  if (size > 0)
+  {
+    void *p = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED)
+    {
+      std::cout << "Could not map file \'" << fileName << "\'" << std::endl;
+      ::close(fd);
+      size = 0;
+      return false;
+    }
+    // Read ahead aggressively when the file is read in order. Otherwise, reading ahead would just
+    // fill memory with pages that aren't needed.
+    madvise(p, size, access == FileAccess::SEQUENTIAL ? MADV_SEQUENTIAL : MADV_RANDOM);
+    data = (const uint8_t*)p;
+  }
+
+  // The mapping stays valid after the descriptor is closed.
+  ::close(fd);
+  return true;
+}
+
+void MappedFile::close()
+{
+  if (data)
+    munmap((void*)data, size);
+  data = 0;
+  size = 0;
+}
+
+#endif
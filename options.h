@@ -0,0 +1,41 @@
+// options.h
+
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+#include "log.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string>
+#include <thread>
+
+// Settings that can be changed from the command line.
+struct Options
+{
+  Options() : nThreads(std::thread::hardware_concurrency()), memoryBudget(0), reorderWindow(64),
+              writeIndex(false), dropMerkleRoots(false), collectStats(false),
+              logLevel(LogLevel::INFO), firstHeight(0), lastHeight(0)
+  {
+    // hardware_concurrency() is allowed to return 0 if it can't tell
+    if (nThreads == 0)
+      nThreads = 1;
+
+    const char *tmp = getenv("TMPDIR");
+    tempDirectory = tmp && *tmp ? tmp : "/tmp";
+  }
+
+  unsigned nThreads; // Number of threads used to parse and (de)compress blocks
+  size_t memoryBudget; // Bytes the transaction hashes may use (see -m); 0 for no limit
+  std::string tempDirectory; // Where to put temporary files
+  size_t reorderWindow; // How many blocks from a stream are held back to put them in order of time
+  bool writeIndex; // Whether to add an index to the archive, for decompressing single blocks
+  bool dropMerkleRoots; // Whether to leave merkle roots out of the archive, to be recomputed
+  bool collectStats; // Whether to print where the bytes and the time went (see Stats)
+  int logLevel; // How much to print (see LogLevel)
+  uint64_t firstHeight, lastHeight; // The blocks to extract from an archive...
+  std::string blockHash; // ...or the hash of the one block to extract, if this isn't empty
+};
+
+#endif
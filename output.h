@@ -7,11 +7,9 @@
 
 struct Output
 {
-  ~Output() { if (script) delete[] script; }
-
   uint64_t value;
   uint64_t scriptLength; // varInt
-  uint8_t *script;
+  const uint8_t *script; // Points into the mapped input file, or into the block's arena
 };
 
 void printOutput(Output * output)
@@ -0,0 +1,61 @@
+// outputscript.h
+
+#ifndef OUTPUTSCRIPT_H
+#define OUTPUTSCRIPT_H
+
+#include <stdint.h>
+#include <string.h>
+
+/* Nearly every output script follows one of a few standard templates, in which only a key or a
+ * hash varies. A compressed output stores its script as a varint code:
+ *   n < N_OUTPUT_SCRIPT_TEMPLATES   the script follows template n. Only its payload follows.
+ *   N_OUTPUT_SCRIPT_TEMPLATES + k   any other script, k bytes long. The script follows as is.
+ * The templates are never reordered, as that would change what archives mean. */
+struct OutputScriptTemplate
+{
+  const char *name;
+  uint8_t prefixLength;
+  uint8_t prefix[3];
+  uint8_t payloadLength;
+  uint8_t suffixLength;
+  uint8_t suffix[2];
+
+  uint64_t length() const { return prefixLength + payloadLength + suffixLength; }
+};
+
+static const OutputScriptTemplate OUTPUT_SCRIPT_TEMPLATES[] =
+{
+  // OP_DUP OP_HASH160 <20 bytes> OP_EQUALVERIFY OP_CHECKSIG
+  { "P2PKH", 3, { 0x76, 0xa9, 0x14 }, 20, 2, { 0x88, 0xac } },
+  // OP_HASH160 <20 bytes> OP_EQUAL
+  { "P2SH", 2, { 0xa9, 0x14 }, 20, 1, { 0x87 } },
+  // OP_0 <20 bytes>
+  { "P2WPKH", 2, { 0x00, 0x14 }, 20, 0, {} },
+  // OP_0 <32 bytes>
+  { "P2WSH", 2, { 0x00, 0x20 }, 32, 0, {} },
+  // OP_1 <32 bytes>
+  { "P2TR", 2, { 0x51, 0x20 }, 32, 0, {} },
+  // <33-byte public key> OP_CHECKSIG
+  { "P2PK", 1, { 0x21 }, 33, 1, { 0xac } },
+  // <65-byte public key> OP_CHECKSIG. Most early coinbase outputs look like this.
+  { "P2PK (uncompressed)", 1, { 0x41 }, 65, 1, { 0xac } }
+};
+
+static const uint8_t N_OUTPUT_SCRIPT_TEMPLATES = sizeof(OUTPUT_SCRIPT_TEMPLATES) / sizeof(OutputScriptTemplate);
+
+int findOutputScriptTemplate(const uint8_t *script, uint64_t scriptLength);
+
+// Returns the number of the template the script follows, or -1 if there isn't one.
+int findOutputScriptTemplate(const uint8_t *script, uint64_t scriptLength)
+{
+  for (int n = 0; n < N_OUTPUT_SCRIPT_TEMPLATES; n++)
+  {
+    const OutputScriptTemplate &t = OUTPUT_SCRIPT_TEMPLATES[n];
+    if (scriptLength == t.length() && memcmp(script, t.prefix, t.prefixLength) == 0 &&
+        memcmp(script + t.prefixLength + t.payloadLength, t.suffix, t.suffixLength) == 0)
+      return n;
+  }
+  return -1;
+}
+
+#endif
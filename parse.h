@@ -3,67 +3,94 @@
 #ifndef PARSE_H
 #define PARSE_H
 
+#include "amount.h"
+#include "arena.h"
 #include "block.h"
+#include "blockheader.h"
+#include "bytereader.h"
+#include "columns.h"
+#include "inputscript.h"
+#include "outputscript.h"
+#include "rans.h"
+#include "txhashlocation.h"
+#include "witnessstack.h"
 
 #include <array>
-#include <fstream>
 #include <iostream>
 #include <stdint.h>
-
-extern std::vector<std::array<uint8_t, 32>> txHashTable;
-
-Block *parseBlock(std::ifstream &fin);
-Input *parseInput(std::ifstream &fin);
-Output *parseOutput(std::ifstream &fin);
-Transaction *parseTransaction(std::ifstream &fin);
-
-Block *parseCompressedBlock(std::ifstream &fin);
-Input *parseCompressedInput(std::ifstream &fin, const uint8_t flags);
-Output *parseCompressedOutput(std::ifstream &fin);
-Transaction *parseCompressedTransaction(std::ifstream &fin);
-void parseCompressedTransactionHash(std::ifstream &fin, std::array<uint8_t, 32> &hash);
-
-void readHash(std::ifstream &fin, char *buffer, int nBytes);
-uint64_t readVarInt(std::ifstream &fin);
-
-Block *parseBlock(std::ifstream &fin)
+#include <string.h>
+#include <vector>
+
+/* An archive starts with ARCHIVE_MAGIC_NUMBER and ARCHIVE_VERSION, as u32s. Then comes a sequence
+ * of compressed blocks, roughly in order of time. Each one is preceded by a u32 giving its position
+ * in the original input, and the last one is followed by END_OF_ARCHIVE in place of that. An index
+ * (see archiveindex.h) may come after.
+ * The version goes up whenever the format changes, and archives with any other version are turned
+ * away rather than read as if they were corrupt. So are those from before archives had a header,
+ * which don't start with the magic number. */
+static const uint32_t ARCHIVE_MAGIC_NUMBER = 0x41435442; // "BTCA"
+static const uint32_t ARCHIVE_VERSION = 1;
+static const uint32_t END_OF_ARCHIVE = 0xffffffff;
+
+Block *parseBlock(ByteReader &in, Arena &arena);
+Input *parseInput(ByteReader &in, Arena &arena);
+Output *parseOutput(ByteReader &in, Arena &arena);
+Transaction *parseTransaction(ByteReader &in, Arena &arena);
+
+bool parseArchiveHeader(ByteReader &in);
+bool parseColumns(ByteReader &in, Arena &arena, ByteReader columns[Column::COUNT]);
+Block *parseCompressedBlock(ByteReader &in, Arena &arena, std::vector<TxHashLocation> &locations, uint8_t &headerFlags);
+Input *parseCompressedInput(ColumnReaders &in, Arena &arena, const uint8_t flags, std::vector<TxHashLocation> &locations);
+const uint8_t *parseCompressedInputScript(ColumnReaders &in, Arena &arena, uint64_t &scriptLength);
+Output *parseCompressedOutput(ColumnReaders &in, Arena &arena);
+const uint8_t *parseCompressedOutputScript(ColumnReaders &in, Arena &arena, uint64_t &scriptLength);
+Transaction *parseCompressedTransaction(ColumnReaders &in, Arena &arena, std::vector<TxHashLocation> &locations);
+bool parseCompressedTransactionHash(ColumnReaders &in, std::array<uint8_t, 32> &hash, TxHashLocation &location);
+bool parseCompressedWitnessStack(ColumnReaders &in, Arena &arena, Input *input);
+
+void readHash(ByteReader &in, char *buffer, int nBytes);
+uint64_t readVarInt(ByteReader &in);
+uint64_t readBase128(ByteReader &in);
+
+// The following parse a block directly out of memory (e.g. a MappedFile). Scripts and witness
+// items are not copied; they point into the underlying bytes, which must therefore outlive the
+// parsed block. Everything else is allocated from the given arena, and is freed by resetting it.
+
+Block *parseBlock(ByteReader &in, Arena &arena)
 {
-  // Make sure file stream is open
-  if (!fin.good())
-  {
-    std::cout << "Attempting to parse block from invalid filestream" << std::endl;
-    return 0;
-  }
-
   // Make sure it is pointing to a block (check magic number)
   uint32_t magicNumber;
-  fin.read((char*)&magicNumber, sizeof(uint32_t));
+  in.read(&magicNumber, sizeof(uint32_t));
   if (magicNumber != Block::MAGIC_NUMBER)
   {
-    std::cout << "Filestream is not pointing to a valid block" << std::endl;
+    std::cout << "Input is not pointing to a valid block" << std::endl;
     if (magicNumber == Block::MAGIC_NUMBER_REVERSE)
       std::cout << "This is likely a endianness issue" << std::endl;
     return 0;
   }
 
-  Block *block = new Block;
-  fin.read((char*)&block->size, sizeof(uint32_t));
-  fin.read((char*)&block->version, sizeof(uint32_t));
-  //fin.read((char*)&block->hashPrevBlock, 32);
-  //fin.read((char*)&block->hashMerkleRoot, 32);
-  readHash(fin, (char*)&block->hashPrevBlock, 32);
-  readHash(fin, (char*)&block->hashMerkleRoot, 32);
-  fin.read((char*)&block->time, sizeof(uint32_t));
-  fin.read((char*)&block->bits, sizeof(uint32_t));
-  fin.read((char*)&block->nonce, sizeof(uint32_t));
+  Block *block = arena.create<Block>();
+  in.read(&block->size, sizeof(uint32_t));
+  in.read(&block->version, sizeof(uint32_t));
+  readHash(in, (char*)&block->hashPrevBlock, 32);
+  readHash(in, (char*)&block->hashMerkleRoot, 32);
+  in.read(&block->time, sizeof(uint32_t));
+  in.read(&block->bits, sizeof(uint32_t));
+  in.read(&block->nonce, sizeof(uint32_t));
   block->computeHash();
 
-  block->transactionCount = readVarInt(fin);
-  block->transactions.resize(block->transactionCount);
+  // Every transaction takes at least 60 bytes. Don't trust a count that can't possibly fit.
+  block->transactionCount = readVarInt(in);
+  if (!in.good() || block->transactionCount > in.remaining() / 60)
+  {
+    std::cout << "Block header is invalid. Aborting." << std::endl;
+    return 0;
+  }
+  block->transactions.allocate(arena, block->transactionCount);
 
-  for (int i = 0; i < block->transactionCount; i++)
+  for (uint64_t i = 0; i < block->transactionCount; i++)
   {
-    block->transactions[i] = parseTransaction(fin);
+    block->transactions[i] = parseTransaction(in, arena);
     if (!block->transactions[i])
     {
       std::cout << "Failed to parse transaction. Aborting." << std::endl;
@@ -74,73 +101,66 @@ Block *parseBlock(std::ifstream &fin)
   return block;
 }
 
-Input *parseInput(std::ifstream &fin)
+Input *parseInput(ByteReader &in, Arena &arena)
 {
-  // Make sure file stream is open
-  if (!fin.good())
-  {
-    std::cout << "Attempting to parse input from invalid filestream" << std::endl;
-    return 0;
-  }
-
-  Input *input = new Input;
-  if (!input)
+  Input *input = arena.create<Input>();
+  readHash(in, (char*)&input->prevTransactionHash, 32);
+  in.read(&input->prevTransactionIndex, sizeof(uint32_t));
+  input->scriptLength = readVarInt(in);
+  input->script = in.take(input->scriptLength);
+  in.read(&input->sequenceNumber, sizeof(uint32_t));
+
+  if (!in.good())
   {
-    std::cout << "Could not allocate memory for input. Aborting." << std::endl;
     return 0;
   }
-  readHash(fin, (char*)&input->prevTransactionHash, 32);
-  fin.read((char*)&input->prevTransactionIndex, sizeof(uint32_t));
-  input->scriptLength = readVarInt(fin);
-  input->script = new uint8_t[input->scriptLength];
-  fin.read((char*)input->script, input->scriptLength);
-  fin.read((char*)&input->sequenceNumber, sizeof(uint32_t));
-
   return input;
 }
 
-Output *parseOutput(std::ifstream &fin)
+Output *parseOutput(ByteReader &in, Arena &arena)
 {
-  if (!fin.good())
+  Output *output = arena.create<Output>();
+  in.read(&output->value, sizeof(uint64_t));
+  output->scriptLength = readVarInt(in);
+  output->script = in.take(output->scriptLength);
+
+  if (!in.good())
   {
-    std::cout << "Attempting to parse output from invalid filestream" << std::endl;
     return 0;
   }
-
-  Output *output = new Output;
-  fin.read((char*)&output->value, sizeof(uint64_t));
-  output->scriptLength = readVarInt(fin);
-  output->script = new uint8_t[output->scriptLength];
-  fin.read((char*)output->script, output->scriptLength);
-
   return output;
 }
 
-Transaction *parseTransaction(std::ifstream &fin)
+Transaction *parseTransaction(ByteReader &in, Arena &arena)
 {
-  // Make sure file stream is open
-  if (!fin.good())
+  if (!in.good())
   {
-    std::cout << "Attempting to parse transaction from invalid filestream" << std::endl;
+    std::cout << "Attempting to parse transaction past the end of the input" << std::endl;
     return 0;
   }
 
-  Transaction *transaction = new Transaction;
-  fin.read((char*)&transaction->version, sizeof(uint32_t));
+  Transaction *transaction = arena.create<Transaction>();
+  in.read(&transaction->version, sizeof(uint32_t));
 
   // Check if the flag is present.
   transaction->flag = false;
-  if (fin.peek() == 0) // If the next byte is 0x00
+  if (in.peek() == 0) // If the next byte is 0x00
   {
     transaction->flag = true;
-    fin.ignore(2); // Skip the next two bytes
+    in.skip(2); // Skip the next two bytes
   }
 
-  transaction->inputCount = readVarInt(fin);
-  transaction->inputs.resize(transaction->inputCount);
+  transaction->inputCount = readVarInt(in);
+  // Every input takes at least 41 bytes. Don't trust a count that can't possibly fit.
+  if (transaction->inputCount > in.remaining() / 41)
+  {
+    std::cout << "Invalid input count. Aborting." << std::endl;
+    return 0;
+  }
+  transaction->inputs.allocate(arena, transaction->inputCount);
   for (uint64_t i = 0; i < transaction->inputCount; i++)
   {
-    transaction->inputs[i] = parseInput(fin);
+    transaction->inputs[i] = parseInput(in, arena);
     if (!transaction->inputs[i])
     {
       std::cout << "Failed to parse input. Aborting." << std::endl;
@@ -148,11 +168,17 @@ Transaction *parseTransaction(std::ifstream &fin)
     }
   }
 
-  transaction->outputCount = readVarInt(fin);
-  transaction->outputs.resize(transaction->outputCount);
+  transaction->outputCount = readVarInt(in);
+  // Likewise, every output takes at least 9 bytes.
+  if (transaction->outputCount > in.remaining() / 9)
+  {
+    std::cout << "Invalid output count. Aborting." << std::endl;
+    return 0;
+  }
+  transaction->outputs.allocate(arena, transaction->outputCount);
   for (uint64_t i = 0; i < transaction->outputCount; i++)
   {
-    transaction->outputs[i] = parseOutput(fin);
+    transaction->outputs[i] = parseOutput(in, arena);
     if (!transaction->outputs[i])
     {
       std::cout << "Failed to parse output. Aborting." << std::endl;
@@ -161,76 +187,168 @@ Transaction *parseTransaction(std::ifstream &fin)
   }
 
   // Handle witnesses
+  for (Input *input : transaction->inputs)
+    input->witnessCount = 0;
   if (transaction->flag)
   {
-    for (uint64_t i = 0; i < transaction->inputCount; i++)
+    for (Input *input : transaction->inputs)
     {
-      Input *input = transaction->inputs[i];
-      input->witnessCount = readVarInt(fin);
-      input->witnesses.resize(input->witnessCount);
+      input->witnessCount = readVarInt(in);
+      if (input->witnessCount > in.remaining())
+      {
+        std::cout << "Invalid witness count. Aborting." << std::endl;
+        return 0;
+      }
+      input->witnesses.allocate(arena, input->witnessCount);
       for (uint64_t j = 0; j < input->witnessCount; j++)
       {
-        input->witnesses[j] = new Witness;
-        Witness *w = input->witnesses[j];
-        if (!input->witnesses[j])
-        {
-          std::cout << "Could not allocate memory for witness data. Aborting" << std::endl;
-          return 0;
-        }
-        w->size = readVarInt(fin);
-        w->data.resize(w->size);
-        for (uint64_t k = 0; k < w->size; k++)
-        {
-          uint8_t tmp;
-          fin.read((char*)&tmp, 1);
-          w->data[k] = tmp;
-        }
+        Witness *w = input->witnesses[j] = arena.create<Witness>();
+        w->size = readVarInt(in);
+        w->data = in.take(w->size);
       }
     }
   }
-  fin.read((char*)&transaction->lockTime, sizeof(uint32_t));
+  in.read(&transaction->lockTime, sizeof(uint32_t));
 
+  if (!in.good())
+  {
+    std::cout << "Transaction is truncated. Aborting." << std::endl;
+    return 0;
+  }
   return transaction;
 }
 
-Block *parseCompressedBlock(std::ifstream &fin)
+// The compressed parsers also read from memory (a mapped archive). As with parseBlock(), scripts
+// and witness items point into the archive rather than being copied, unless they have to be put
+// back together (see InputScriptType, OutputScriptTemplate and WitnessStackType) or come from a
+// rANS coded column (see Column), in which case they are allocated from the arena.
+// The previous transaction hashes of inputs can usually not be filled in yet, because they refer
+// to other transactions in the archive. Where to find each one is added to locations instead, in
+// input order, and the caller fills in the hashes once the transactions they refer to are known.
+// Likewise, the block header is only complete once the caller has passed it and headerFlags to
+// resolveMerkleRoot(), then resolveBlockHeader(), which also computes the block's hash.
+
+// Reads the magic number and version at the start of an archive. Returns whether they can be read.
+bool parseArchiveHeader(ByteReader &in)
 {
-  // Make sure file stream is open
-  if (!fin.good())
+  uint32_t magicNumber = 0, version = 0;
+  in.read(&magicNumber, sizeof(uint32_t));
+  in.read(&version, sizeof(uint32_t));
+  if (!in.good())
   {
-    std::cout << "Attempting to parse block from invalid filestream" << std::endl;
-    return 0;
+    std::cout << "Compressed file is truncated" << std::endl;
+    return false;
+  }
+  if (magicNumber != ARCHIVE_MAGIC_NUMBER)
+  {
+    std::cout << "Unsupported archive version: the archive has no header, so it is either not an archive "
+              << "or was written by a version of btcompress from before archive version 1" << std::endl;
+    return false;
   }
+  if (version != ARCHIVE_VERSION)
+  {
+    std::cout << "Unsupported archive version " << version << " (this version of btcompress reads version "
+              << ARCHIVE_VERSION << ")" << std::endl;
+    return false;
+  }
+  return true;
+}
 
+/* Reads the columns of a columnar block (see Column), decoding those that are rANS coded into the
+ * arena. in must hold just the columns. Returns false if they aren't valid. */
+bool parseColumns(ByteReader &in, Arena &arena, ByteReader columns[Column::COUNT])
+{
+  uint64_t total = 0;
+  for (int c = 0; c < Column::COUNT; c++)
+  {
+    uint64_t code = readVarInt(in);
+    uint64_t size = code / 2;
+    if (!in.good() || size > MAX_COLUMNS_SIZE - total)
+      return false;
+    total += size;
+
+    if (code % 2 == 0)
+    {
+      const uint8_t *data = in.take(size);
+      if (!data)
+        return false;
+      columns[c] = ByteReader(data, size);
+    }
+    else
+    {
+      uint64_t encodedSize = readVarInt(in);
+      const uint8_t *encodedData = in.take(encodedSize);
+      if (!encodedData || size == 0)
+        return false;
+      ByteReader encoded(encodedData, encodedSize);
+      uint8_t *data = arena.createArray<uint8_t>(size);
+      if (!ransDecode(encoded, data, size) || encoded.remaining() != 0)
+        return false;
+      columns[c] = ByteReader(data, size);
+    }
+  }
+  return in.remaining() == 0;
+}
+
+Block *parseCompressedBlock(ByteReader &in, Arena &arena, std::vector<TxHashLocation> &locations, uint8_t &headerFlags)
+{
   // Make sure it is pointing to a block (check magic number)
   uint32_t magicNumber;
-  fin.read((char*)&magicNumber, sizeof(uint32_t));
-  if (magicNumber != Block::MAGIC_NUMBER)
+  in.read(&magicNumber, sizeof(uint32_t));
+  if (magicNumber != COLUMNAR_MAGIC_NUMBER)
   {
-    std::cout << "Filestream is not pointing to a valid block" << std::endl;
-    if (magicNumber == Block::MAGIC_NUMBER_REVERSE)
-      std::cout << "This is likely a endianness issue" << std::endl;
+    std::cout << "Input is not pointing to a valid block" << std::endl;
     return 0;
   }
 
-  Block *block = new Block;
-  fin.read((char*)&block->size, sizeof(uint32_t));
-  fin.read((char*)&block->version, sizeof(uint32_t));
-  //fin.read((char*)&block->hashPrevBlock, 32);
-  //fin.read((char*)&block->hashMerkleRoot, 32);
-  readHash(fin, (char*)&block->hashPrevBlock, 32);
-  readHash(fin, (char*)&block->hashMerkleRoot, 32);
-  fin.read((char*)&block->time, sizeof(uint32_t));
-  fin.read((char*)&block->bits, sizeof(uint32_t));
-  fin.read((char*)&block->nonce, sizeof(uint32_t));
-  block->computeHash();
+  Block *block = arena.create<Block>();
+  in.read(&block->size, sizeof(uint32_t));
+
+  ByteReader columns[Column::COUNT];
+  ColumnReaders readers;
+  for (int c = 0; c < Column::COUNT; c++)
+    readers.columns[c] = &columns[c];
+  const uint8_t *data = in.take(block->size);
+  ByteReader columnReader(data, data ? block->size : 0);
+  if (!data || !parseColumns(columnReader, arena, columns))
+  {
+    std::cout << "Block columns are invalid. Aborting." << std::endl;
+    return 0;
+  }
 
-  block->transactionCount = readVarInt(fin);
-  block->transactions.resize(block->transactionCount);
+  // See HeaderFlags. The time is just the difference from the previous block's, for now.
+  ByteReader &chain = readers[Column::CHAIN];
+  headerFlags = 0xff;
+  chain.read(&headerFlags, 1);
+  if (headerFlags & ~(HeaderFlags::PREV_BLOCK_IMPLICIT | HeaderFlags::VERSION_SAME | HeaderFlags::BITS_SAME |
+                      HeaderFlags::MERKLE_ROOT_IMPLICIT))
+    chain.fail();
+  if (!(headerFlags & HeaderFlags::PREV_BLOCK_IMPLICIT))
+    readHash(chain, (char*)&block->hashPrevBlock, 32);
+  if (!(headerFlags & HeaderFlags::VERSION_SAME))
+    chain.read(&block->version, sizeof(uint32_t));
+  if (!(headerFlags & HeaderFlags::BITS_SAME))
+    chain.read(&block->bits, sizeof(uint32_t));
+  uint64_t time = readBase128(chain);
+  if (time > UINT32_MAX)
+    chain.fail();
+  block->time = zigzagDecode(time);
+  if (!(headerFlags & HeaderFlags::MERKLE_ROOT_IMPLICIT))
+    readHash(readers[Column::HEADERS], (char*)&block->hashMerkleRoot, 32);
+  readers[Column::HEADERS].read(&block->nonce, sizeof(uint32_t));
+
+  // Every transaction has a byte of flags
+  block->transactionCount = readVarInt(readers[Column::COUNTS]);
+  if (!readers.good() || block->transactionCount > readers[Column::FLAGS].remaining())
+  {
+    std::cout << "Block header is invalid. Aborting." << std::endl;
+    return 0;
+  }
+  block->transactions.allocate(arena, block->transactionCount);
 
-  for (int i = 0; i < block->transactionCount; i++)
+  for (uint64_t i = 0; i < block->transactionCount; i++)
   {
-    block->transactions[i] = parseCompressedTransaction(fin);
+    block->transactions[i] = parseCompressedTransaction(readers, arena, locations);
     if (!block->transactions[i])
     {
       std::cout << "Failed to parse transaction. Aborting." << std::endl;
@@ -238,93 +356,138 @@ Block *parseCompressedBlock(std::ifstream &fin)
     }
   }
 
-  printBlockHeader(block);
-  std::cout << std::endl;
+  // Whatever is left over in a column means the block isn't what it seems
+  for (int c = 0; c < Column::COUNT; c++)
+  {
+    if (columns[c].remaining() != 0)
+    {
+      std::cout << "Block columns are invalid. Aborting." << std::endl;
+      return 0;
+    }
+  }
 
   return block;
 }
 
-Input *parseCompressedInput(std::ifstream &fin, const uint8_t flags)
+Input *parseCompressedInput(ColumnReaders &in, Arena &arena, const uint8_t flags, std::vector<TxHashLocation> &locations)
 {
   static const uint8_t SEQUENCE_NUMBERS_DEFAULT = 0x8;
 
-  // Make sure file stream is open
-  if (!fin.good())
-  {
-    std::cout << "Attempting to parse input from invalid filestream" << std::endl;
-    return 0;
-  }
+  Input *input = arena.create<Input>();
+  input->witnessCount = 0;
 
-  Input *input = new Input;
-  if (!input)
+  TxHashLocation location;
+  if (!parseCompressedTransactionHash(in, input->prevTransactionHash, location))
   {
-    std::cout << "Could not allocate memory for input. Aborting." << std::endl;
+    std::cout << "Invalid transaction hash location. Aborting." << std::endl;
     return 0;
   }
-
-  parseCompressedTransactionHash(fin, input->prevTransactionHash);
-  input->prevTransactionIndex = readVarInt(fin);
-  //fin.read((char*)&input->prevTransactionIndex, sizeof(uint32_t));
-  input->scriptLength = readVarInt(fin);
-  if (input->scriptLength > 1000)
-    exit(1);
-  input->script = new uint8_t[input->scriptLength];
-  fin.read((char*)input->script, input->scriptLength);
+  locations.push_back(location);
+  input->prevTransactionIndex = readVarInt(in[Column::PREV_INDICES]);
+  input->script = parseCompressedInputScript(in, arena, input->scriptLength);
 
   if (flags & SEQUENCE_NUMBERS_DEFAULT)
     input->sequenceNumber = 0xffffffff;
   else
   {
     uint64_t tmp;
-    tmp = readVarInt(fin);
+    tmp = readVarInt(in[Column::SEQUENCES]);
     input->sequenceNumber = tmp ^ 0xffffffff;
-    //fin.read((char*)&input->sequenceNumber, sizeof(uint32_t));
   }
 
+  if (!in.good())
+  {
+    return 0;
+  }
   return input;
 }
 
-Output *parseCompressedOutput(std::ifstream &fin)
+// Reads an input script stored as in InputScriptType. A script that follows a template is put
+// back together in the arena; any other script points into the archive.
+const uint8_t *parseCompressedInputScript(ColumnReaders &in, Arena &arena, uint64_t &scriptLength)
 {
-  if (!fin.good())
+  uint64_t code = readVarInt(in[Column::SCRIPT_CODES]);
+  if (code >= N_INPUT_SCRIPT_CODES)
   {
-    std::cout << "Attempting to parse output from invalid filestream" << std::endl;
+    scriptLength = code - N_INPUT_SCRIPT_CODES;
+    return in[Column::SCRIPTS].take(scriptLength);
+  }
+
+  SignatureScript parts;
+  parts.type = code / 2;
+  parts.hashType = SIGHASH_ALL;
+  if (code % 2)
+    in[Column::SCRIPT_CODES].read(&parts.hashType, 1);
+  in[Column::SIGNATURES].read(parts.rs, 64);
+  if (parts.type != InputScriptType::P2PK)
+    in[Column::KEYS].read(parts.publicKey, 33);
+
+  uint8_t buffer[MAX_TEMPLATED_INPUT_SCRIPT_SIZE];
+  scriptLength = in.good() ? buildInputScript(buffer, parts) : 0;
+  if (scriptLength == 0)
+  {
+    // Not a public key
+    in[Column::KEYS].fail();
     return 0;
   }
+  uint8_t *script = arena.createArray<uint8_t>(scriptLength);
+  memcpy(script, buffer, scriptLength);
+  return script;
+}
 
-  Output *output = new Output;
-  //fin.read((char*)&output->value, sizeof(uint64_t));
-  output->value = readVarInt(fin);
-  output->scriptLength = readVarInt(fin);
-  if (output->scriptLength > 1000)
-    exit(1);
-  output->script = new uint8_t[output->scriptLength];
-  fin.read((char*)output->script, output->scriptLength);
+Output *parseCompressedOutput(ColumnReaders &in, Arena &arena)
+{
+  Output *output = arena.create<Output>();
+  // A code of 0 means the value was too big to compress (see writeCompressedTransactionOutput()).
+  uint64_t amount = readBase128(in[Column::AMOUNTS]);
+  if (amount)
+    output->value = decompressAmount(amount - 1);
+  else
+    in[Column::AMOUNTS].read(&output->value, sizeof(uint64_t));
+  output->script = parseCompressedOutputScript(in, arena, output->scriptLength);
 
+  if (!in.good())
+  {
+    return 0;
+  }
   return output;
 }
 
-Transaction *parseCompressedTransaction(std::ifstream &fin)
+// Reads an output script stored as in OutputScriptTemplate. A script that follows a template is
+// put back together in the arena; any other script points into the archive.
+const uint8_t *parseCompressedOutputScript(ColumnReaders &in, Arena &arena, uint64_t &scriptLength)
+{
+  uint64_t code = readVarInt(in[Column::SCRIPT_CODES]);
+  if (code >= N_OUTPUT_SCRIPT_TEMPLATES)
+  {
+    scriptLength = code - N_OUTPUT_SCRIPT_TEMPLATES;
+    return in[Column::SCRIPTS].take(scriptLength);
+  }
+
+  const OutputScriptTemplate &t = OUTPUT_SCRIPT_TEMPLATES[code];
+  scriptLength = t.length();
+  uint8_t *script = arena.createArray<uint8_t>(scriptLength);
+  memcpy(script, t.prefix, t.prefixLength);
+  in[Column::PAYLOADS].read(script + t.prefixLength, t.payloadLength);
+  memcpy(script + t.prefixLength + t.payloadLength, t.suffix, t.suffixLength);
+  return script;
+}
+
+Transaction *parseCompressedTransaction(ColumnReaders &in, Arena &arena, std::vector<TxHashLocation> &locations)
 {
   static const uint8_t VERSION_2 = 0x1;
   static const uint8_t FLAG_PRESENT = 0x2;
   static const uint8_t LOCK_TIME_DEFAULT = 0x4;
 
-  // Make sure file stream is open
-  if (!fin.good())
+  if (!in.good())
   {
-    std::cout << "Attempting to parse transaction from invalid filestream" << std::endl;
+    std::cout << "Attempting to parse transaction past the end of the input" << std::endl;
     return 0;
   }
 
-  Transaction *transaction = new Transaction;
-  /*
-  uint8_t version;
-  fin.read((char*)&version, sizeof(uint8_t));
-  transaction->version = version;
-  */
+  Transaction *transaction = arena.create<Transaction>();
   uint8_t compressedFlag = 0;
-  fin.read((char*)&compressedFlag, sizeof(uint8_t));
+  in[Column::FLAGS].read(&compressedFlag, sizeof(uint8_t));
 
   if (compressedFlag & VERSION_2)
     transaction->version = 2;
@@ -335,11 +498,19 @@ Transaction *parseCompressedTransaction(std::ifstream &fin)
     transaction->flag = true;
   else
     transaction->flag = false;
-  transaction->inputCount = readVarInt(fin);
-  transaction->inputs.resize(transaction->inputCount);
+
+  // Every input has a previous transaction hash location, and every output a value, which take at
+  // least a byte each.
+  transaction->inputCount = readVarInt(in[Column::COUNTS]);
+  if (transaction->inputCount > in[Column::LOCATIONS].remaining())
+  {
+    std::cout << "Invalid input count. Aborting." << std::endl;
+    return 0;
+  }
+  transaction->inputs.allocate(arena, transaction->inputCount);
   for (uint64_t i = 0; i < transaction->inputCount; i++)
   {
-    transaction->inputs[i] = parseCompressedInput(fin, compressedFlag);
+    transaction->inputs[i] = parseCompressedInput(in, arena, compressedFlag, locations);
     if (!transaction->inputs[i])
     {
       std::cout << "Failed to parse input. Aborting." << std::endl;
@@ -347,11 +518,16 @@ Transaction *parseCompressedTransaction(std::ifstream &fin)
     }
   }
 
-  transaction->outputCount = readVarInt(fin);
-  transaction->outputs.resize(transaction->outputCount);
+  transaction->outputCount = readVarInt(in[Column::COUNTS]);
+  if (transaction->outputCount > in[Column::AMOUNTS].remaining())
+  {
+    std::cout << "Invalid output count. Aborting." << std::endl;
+    return 0;
+  }
+  transaction->outputs.allocate(arena, transaction->outputCount);
   for (uint64_t i = 0; i < transaction->outputCount; i++)
   {
-    transaction->outputs[i] = parseCompressedOutput(fin);
+    transaction->outputs[i] = parseCompressedOutput(in, arena);
     if (!transaction->outputs[i])
     {
       std::cout << "Failed to parse output. Aborting." << std::endl;
@@ -362,27 +538,12 @@ Transaction *parseCompressedTransaction(std::ifstream &fin)
   // Handle witnesses
   if (transaction->flag)
   {
-    for (uint64_t i = 0; i < transaction->inputCount; i++)
+    for (Input *input : transaction->inputs)
     {
-      Input *input = transaction->inputs[i];
-      input->witnessCount = readVarInt(fin);
-      input->witnesses.resize(input->witnessCount);
-      for (uint64_t j = 0; j < input->witnessCount; j++)
+      if (!parseCompressedWitnessStack(in, arena, input))
       {
-        input->witnesses[j] = new Witness;
-        Witness *w = input->witnesses[j];
-        if (!input->witnesses[j])
-        {
-          return 0;
-        }
-        w->size = readVarInt(fin);
-        w->data.resize(w->size);
-        for (uint64_t k = 0; k < w->size; k++)
-        {
-          uint8_t tmp;
-          fin.read((char*)&tmp, 1);
-          w->data[k] = tmp;
-        }
+        std::cout << "Invalid witness. Aborting." << std::endl;
+        return 0;
       }
     }
   }
@@ -390,34 +551,141 @@ Transaction *parseCompressedTransaction(std::ifstream &fin)
   if (compressedFlag & LOCK_TIME_DEFAULT)
     transaction->lockTime = 0x0;
   else
-    fin.read((char*)&transaction->lockTime, sizeof(uint32_t));
+    in[Column::SEQUENCES].read(&transaction->lockTime, sizeof(uint32_t));
+
+  if (!in.good())
+  {
+    std::cout << "Transaction is truncated. Aborting." << std::endl;
+    return 0;
+  }
   return transaction;
 }
 
-void parseCompressedTransactionHash(std::ifstream &fin, std::array<uint8_t, 32> &hash)
+bool parseCompressedTransactionHash(ColumnReaders &in, std::array<uint8_t, 32> &hash, TxHashLocation &location)
+{
+  // Only a new external hash is stored in full. The others are filled in by the caller.
+  ByteReader &locations = in[Column::LOCATIONS];
+  uint64_t code = readVarInt(locations);
+  location.value = 0;
+  location.position = 0;
+  if (code == TxHashLocation::NEW_EXTERNAL)
+  {
+    location.kind = TxHashLocation::NEW_EXTERNAL;
+    readHash(in[Column::TX_HASHES], (char*)hash.data(), 32);
+  }
+  else if (code == TxHashLocation::EXTERNAL)
+  {
+    location.kind = TxHashLocation::EXTERNAL;
+    location.value = readVarInt(locations);
+  }
+  else
+  {
+    location.kind = TxHashLocation::INTERNAL;
+    location.value = code - TxHashLocation::INTERNAL;
+    location.position = readVarInt(locations);
+  }
+  return in.good();
+}
+
+// Reads a witness stored as in WitnessStackType. Signatures and multisig scripts are put back
+// together in the arena; everything else points into the archive.
+bool parseCompressedWitnessStack(ColumnReaders &in, Arena &arena, Input *input)
 {
-  uint32_t txHashIndex;
-  fin.read((char*)&txHashIndex, sizeof(uint32_t));
-  hash = txHashTable[txHashIndex];
-  // fin.read(buffer, 32);
-  // char *start = (char*)hash.data();
-  // char *ptr = start + 32;
-  // while (ptr > start)
-  //   fin.read(--ptr, 1);
+  uint64_t code = readVarInt(in[Column::SCRIPT_CODES]);
+  if (code >= N_WITNESS_CODES)
+  {
+    // Every item's size takes at least a byte
+    input->witnessCount = code - N_WITNESS_CODES;
+    if (input->witnessCount > in[Column::COUNTS].remaining())
+      return false;
+    input->witnesses.allocate(arena, input->witnessCount);
+    for (uint64_t j = 0; j < input->witnessCount; j++)
+    {
+      Witness *w = input->witnesses[j] = arena.create<Witness>();
+      w->size = readVarInt(in[Column::COUNTS]);
+      w->data = in[Column::SCRIPTS].take(w->size);
+    }
+    return in.good();
+  }
+
+  if (code >= WitnessStackType::TAPROOT)
+  {
+    input->witnessCount = 1;
+    input->witnesses.allocate(arena, 1);
+    Witness *w = input->witnesses[0] = arena.create<Witness>();
+    w->size = 64 + (code - WitnessStackType::TAPROOT);
+    w->data = in[Column::SIGNATURES].take(w->size);
+    return in.good();
+  }
+
+  // The rest have signatures, each stored as an optional hash type, r and s
+  bool hashTypesStored = code % 2;
+  auto readSignature = [&]() -> Witness*
+  {
+    uint8_t rs[64], hashType = SIGHASH_ALL;
+    if (hashTypesStored)
+      in[Column::SCRIPT_CODES].read(&hashType, 1);
+    in[Column::SIGNATURES].read(rs, 64);
+    Witness *w = arena.create<Witness>();
+    uint8_t *item = arena.createArray<uint8_t>(MAX_DER_SIGNATURE_SIZE + 1);
+    w->size = joinWitnessSignature(item, rs, hashType);
+    w->data = item;
+    return w;
+  };
+
+  if (code < WitnessStackType::MULTISIG)
+  {
+    input->witnessCount = 2;
+    input->witnesses.allocate(arena, 2);
+    input->witnesses[0] = readSignature();
+    Witness *key = input->witnesses[1] = arena.create<Witness>();
+    key->size = 33;
+    key->data = in[Column::KEYS].take(33);
+    return in.good();
+  }
+
+  uint8_t mn = 0;
+  in[Column::SCRIPT_CODES].read(&mn, 1);
+  int m = (mn >> 4) + 1, n = (mn & 0xf) + 1;
+  if (m > n)
+    return false;
+
+  input->witnessCount = m + 2;
+  input->witnesses.allocate(arena, m + 2);
+  Witness *dummy = input->witnesses[0] = arena.create<Witness>();
+  dummy->size = 0;
+  dummy->data = in[Column::SCRIPTS].take(0);
+  for (int k = 0; k < m; k++)
+    input->witnesses[1 + k] = readSignature();
+
+  Witness *script = input->witnesses[m + 1] = arena.create<Witness>();
+  script->size = 3 + 34 * n;
+  uint8_t *p = arena.createArray<uint8_t>(script->size);
+  script->data = p;
+  *p++ = OP_1 + m - 1;
+  for (int k = 0; k < n; k++)
+  {
+    *p++ = 33;
+    in[Column::KEYS].read(p, 33);
+    p += 33;
+  }
+  *p++ = OP_1 + n - 1;
+  *p = OP_CHECKMULTISIG;
+  return in.good();
 }
 
-void readHash(std::ifstream &fin, char *buffer, int nBytes)
+void readHash(ByteReader &in, char *buffer, int nBytes)
 {
-  // fin.read(buffer, 32);
-  char *ptr = buffer + nBytes;
-  while (ptr > buffer)
-    fin.read(--ptr, 1);
+  // Hashes are stored little-endian; reverse them so they read naturally.
+  const uint8_t *src = in.take(nBytes);
+  for (int i = 0; i < nBytes; i++)
+    buffer[i] = src ? src[nBytes - 1 - i] : 0;
 }
 
-uint64_t readVarInt(std::ifstream &fin)
+uint64_t readVarInt(ByteReader &in)
 {
-  uint8_t firstByte;
-  fin.read((char*)&firstByte, 1);
+  uint8_t firstByte = 0;
+  in.read(&firstByte, 1);
 
   if (firstByte < 0xfd)
   {
@@ -426,22 +694,46 @@ uint64_t readVarInt(std::ifstream &fin)
   else if (firstByte == 0xfd)
   {
     uint16_t theRest;
-    fin.read((char*)&theRest, 2);
+    in.read(&theRest, 2);
     return (uint64_t)theRest;
   }
   else if (firstByte == 0xfe)
   {
     uint32_t theRest;
-    fin.read((char*)&theRest, 4);
+    in.read(&theRest, 4);
     return (uint64_t)theRest;
   }
-  else if (firstByte == 0xff)
+  else
   {
     uint64_t theRest;
-    fin.read((char*)&theRest, 8);
+    in.read(&theRest, 8);
     return theRest;
   }
 }
 
+// Reads a value written by writeBase128(). Anything that doesn't fit in 64 bits fails the reader.
+uint64_t readBase128(ByteReader &in)
+{
+  uint64_t val = 0;
+  for (;;)
+  {
+    uint8_t b = 0;
+    in.read(&b, 1);
+    if (val > (UINT64_MAX >> 7))
+    {
+      in.fail();
+      return 0;
+    }
+    val = (val << 7) | (b & 0x7f);
+    if (!(b & 0x80))
+      return val;
+    if (val == UINT64_MAX)
+    {
+      in.fail();
+      return 0;
+    }
+    val++;
+  }
+}
 
 #endif
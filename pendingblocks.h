@@ -0,0 +1,98 @@
+// pendingblocks.h
+
+#ifndef PENDINGBLOCKS_H
+#define PENDINGBLOCKS_H
+
+#include "log.h"
+#include "spillfile.h"
+
+#include <iostream>
+#include <map>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+// How much memory blocks waiting to be written out may take when decompressing without -m
+static const size_t DEFAULT_PENDING_MEMORY = 256 << 20;
+
+/* Decompressed blocks that are waiting to be written out until every block before them in the
+ * original file has been. Archives are in order of time, which can be a long way from file order,
+ * so there is no telling how many there will be. Up to memoryLimit bytes of them are kept in
+ * memory, and the rest go to a temporary file (see SpillFile), to be read back when their turn
+ * comes. */
+struct PendingBlocks
+{
+  PendingBlocks(const std::string &tempDirectory, size_t memoryLimit);
+
+  bool empty() const { return blocks.empty(); }
+  bool contains(uint32_t index) const { return blocks.count(index) != 0; }
+  uint32_t first() const { return blocks.begin()->first; }
+  bool add(uint32_t index, const uint8_t *data, size_t size);
+  bool popFirst(std::ostream *out);
+
+  struct Pending
+  {
+    std::string data; // The block, unless it is in the file
+    uint64_t offset; // Where it is in the file, if it is
+    size_t size;
+    bool spilled;
+  };
+
+  std::map<uint32_t, Pending> blocks; // By their index in the original file
+  size_t memoryLimit, memoryUsed;
+  SpillFile file;
+};
+
+PendingBlocks::PendingBlocks(const std::string &tempDirectory, size_t memoryLimit)
+  : memoryLimit(memoryLimit), memoryUsed(0), file(tempDirectory)
+{
+}
+
+// Adds the block with the given index. Returns false if it couldn't be written to the file.
+bool PendingBlocks::add(uint32_t index, const uint8_t *data, size_t size)
+{
+  Pending &p = blocks[index];
+  p.size = size;
+  p.spilled = memoryUsed + size > memoryLimit;
+  if (!p.spilled)
+  {
+    p.data.assign((const char*)data, size);
+    memoryUsed += size;
+    return true;
+  }
+
+  if (!file.write(data, size, p.offset))
+  {
+    blocks.erase(index);
+    return false;
+  }
+  return true;
+}
+
+// Removes the first block, writing it to out unless out is 0.
+bool PendingBlocks::popFirst(std::ostream *out)
+{
+  auto it = blocks.begin();
+  Pending &p = it->second;
+  if (!p.spilled)
+  {
+    if (out)
+      out->write(p.data.data(), p.size);
+    memoryUsed -= p.size;
+  }
+  else
+  {
+    if (out)
+    {
+      p.data.resize(p.size);
+      if (!file.read(p.offset, &p.data[0], p.size))
+        return false;
+      out->write(p.data.data(), p.size);
+    }
+    file.release(p.offset, p.size);
+  }
+  blocks.erase(it);
+  return true;
+}
+
+#endif
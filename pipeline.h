@@ -0,0 +1,88 @@
+// pipeline.h
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <stddef.h>
+#include <thread>
+#include <vector>
+
+bool runOrderedPipeline(size_t nItems, unsigned nThreads, size_t window,
+                        const std::function<bool(size_t)> &work,
+                        const std::function<bool(size_t)> &commit);
+
+/* Runs work(i) for every i in [0, nItems) on nThreads worker threads, and commit(i) on the calling
+ * thread in strictly increasing order of i. No more than 'window' items are ever in flight, and
+ * work(i + window) never starts before commit(i) has returned, so the caller can keep per-item
+ * state in 'window' slots indexed by i % window.
+ * If either callback returns false, no further items are committed and false is returned. That is
+ * also how to stop early when the number of items isn't known up front: pass SIZE_MAX for nItems,
+ * and have commit() return false after the last one. */
+bool runOrderedPipeline(size_t nItems, unsigned nThreads, size_t window,
+                        const std::function<bool(size_t)> &work,
+                        const std::function<bool(size_t)> &commit)
+{
+  static const char PENDING = 0, DONE = 1, FAILED = 2;
+
+  nThreads = std::max(1u, nThreads);
+  window = std::max<size_t>(1, window);
+
+  std::mutex mutex;
+  std::condition_variable slotFreed, itemDone;
+  std::vector<char> state(window, PENDING);
+  size_t nextItem = 0, nCommitted = 0;
+  bool abort = false;
+
+  auto worker = [&]()
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;)
+    {
+      slotFreed.wait(lock, [&]() { return abort || nextItem >= nItems || nextItem < nCommitted + window; });
+      if (abort || nextItem >= nItems)
+        return;
+      size_t i = nextItem++;
+
+      lock.unlock();
+      bool ok = work(i);
+      lock.lock();
+
+      state[i % window] = ok ? DONE : FAILED;
+      itemDone.notify_all();
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (unsigned t = 0; t < nThreads; t++)
+    threads.emplace_back(worker);
+
+  bool ok = true;
+  for (size_t i = 0; i < nItems && ok; i++)
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    itemDone.wait(lock, [&]() { return state[i % window] != PENDING; });
+    ok = state[i % window] == DONE;
+    state[i % window] = PENDING;
+    lock.unlock();
+
+    if (ok)
+      ok = commit(i);
+
+    lock.lock();
+    nCommitted++;
+    if (!ok)
+      abort = true;
+    slotFreed.notify_all();
+  }
+
+  for (auto &t : threads)
+    t.join();
+
+  return ok;
+}
+
+#endif
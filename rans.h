@@ -0,0 +1,175 @@
+// rans.h
+
+#ifndef RANS_H
+#define RANS_H
+
+#include "bytereader.h"
+#include "bytewriter.h"
+
+#include <algorithm>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+/* An order-0 entropy coder for bytes: range asymmetric numeral systems (rANS), after Fabian
+ * Giesen's rans_byte.h. Each byte costs about -log2 of its frequency in the data, so a column of
+ * mostly small numbers or repeated codes shrinks, and a column of hashes doesn't.
+ * The encoded form is the frequency table, as one less than the number of different bytes (a
+ * byte), then each byte and its frequency out of RANS_SCALE, in increasing order of bytes, then
+ * the coder's final state (4 bytes, most significant first), then the bytes it put out. A frequency
+ * below 128 takes a byte, and any other two, most significant first, with the top bit set.
+ * Empty data can't be encoded. */
+
+static const uint32_t RANS_SCALE_BITS = 12;
+static const uint32_t RANS_SCALE = 1 << RANS_SCALE_BITS;
+// The coder's state is kept in [RANS_LOWER_BOUND, 256 * RANS_LOWER_BOUND)
+static const uint32_t RANS_LOWER_BOUND = 1 << 23;
+
+void ransCountFrequencies(const uint8_t *data, size_t n, uint32_t freq[256]);
+void ransEncode(ByteWriter &out, const uint8_t *data, size_t n);
+bool ransDecode(ByteReader &in, uint8_t *data, size_t n);
+
+// Counts how often each byte occurs, scaled so that the counts add up to RANS_SCALE. Every byte
+// that occurs at all gets at least 1.
+void ransCountFrequencies(const uint8_t *data, size_t n, uint32_t freq[256])
+{
+  uint64_t counts[256] = { 0 };
+  for (size_t i = 0; i < n; i++)
+    counts[data[i]]++;
+
+  uint32_t total = 0;
+  int largest = 0;
+  for (int s = 0; s < 256; s++)
+  {
+    freq[s] = counts[s] ? std::max<uint64_t>(1, counts[s] * RANS_SCALE / n) : 0;
+    total += freq[s];
+    if (freq[s] > freq[largest])
+      largest = s;
+  }
+
+  // Rounding leaves the total a little off. Make up the difference with the most frequent bytes,
+  // which it affects the least.
+  while (total < RANS_SCALE)
+  {
+    freq[largest]++;
+    total++;
+  }
+  while (total > RANS_SCALE)
+  {
+    for (int s = 0; s < 256; s++)
+      if (freq[s] > freq[largest])
+        largest = s;
+    freq[largest]--;
+    total--;
+  }
+}
+
+void ransEncode(ByteWriter &out, const uint8_t *data, size_t n)
+{
+  uint32_t freq[256], start[256];
+  ransCountFrequencies(data, n, freq);
+
+  int nSymbols = 0;
+  for (int s = 0; s < 256; s++)
+    nSymbols += freq[s] != 0;
+  out.put8(nSymbols - 1);
+  uint32_t cumulative = 0;
+  for (int s = 0; s < 256; s++)
+  {
+    start[s] = cumulative;
+    cumulative += freq[s];
+    if (freq[s])
+    {
+      out.put8(s);
+      if (freq[s] >= 0x80)
+        out.put8(0x80 | freq[s] >> 8);
+      out.put8(freq[s] & 0xff);
+    }
+  }
+
+  // rANS works backwards: the last byte is encoded first, so that the decoder gets them in order.
+  // What it puts out is collected back to front as well.
+  std::vector<uint8_t> reversed;
+  reversed.reserve(n / 2 + 16);
+  uint32_t x = RANS_LOWER_BOUND;
+  for (size_t i = n; i-- > 0;)
+  {
+    uint32_t f = freq[data[i]];
+    uint32_t xMax = ((RANS_LOWER_BOUND >> RANS_SCALE_BITS) << 8) * f;
+    while (x >= xMax)
+    {
+      reversed.push_back(x & 0xff);
+      x >>= 8;
+    }
+    x = ((x / f) << RANS_SCALE_BITS) + (x % f) + start[data[i]];
+  }
+  for (int k = 0; k < 4; k++, x >>= 8)
+    reversed.push_back(x & 0xff);
+
+  uint8_t *p = out.reserve(reversed.size());
+  for (size_t i = 0; i < reversed.size(); i++)
+    p[i] = reversed[reversed.size() - 1 - i];
+  out.size += reversed.size();
+}
+
+// Decodes n bytes encoded by ransEncode(). Returns false if they don't decode cleanly.
+bool ransDecode(ByteReader &in, uint8_t *data, size_t n)
+{
+  uint32_t freq[256] = { 0 }, start[256] = { 0 };
+  uint8_t symbols[RANS_SCALE];
+
+  // Read the frequency table, and work out which byte every slot stands for
+  uint8_t last = 0;
+  in.read(&last, 1);
+  uint32_t cumulative = 0;
+  int previous = -1;
+  for (int k = 0; k <= last; k++)
+  {
+    uint8_t s = 0, b = 0;
+    in.read(&s, 1);
+    in.read(&b, 1);
+    uint32_t f = b;
+    if (b & 0x80)
+    {
+      in.read(&b, 1);
+      f = (f & 0x7f) << 8 | b;
+    }
+    if (!in.good() || s <= previous || f == 0 || cumulative + f > RANS_SCALE)
+      return false;
+    freq[s] = f;
+    start[s] = cumulative;
+    memset(symbols + cumulative, s, f);
+    cumulative += f;
+    previous = s;
+  }
+  if (cumulative != RANS_SCALE)
+    return false;
+
+  uint8_t state[4] = { 0 };
+  in.read(state, 4);
+  uint32_t x = (uint32_t)state[0] << 24 | (uint32_t)state[1] << 16 | (uint32_t)state[2] << 8 | state[3];
+  if (!in.good() || x < RANS_LOWER_BOUND)
+    return false;
+
+  const uint8_t *p = in.ptr, *end = in.end;
+  for (size_t i = 0; i < n; i++)
+  {
+    uint32_t slot = x & (RANS_SCALE - 1);
+    uint8_t s = symbols[slot];
+    data[i] = s;
+    x = freq[s] * (x >> RANS_SCALE_BITS) + slot - start[s];
+    while (x < RANS_LOWER_BOUND)
+    {
+      if (p == end)
+        return false;
+      x = (x << 8) | *p++;
+    }
+  }
+  in.skip(p - in.ptr);
+
+  // The encoder started from RANS_LOWER_BOUND, so that is where decoding has to end up
+  return x == RANS_LOWER_BOUND;
+}
+
+#endif
@@ -0,0 +1,192 @@
+// secp256k1.h
+
+#ifndef SECP256K1_H
+#define SECP256K1_H
+
+#include <stdint.h>
+#include <string.h>
+
+/* Just enough arithmetic on secp256k1, the curve Bitcoin's keys are on, to decompress public
+ * keys. A point (x, y) on y^2 = x^3 + 7 (mod p) is fully determined by x and whether y is odd,
+ * which is all a compressed public key holds. Nothing here handles secrets, so none of it needs
+ * to run in constant time. */
+
+// A number modulo p = 2^256 - 2^32 - 977, as four 64-bit limbs, least significant first
+struct FieldElement
+{
+  uint64_t n[4];
+};
+
+void fieldFromBytes(FieldElement &a, const uint8_t *bytes);
+void fieldToBytes(uint8_t *bytes, const FieldElement &a);
+bool fieldIsReduced(const FieldElement &a);
+void fieldAddSmall(FieldElement &r, const FieldElement &a, uint64_t b);
+void fieldMul(FieldElement &r, const FieldElement &a, const FieldElement &b);
+void fieldNegate(FieldElement &r, const FieldElement &a);
+void fieldReduce(FieldElement &r, const uint64_t t[8]);
+void fieldSqrt(FieldElement &r, const FieldElement &a);
+bool decompressPublicKey(uint8_t uncompressed[65], const uint8_t compressed[33]);
+
+static const uint64_t FIELD_P[4] = { 0xfffffffefffffc2fULL, 0xffffffffffffffffULL, 0xffffffffffffffffULL, 0xffffffffffffffffULL };
+// 2^256 mod p
+static const uint64_t FIELD_C = 0x1000003d1ULL;
+
+// Reads a 32-byte big-endian number, as in a public key. It may not be reduced (see fieldIsReduced()).
+void fieldFromBytes(FieldElement &a, const uint8_t *bytes)
+{
+  for (int i = 0; i < 4; i++)
+  {
+    uint64_t limb = 0;
+    for (int j = 0; j < 8; j++)
+      limb = (limb << 8) | bytes[(3 - i) * 8 + j];
+    a.n[i] = limb;
+  }
+}
+
+void fieldToBytes(uint8_t *bytes, const FieldElement &a)
+{
+  for (int i = 0; i < 4; i++)
+    for (int j = 0; j < 8; j++)
+      bytes[(3 - i) * 8 + j] = a.n[i] >> (56 - 8 * j);
+}
+
+// Whether a is less than p
+bool fieldIsReduced(const FieldElement &a)
+{
+  for (int i = 3; i >= 0; i--)
+    if (a.n[i] != FIELD_P[i])
+      return a.n[i] < FIELD_P[i];
+  return false;
+}
+
+void fieldAddSmall(FieldElement &r, const FieldElement &a, uint64_t b)
+{
+  uint64_t t[8] = { a.n[0], a.n[1], a.n[2], a.n[3], 0, 0, 0, 0 };
+  unsigned __int128 carry = b;
+  for (int i = 0; i < 4 && carry; i++)
+  {
+    carry += t[i];
+    t[i] = (uint64_t)carry;
+    carry >>= 64;
+  }
+  t[4] = (uint64_t)carry;
+  fieldReduce(r, t);
+}
+
+void fieldMul(FieldElement &r, const FieldElement &a, const FieldElement &b)
+{
+  uint64_t t[8] = { 0 };
+  for (int i = 0; i < 4; i++)
+  {
+    unsigned __int128 carry = 0;
+    for (int j = 0; j < 4; j++)
+    {
+      carry += (unsigned __int128)a.n[i] * b.n[j] + t[i + j];
+      t[i + j] = (uint64_t)carry;
+      carry >>= 64;
+    }
+    t[i + 4] = (uint64_t)carry;
+  }
+  fieldReduce(r, t);
+}
+
+// r = p - a, for a reduced, non-zero a
+void fieldNegate(FieldElement &r, const FieldElement &a)
+{
+  unsigned __int128 borrow = 0;
+  for (int i = 0; i < 4; i++)
+  {
+    unsigned __int128 d = (unsigned __int128)FIELD_P[i] - a.n[i] - borrow;
+    r.n[i] = (uint64_t)d;
+    borrow = (d >> 64) & 1;
+  }
+}
+
+// Reduces a 512-bit number t, least significant limb first, modulo p.
+void fieldReduce(FieldElement &r, const uint64_t t[8])
+{
+  // t = high * 2^256 + low, and 2^256 = FIELD_C (mod p), so t = high * FIELD_C + low (mod p).
+  // That takes the number down to a little over 256 bits, and then whatever is left over the
+  // top is folded back in the same way until nothing is.
+  unsigned __int128 carry = 0;
+  for (int i = 0; i < 4; i++)
+  {
+    carry += (unsigned __int128)t[4 + i] * FIELD_C + t[i];
+    r.n[i] = (uint64_t)carry;
+    carry >>= 64;
+  }
+  while (carry)
+  {
+    carry *= FIELD_C;
+    for (int i = 0; i < 4; i++)
+    {
+      carry += r.n[i];
+      r.n[i] = (uint64_t)carry;
+      carry >>= 64;
+    }
+  }
+
+  // Now r < 2^256, which is less than 2p
+  if (!fieldIsReduced(r))
+  {
+    // r - p = r + FIELD_C - 2^256
+    carry = FIELD_C;
+    for (int i = 0; i < 4; i++)
+    {
+      carry += r.n[i];
+      r.n[i] = (uint64_t)carry;
+      carry >>= 64;
+    }
+  }
+}
+
+/* Sets r to a square root of a, if a has one. Since p = 3 (mod 4), that is a^((p + 1) / 4).
+ * The caller has to check that r * r really is a. */
+void fieldSqrt(FieldElement &r, const FieldElement &a)
+{
+  static const uint64_t EXPONENT[4] = { 0xffffffffbfffff0cULL, 0xffffffffffffffffULL, 0xffffffffffffffffULL, 0x3fffffffffffffffULL };
+  FieldElement result = { { 1, 0, 0, 0 } };
+  for (int i = 3; i >= 0; i--)
+  {
+    for (int bit = 63; bit >= 0; bit--)
+    {
+      fieldMul(result, result, result);
+      if ((EXPONENT[i] >> bit) & 1)
+        fieldMul(result, result, a);
+    }
+  }
+  r = result;
+}
+
+/* Turns a 33-byte compressed public key (0x02 or 0x03, then x) into the 65-byte uncompressed one
+ * (0x04, x, y). Returns false if it isn't a point on the curve. */
+bool decompressPublicKey(uint8_t uncompressed[65], const uint8_t compressed[33])
+{
+  if (compressed[0] != 0x02 && compressed[0] != 0x03)
+    return false;
+
+  FieldElement x, x3, rhs, y, check;
+  fieldFromBytes(x, compressed + 1);
+  if (!fieldIsReduced(x))
+    return false;
+
+  fieldMul(x3, x, x);
+  fieldMul(x3, x3, x);
+  fieldAddSmall(rhs, x3, 7);
+  fieldSqrt(y, rhs);
+  fieldMul(check, y, y);
+  if (memcmp(check.n, rhs.n, sizeof(rhs.n)) != 0)
+    return false;
+
+  // Of y and p - y, pick the one with the right parity. (y is never 0: the curve has no point
+  // of order 2.)
+  if ((y.n[0] & 1) != (compressed[0] & 1))
+    fieldNegate(y, y);
+
+  uncompressed[0] = 0x04;
+  memcpy(uncompressed + 1, compressed + 1, 32);
+  fieldToBytes(uncompressed + 33, y);
+  return true;
+}
+
+#endif
@@ -0,0 +1,509 @@
+// sha256.h
+
+#ifndef SHA256_H
+#define SHA256_H
+
+#include "picosha2.h"
+
+#include <iostream>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SHA256_X86 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+/* Double SHA-256, as used for block hashes, txids and merkle trees.
+ *
+ * There are three implementations of the SHA-256 compression function: plain C++, one using the
+ * SHA extensions (SHA-NI) of recent x86 CPUs, and one using AVX2 to work on 8 messages at once.
+ * The fastest one the CPU supports is picked the first time a hash is computed, after checking
+ * it against picosha2. sha256dBatch() hashes many messages at once, which is what lets the AVX2
+ * implementation be used; hashing one message at a time only uses SHA-NI or plain C++. */
+
+void sha256d(const uint8_t *data, size_t size, uint8_t hash[32]);
+void sha256dBatch(const uint8_t *const *data, const size_t *sizes, size_t n, uint8_t (*hashes)[32]);
+const char *sha256Implementation();
+
+// Processes nBlocks consecutive 64-byte blocks
+typedef void (*Sha256Transform)(uint32_t *state, const uint8_t *blocks, size_t nBlocks);
+// Processes one 64-byte block for each of 8 messages
+typedef void (*Sha256Transform8)(uint32_t *const states[8], const uint8_t *const blocks[8]);
+
+struct Sha256Backend
+{
+  const char *name;
+  Sha256Transform transform;
+  Sha256Transform8 transform8; // 0 if there is no multi-buffer implementation
+};
+
+const Sha256Backend &sha256Backend();
+bool sha256SelfTest(const Sha256Backend &backend);
+void sha256dWith(const Sha256Backend &backend, const uint8_t *data, size_t size, uint8_t hash[32]);
+void sha256dBatchWith(const Sha256Backend &backend, const uint8_t *const *data, const size_t *sizes, size_t n,
+                      uint8_t (*hashes)[32]);
+void sha256TransformScalar(uint32_t *state, const uint8_t *blocks, size_t nBlocks);
+#ifdef SHA256_X86
+void sha256TransformShaNi(uint32_t *state, const uint8_t *blocks, size_t nBlocks);
+void sha256Transform8Avx2(uint32_t *const states[8], const uint8_t *const blocks[8]);
+#endif
+
+static const uint32_t SHA256_IV[8] =
+{
+  0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static const uint32_t SHA256_K[64] =
+{
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t sha256ReadBE(const uint8_t *p)
+{
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline void sha256WriteBE(uint8_t *p, uint32_t n)
+{
+  p[0] = n >> 24;
+  p[1] = n >> 16;
+  p[2] = n >> 8;
+  p[3] = n;
+}
+
+/* Copies the end of a message (everything after its last whole block) into tail, and pads it.
+ * Returns the number of 64-byte blocks in tail: 1 or 2. */
+static inline size_t sha256PadTail(uint8_t tail[128], const uint8_t *data, size_t size)
+{
+  size_t rest = size % 64;
+  size_t nTailBlocks = rest < 56 ? 1 : 2;
+  if (rest)
+    memmove(tail, data + size - rest, rest);
+  memset(tail + rest, 0, 64 * nTailBlocks - rest);
+  tail[rest] = 0x80;
+  uint64_t bits = (uint64_t)size * 8;
+  sha256WriteBE(tail + 64 * nTailBlocks - 8, bits >> 32);
+  sha256WriteBE(tail + 64 * nTailBlocks - 4, bits & 0xffffffff);
+  return nTailBlocks;
+}
+
+void sha256d(const uint8_t *data, size_t size, uint8_t hash[32])
+{
+  sha256dWith(sha256Backend(), data, size, hash);
+}
+
+/* Computes hashes[i] = SHA256(SHA256(data[i])), where data[i] is sizes[i] bytes long. */
+void sha256dBatch(const uint8_t *const *data, const size_t *sizes, size_t n, uint8_t (*hashes)[32])
+{
+  sha256dBatchWith(sha256Backend(), data, sizes, n, hashes);
+}
+
+const char *sha256Implementation()
+{
+  return sha256Backend().name;
+}
+
+// Picks the implementation to use, once.
+const Sha256Backend &sha256Backend()
+{
+  static const Sha256Backend backend = []()
+  {
+    Sha256Backend scalar = { "scalar", sha256TransformScalar, 0 };
+    Sha256Backend best = scalar;
+
+#ifdef SHA256_X86
+    unsigned eax, ebx, ecx, edx;
+    bool sse41 = false, avx = false, avx2 = false, sha = false;
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+    {
+      sse41 = (ecx >> 19) & 1;
+      // AVX also needs the OS to save the YMM registers
+      if (((ecx >> 27) & 1) && ((ecx >> 28) & 1))
+      {
+        uint32_t xcr0, xcr0High;
+        __asm__ ("xgetbv" : "=a"(xcr0), "=d"(xcr0High) : "c"(0));
+        avx = (xcr0 & 6) == 6;
+      }
+    }
+    if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+    {
+      avx2 = avx && ((ebx >> 5) & 1);
+      sha = sse41 && ((ebx >> 29) & 1);
+    }
+
+    // SHA-NI hashes a single message faster than AVX2 hashes 8, so it is used for batches too.
+    Sha256Backend candidate = scalar;
+    if (avx2)
+    {
+      candidate.name = "avx2 (8-way)";
+      candidate.transform8 = sha256Transform8Avx2;
+      if (sha256SelfTest(candidate))
+        best = candidate;
+      else
+        std::cout << "SHA-256 self-test failed for " << candidate.name << std::endl;
+    }
+    if (sha)
+    {
+      candidate.name = "sha-ni";
+      candidate.transform = sha256TransformShaNi;
+      candidate.transform8 = 0;
+      if (sha256SelfTest(candidate))
+        best = candidate;
+      else
+        std::cout << "SHA-256 self-test failed for " << candidate.name << std::endl;
+    }
+#endif
+
+    return best;
+  }();
+  return backend;
+}
+
+/* Checks an implementation against picosha2, on messages of every length that pads differently,
+ * and on batches big enough to fill the multi-buffer lanes unevenly. */
+bool sha256SelfTest(const Sha256Backend &backend)
+{
+  std::vector<uint8_t> data(300);
+  for (size_t i = 0; i < data.size(); i++)
+    data[i] = (uint8_t)(i * 131 + 7);
+
+  std::vector<const uint8_t*> messages;
+  std::vector<size_t> sizes;
+  for (size_t size = 0; size <= data.size(); size += (size < 140 ? 1 : 17))
+  {
+    messages.push_back(data.data() + data.size() - size);
+    sizes.push_back(size);
+  }
+
+  std::vector<uint8_t> hashes(32 * messages.size());
+  uint8_t (*batch)[32] = (uint8_t (*)[32])hashes.data();
+  sha256dBatchWith(backend, messages.data(), sizes.data(), messages.size(), batch);
+
+  for (size_t i = 0; i < messages.size(); i++)
+  {
+    uint8_t expected[32], first[32], single[32];
+    picosha2::hash256(messages[i], messages[i] + sizes[i], first, first + 32);
+    picosha2::hash256(first, first + 32, expected, expected + 32);
+    sha256dWith(backend, messages[i], sizes[i], single);
+    if (memcmp(expected, single, 32) != 0 || memcmp(expected, batch[i], 32) != 0)
+      return false;
+  }
+  return true;
+}
+
+void sha256dWith(const Sha256Backend &backend, const uint8_t *data, size_t size, uint8_t hash[32])
+{
+  uint32_t state[8];
+  uint8_t tail[128];
+
+  memcpy(state, SHA256_IV, sizeof(state));
+  backend.transform(state, data, size / 64);
+  backend.transform(state, tail, sha256PadTail(tail, data, size));
+
+  // The second hash is of the 32-byte first hash, which always pads to a single block.
+  for (int i = 0; i < 8; i++)
+    sha256WriteBE(tail + 4 * i, state[i]);
+  sha256PadTail(tail, tail, 32);
+  memcpy(state, SHA256_IV, sizeof(state));
+  backend.transform(state, tail, 1);
+
+  for (int i = 0; i < 8; i++)
+    sha256WriteBE(hash + 4 * i, state[i]);
+}
+
+void sha256dBatchWith(const Sha256Backend &backend, const uint8_t *const *data, const size_t *sizes, size_t n,
+                      uint8_t (*hashes)[32])
+{
+  if (!backend.transform8)
+  {
+    for (size_t i = 0; i < n; i++)
+      sha256dWith(backend, data[i], sizes[i], hashes[i]);
+    return;
+  }
+
+  // Each of the 8 lanes works through one message at a time: its whole blocks, then its padded
+  // tail, then the second hash. When a lane finishes, it starts on the next message. Idle lanes
+  // hash a dummy block.
+  struct Lane
+  {
+    size_t message; // n if the lane is idle
+    const uint8_t *next; // The message's next whole block
+    size_t nBlocks; // Whole blocks left at next
+    uint8_t tail[128];
+    size_t tailPos, nTailBlocks;
+    bool secondHash;
+    uint32_t state[8];
+  };
+
+  Lane lanes[8];
+  uint32_t dummyState[8];
+  static const uint8_t dummyBlock[64] = { 0 };
+  size_t nextMessage = 0, nActive = 0;
+
+  auto start = [&](Lane &lane)
+  {
+    lane.message = nextMessage < n ? nextMessage++ : n;
+    if (lane.message == n)
+      return;
+    const uint8_t *message = data[lane.message];
+    lane.next = message;
+    lane.nBlocks = sizes[lane.message] / 64;
+    lane.nTailBlocks = sha256PadTail(lane.tail, message, sizes[lane.message]);
+    lane.tailPos = 0;
+    lane.secondHash = false;
+    memcpy(lane.state, SHA256_IV, sizeof(lane.state));
+    nActive++;
+  };
+
+  for (Lane &lane : lanes)
+    start(lane);
+
+  // Once only a few messages are left, hashing them one at a time is faster.
+  while (nActive > 2 || (nActive > 0 && nextMessage < n))
+  {
+    uint32_t *states[8];
+    const uint8_t *blocks[8];
+    for (int l = 0; l < 8; l++)
+    {
+      Lane &lane = lanes[l];
+      if (lane.message == n)
+      {
+        states[l] = dummyState;
+        blocks[l] = dummyBlock;
+      }
+      else
+      {
+        states[l] = lane.state;
+        blocks[l] = lane.nBlocks ? lane.next : lane.tail + 64 * lane.tailPos;
+      }
+    }
+
+    backend.transform8(states, blocks);
+
+    for (Lane &lane : lanes)
+    {
+      if (lane.message == n)
+        continue;
+      if (lane.nBlocks)
+      {
+        lane.next += 64;
+        lane.nBlocks--;
+        continue;
+      }
+      if (++lane.tailPos < lane.nTailBlocks)
+        continue;
+
+      if (!lane.secondHash)
+      {
+        // Start on the second hash, of the first one
+        for (int i = 0; i < 8; i++)
+          sha256WriteBE(lane.tail + 4 * i, lane.state[i]);
+        lane.nTailBlocks = sha256PadTail(lane.tail, lane.tail, 32);
+        lane.tailPos = 0;
+        lane.secondHash = true;
+        memcpy(lane.state, SHA256_IV, sizeof(lane.state));
+        continue;
+      }
+
+      for (int i = 0; i < 8; i++)
+        sha256WriteBE(hashes[lane.message] + 4 * i, lane.state[i]);
+      nActive--;
+      start(lane);
+    }
+  }
+
+  // Finish the stragglers on their own, from wherever they got to.
+  for (Lane &lane : lanes)
+  {
+    if (lane.message == n)
+      continue;
+    backend.transform(lane.state, lane.next, lane.nBlocks);
+    backend.transform(lane.state, lane.tail + 64 * lane.tailPos, lane.nTailBlocks - lane.tailPos);
+    if (!lane.secondHash)
+    {
+      for (int i = 0; i < 8; i++)
+        sha256WriteBE(lane.tail + 4 * i, lane.state[i]);
+      sha256PadTail(lane.tail, lane.tail, 32);
+      memcpy(lane.state, SHA256_IV, sizeof(lane.state));
+      backend.transform(lane.state, lane.tail, 1);
+    }
+    for (int i = 0; i < 8; i++)
+      sha256WriteBE(hashes[lane.message] + 4 * i, lane.state[i]);
+  }
+}
+
+#define SHA256_ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+void sha256TransformScalar(uint32_t *state, const uint8_t *blocks, size_t nBlocks)
+{
+  for (; nBlocks > 0; nBlocks--, blocks += 64)
+  {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++)
+      w[i] = sha256ReadBE(blocks + 4 * i);
+    for (int i = 16; i < 64; i++)
+    {
+      uint32_t s0 = SHA256_ROTR(w[i - 15], 7) ^ SHA256_ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+      uint32_t s1 = SHA256_ROTR(w[i - 2], 17) ^ SHA256_ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; i++)
+    {
+      uint32_t s1 = SHA256_ROTR(e, 6) ^ SHA256_ROTR(e, 11) ^ SHA256_ROTR(e, 25);
+      uint32_t ch = (e & f) ^ (~e & g);
+      uint32_t t1 = h + s1 + ch + SHA256_K[i] + w[i];
+      uint32_t s0 = SHA256_ROTR(a, 2) ^ SHA256_ROTR(a, 13) ^ SHA256_ROTR(a, 22);
+      uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+      uint32_t t2 = s0 + maj;
+      h = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+    }
+
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+  }
+}
+
+#ifdef SHA256_X86
+
+// The SHA-NI instructions work on the state split as ABEF and CDGH, 4 rounds at a time.
+__attribute__((target("sha,sse4.1")))
+void sha256TransformShaNi(uint32_t *state, const uint8_t *blocks, size_t nBlocks)
+{
+  const __m128i BYTE_SWAP = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+  __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[0]), 0xb1); // CDAB
+  __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[4]), 0x1b); // EFGH
+  __m128i state0 = _mm_alignr_epi8(tmp, state1, 8); // ABEF
+  state1 = _mm_blend_epi16(state1, tmp, 0xf0); // CDGH
+
+  for (; nBlocks > 0; nBlocks--, blocks += 64)
+  {
+    __m128i savedState0 = state0, savedState1 = state1;
+
+    __m128i msg[4];
+    for (int i = 0; i < 4; i++)
+      msg[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(blocks + 16 * i)), BYTE_SWAP);
+
+    for (int i = 0; i < 16; i++)
+    {
+      __m128i t = _mm_add_epi32(msg[i & 3], _mm_loadu_si128((const __m128i*)&SHA256_K[4 * i]));
+      state1 = _mm_sha256rnds2_epu32(state1, state0, t);
+      state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(t, 0x0e));
+
+      // Replace these 4 words of the message schedule with the ones 16 words later
+      if (i < 12)
+        msg[i & 3] = _mm_sha256msg2_epu32(
+          _mm_add_epi32(_mm_sha256msg1_epu32(msg[i & 3], msg[(i + 1) & 3]),
+                        _mm_alignr_epi8(msg[(i + 3) & 3], msg[(i + 2) & 3], 4)),
+          msg[(i + 3) & 3]);
+    }
+
+    state0 = _mm_add_epi32(state0, savedState0);
+    state1 = _mm_add_epi32(state1, savedState1);
+  }
+
+  tmp = _mm_shuffle_epi32(state0, 0x1b); // FEBA
+  state1 = _mm_shuffle_epi32(state1, 0xb1); // DCHG
+  _mm_storeu_si128((__m128i*)&state[0], _mm_blend_epi16(tmp, state1, 0xf0)); // DCBA
+  _mm_storeu_si128((__m128i*)&state[4], _mm_alignr_epi8(state1, tmp, 8)); // HGFE
+}
+
+// Each 32-bit lane of the AVX2 registers holds the same word of a different message.
+__attribute__((target("avx2")))
+void sha256Transform8Avx2(uint32_t *const states[8], const uint8_t *const blocks[8])
+{
+#define SHA256_ROTR8(x, n) _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - (n)))
+#define SHA256_LANES(expr) _mm256_set_epi32(expr(7), expr(6), expr(5), expr(4), expr(3), expr(2), expr(1), expr(0))
+
+  __m256i s[8];
+  for (int i = 0; i < 8; i++)
+  {
+#define SHA256_STATE_WORD(l) (int)states[l][i]
+    s[i] = SHA256_LANES(SHA256_STATE_WORD);
+#undef SHA256_STATE_WORD
+  }
+
+  __m256i w[16];
+  for (int i = 0; i < 16; i++)
+  {
+#define SHA256_BLOCK_WORD(l) (int)sha256ReadBE(blocks[l] + 4 * i)
+    w[i] = SHA256_LANES(SHA256_BLOCK_WORD);
+#undef SHA256_BLOCK_WORD
+  }
+
+  __m256i a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+  for (int i = 0; i < 64; i++)
+  {
+    __m256i wi;
+    if (i < 16)
+      wi = w[i];
+    else
+    {
+      __m256i w15 = w[(i - 15) & 15], w2 = w[(i - 2) & 15];
+      __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(SHA256_ROTR8(w15, 7), SHA256_ROTR8(w15, 18)),
+                                    _mm256_srli_epi32(w15, 3));
+      __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(SHA256_ROTR8(w2, 17), SHA256_ROTR8(w2, 19)),
+                                    _mm256_srli_epi32(w2, 10));
+      wi = w[i & 15] = _mm256_add_epi32(_mm256_add_epi32(w[i & 15], s0), _mm256_add_epi32(w[(i - 7) & 15], s1));
+    }
+
+    __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(SHA256_ROTR8(e, 6), SHA256_ROTR8(e, 11)), SHA256_ROTR8(e, 25));
+    __m256i ch = _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g));
+    __m256i t1 = _mm256_add_epi32(_mm256_add_epi32(h, s1),
+                                  _mm256_add_epi32(ch, _mm256_add_epi32(_mm256_set1_epi32(SHA256_K[i]), wi)));
+    __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(SHA256_ROTR8(a, 2), SHA256_ROTR8(a, 13)), SHA256_ROTR8(a, 22));
+    __m256i maj = _mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(c, _mm256_or_si256(a, b)));
+    __m256i t2 = _mm256_add_epi32(s0, maj);
+    h = g;
+    g = f;
+    f = e;
+    e = _mm256_add_epi32(d, t1);
+    d = c;
+    c = b;
+    b = a;
+    a = _mm256_add_epi32(t1, t2);
+  }
+
+  s[0] = _mm256_add_epi32(s[0], a); s[1] = _mm256_add_epi32(s[1], b);
+  s[2] = _mm256_add_epi32(s[2], c); s[3] = _mm256_add_epi32(s[3], d);
+  s[4] = _mm256_add_epi32(s[4], e); s[5] = _mm256_add_epi32(s[5], f);
+  s[6] = _mm256_add_epi32(s[6], g); s[7] = _mm256_add_epi32(s[7], h);
+
+  for (int i = 0; i < 8; i++)
+  {
+    uint32_t words[8];
+    _mm256_storeu_si256((__m256i*)words, s[i]);
+    for (int l = 0; l < 8; l++)
+      states[l][i] = words[l];
+  }
+
+#undef SHA256_LANES
+#undef SHA256_ROTR8
+}
+
+#endif
+
+#undef SHA256_ROTR
+
+#endif
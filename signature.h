@@ -0,0 +1,97 @@
+// signature.h
+
+#ifndef SIGNATURE_H
+#define SIGNATURE_H
+
+#include "secp256k1.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/* ECDSA signatures are DER-encoded in transactions: 0x30, length, 0x02, length of r, r, 0x02,
+ * length of s, s, where r and s are big-endian, as short as they can be, and get a 0x00 in front
+ * when they would otherwise look negative. That framing costs 6 to 8 bytes, and it can be rebuilt
+ * from r and s alone, which are stored as 32 bytes each instead. Signatures that aren't encoded
+ * exactly like that (which older transactions may have) are not compressed. */
+
+// Longest DER signature there is (without the hash type byte that follows it in a script)
+static const size_t MAX_DER_SIGNATURE_SIZE = 72;
+
+bool compressSignature(uint8_t rs[64], const uint8_t *der, size_t length);
+size_t expandSignature(uint8_t *der, const uint8_t rs[64]);
+size_t writeDerInteger(uint8_t *out, const uint8_t value[32]);
+bool compressPublicKey(uint8_t compressed[33], const uint8_t uncompressed[65]);
+
+// Gets r and s out of a DER signature. Returns false unless expandSignature() would give it back exactly.
+bool compressSignature(uint8_t rs[64], const uint8_t *der, size_t length)
+{
+  if (length < 8 || length > MAX_DER_SIGNATURE_SIZE || der[0] != 0x30 || der[1] != length - 2 || der[2] != 0x02)
+    return false;
+  size_t rLength = der[3];
+  if (6 + rLength > length || der[4 + rLength] != 0x02)
+    return false;
+  size_t sLength = der[5 + rLength];
+  if (6 + rLength + sLength != length)
+    return false;
+
+  // Right-align each number in 32 bytes, dropping any leading zeros
+  const uint8_t *parts[2] = { der + 4, der + 6 + rLength };
+  size_t lengths[2] = { rLength, sLength };
+  for (int i = 0; i < 2; i++)
+  {
+    const uint8_t *p = parts[i];
+    size_t n = lengths[i];
+    for (; n > 0 && *p == 0; p++, n--)
+      ;
+    if (n > 32)
+      return false;
+    memset(rs + 32 * i, 0, 32 - n);
+    memcpy(rs + 32 * i + 32 - n, p, n);
+  }
+
+  // Whatever the original got wrong (extra zeros, negative numbers...) shows up as a difference.
+  uint8_t check[MAX_DER_SIGNATURE_SIZE];
+  return expandSignature(check, rs) == length && memcmp(check, der, length) == 0;
+}
+
+// Writes the DER signature for r and s, and returns its length.
+size_t expandSignature(uint8_t *der, const uint8_t rs[64])
+{
+  size_t n = 2;
+  n += writeDerInteger(der + n, rs);
+  n += writeDerInteger(der + n, rs + 32);
+  der[0] = 0x30;
+  der[1] = n - 2;
+  return n;
+}
+
+size_t writeDerInteger(uint8_t *out, const uint8_t value[32])
+{
+  size_t start = 0;
+  while (start < 31 && value[start] == 0)
+    start++;
+  size_t n = 32 - start;
+  bool pad = value[start] & 0x80;
+
+  out[0] = 0x02;
+  out[1] = n + pad;
+  out[2] = 0;
+  memcpy(out + 2 + pad, value + start, n);
+  return 2 + pad + n;
+}
+
+/* Turns an uncompressed public key into a compressed one. Returns false unless
+ * decompressPublicKey() would give it back exactly. */
+bool compressPublicKey(uint8_t compressed[33], const uint8_t uncompressed[65])
+{
+  if (uncompressed[0] != 0x04)
+    return false;
+  compressed[0] = 0x02 | (uncompressed[64] & 1);
+  memcpy(compressed + 1, uncompressed + 1, 32);
+
+  uint8_t check[65];
+  return decompressPublicKey(check, compressed) && memcmp(check, uncompressed, 65) == 0;
+}
+
+#endif
@@ -0,0 +1,140 @@
+// spillfile.h
+
+#ifndef SPILLFILE_H
+#define SPILLFILE_H
+
+#include "externalsort.h"
+#include "log.h"
+
+#include <iterator>
+#include <map>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+
+#include <unistd.h>
+
+/* A temporary file for what doesn't fit in memory, to be read back later. Space that is freed is
+ * reused, by the first gap big enough, so the file only grows to about the most it ever holds at
+ * once, plus whatever gaps are too small to reuse. The file is created the first time something is
+ * written to it.
+ * Reads can come from any number of threads at once, even while something else is written, but
+ * write() and release() must only be called from one thread at a time. */
+struct SpillFile
+{
+  SpillFile(const std::string &tempDirectory);
+  ~SpillFile();
+  SpillFile(const SpillFile &) = delete;
+  SpillFile &operator= (const SpillFile &) = delete;
+
+  bool write(const void *data, size_t size, uint64_t &offset);
+  bool read(uint64_t offset, void *data, size_t size) const;
+  void release(uint64_t offset, size_t size);
+
+  std::string tempDirectory;
+  FILE *file;
+  uint64_t end; // Where the file's last piece in use ends
+  std::map<uint64_t, uint64_t> gaps; // The size of each free piece before end, by offset. None touch.
+};
+
+SpillFile::SpillFile(const std::string &tempDirectory) : tempDirectory(tempDirectory), file(0), end(0)
+{
+}
+
+SpillFile::~SpillFile()
+{
+  if (file)
+    fclose(file);
+}
+
+// Writes size bytes to the file, wherever they fit, and sets offset to where that is.
+bool SpillFile::write(const void *data, size_t size, uint64_t &offset)
+{
+  offset = 0;
+  if (size == 0)
+    return true;
+  if (!file)
+    file = createTempFile(tempDirectory);
+  if (!file)
+  {
+    logStream(LogLevel::ERROR) << "Could not create temporary file in \'" << tempDirectory << "\'" << std::endl;
+    return false;
+  }
+
+  auto gap = gaps.begin();
+  while (gap != gaps.end() && gap->second < size)
+    ++gap;
+  if (gap != gaps.end())
+  {
+    offset = gap->first;
+    if (gap->second > size)
+      gaps[offset + size] = gap->second - size;
+    gaps.erase(gap);
+  }
+  else
+  {
+    offset = end;
+    end += size;
+  }
+
+  for (size_t done = 0; done < size;)
+  {
+    ssize_t n = pwrite(fileno(file), (const char*)data + done, size - done, offset + done);
+    if (n <= 0)
+    {
+      logStream(LogLevel::ERROR) << "Could not write temporary file in \'" << tempDirectory << "\'" << std::endl;
+      release(offset, size);
+      return false;
+    }
+    done += n;
+  }
+  return true;
+}
+
+bool SpillFile::read(uint64_t offset, void *data, size_t size) const
+{
+  for (size_t done = 0; done < size;)
+  {
+    ssize_t n = file ? pread(fileno(file), (char*)data + done, size - done, offset + done) : -1;
+    if (n <= 0)
+    {
+      logStream(LogLevel::ERROR) << "Could not read temporary file" << std::endl;
+      return false;
+    }
+    done += n;
+  }
+  return true;
+}
+
+// Makes the size bytes at offset, which must have been written, free to be written over.
+void SpillFile::release(uint64_t offset, size_t size)
+{
+  if (size == 0)
+    return;
+
+  // Merge the piece with the gaps on either side of it
+  auto next = gaps.lower_bound(offset);
+  if (next != gaps.end() && next->first == offset + size)
+  {
+    size += next->second;
+    next = gaps.erase(next);
+  }
+  if (next != gaps.begin())
+  {
+    auto previous = std::prev(next);
+    if (previous->first + previous->second == offset)
+    {
+      offset = previous->first;
+      size += previous->second;
+      gaps.erase(previous);
+    }
+  }
+
+  if (offset + size == end)
+    end = offset;
+  else
+    gaps[offset] = size;
+}
+
+#endif
@@ -0,0 +1,263 @@
+// stats.h
+
+#ifndef STATS_H
+#define STATS_H
+
+#include "block.h"
+#include "columns.h"
+#include "outputscript.h"
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <stdint.h>
+
+/* Where the bytes and the time go, for --stats. Nothing is counted unless stats points somewhere;
+ * otherwise all it costs is checking it. Worker threads count into a Stats of their own (e.g.
+ * CompressedBlockBuffer::blockStats), which is added to the totals when the block is committed, so
+ * counting takes no locks. Bytes "stored" are those put in the columns, before entropy coding. */
+
+// The fields of the blocks being compressed
+struct StatsField
+{
+  static const int HEADERS = 0; // With the magic number and size
+  static const int COUNTS = 1; // Transaction, input, output and witness item counts
+  static const int VERSIONS = 2; // Transaction versions, SegWit markers and flags, lock times
+  static const int PREV_HASHES = 3;
+  static const int PREV_INDICES = 4;
+  static const int SEQUENCES = 5;
+  static const int INPUT_SCRIPTS = 6; // With their lengths, as are output scripts and witness items
+  static const int AMOUNTS = 7;
+  static const int OUTPUT_SCRIPTS = 8;
+  static const int WITNESSES = 9;
+  static const int COUNT = 10;
+};
+
+// What blocks go through
+struct StatsStage
+{
+  static const int READ = 0;
+  static const int PARSE = 1;
+  static const int ENCODE = 2; // writeCompressedBlock()
+  static const int COMMIT = 3; // commitCompressedBlock()
+  static const int RESOLVE = 4; // Previous transaction hashes and the header
+  static const int SERIALIZE = 5; // writeDecompressedBlock()
+  static const int WRITE = 6;
+  static const int COUNT = 7;
+};
+
+// The witnesses that are stored as their parts (see WitnessStackType), and the rest
+static const int N_WITNESS_STATS = 4;
+// The input scripts that are stored as their parts (see InputScriptType), and the rest
+static const int N_INPUT_SCRIPT_STATS = 4;
+
+struct StatsCounter
+{
+  StatsCounter() : count(0), bytesIn(0), bytesStored(0) {}
+  void add(uint64_t in, uint64_t stored) { count++; bytesIn += in; bytesStored += stored; }
+  void add(const StatsCounter &other)
+  {
+    count += other.count;
+    bytesIn += other.bytesIn;
+    bytesStored += other.bytesStored;
+  }
+
+  uint64_t count, bytesIn, bytesStored;
+};
+
+struct Stats
+{
+  Stats() : blocks(0), transactions(0), bytesIn(0), bytesOut(0), indexBytes(0)
+  {
+    for (int c = 0; c < Column::COUNT; c++)
+      columnBytes[c] = columnArchiveBytes[c] = 0;
+    for (int f = 0; f < StatsField::COUNT; f++)
+      fieldBytes[f] = 0;
+    for (int s = 0; s < StatsStage::COUNT; s++)
+      seconds[s] = 0;
+  }
+  void add(const Stats &other);
+
+  uint64_t blocks, transactions;
+  uint64_t bytesIn, bytesOut;
+  uint64_t columnBytes[Column::COUNT]; // Stored
+  uint64_t columnArchiveBytes[Column::COUNT]; // After entropy coding, with the column sizes
+  uint64_t indexBytes;
+  uint64_t fieldBytes[StatsField::COUNT]; // Of the blocks being compressed
+  StatsCounter outputScripts[N_OUTPUT_SCRIPT_TEMPLATES + 1]; // By template, then the rest
+  StatsCounter inputScripts[N_INPUT_SCRIPT_STATS];
+  StatsCounter witnesses[N_WITNESS_STATS];
+  double seconds[StatsStage::COUNT]; // Added up over threads
+};
+
+// Collects statistics for --stats, if they are wanted
+Stats *stats = 0;
+
+static const char *COLUMN_NAMES[Column::COUNT] =
+{
+  "merkle roots, nonces", "counts", "flags", "previous indices", "sequences, lock times", "script codes",
+  "raw scripts", "signatures", "public keys", "payloads", "amounts", "header chain", "hash locations",
+  "full hashes"
+};
+static const char *FIELD_NAMES[StatsField::COUNT] =
+{
+  "block headers", "counts", "versions, lock times", "previous hashes", "previous indices", "sequences",
+  "input scripts", "amounts", "output scripts", "witnesses"
+};
+static const char *STAGE_NAMES[StatsStage::COUNT] =
+{
+  "read", "parse", "encode", "commit", "resolve", "serialize", "write"
+};
+static const char *INPUT_SCRIPT_NAMES[N_INPUT_SCRIPT_STATS] =
+{
+  "P2PK", "P2PKH", "P2PKH (uncompressed)", "other"
+};
+static const char *WITNESS_NAMES[N_WITNESS_STATS] =
+{
+  "P2WPKH", "multisig", "Taproot key path", "other"
+};
+
+std::chrono::steady_clock::time_point statsStart();
+void statsStop(Stats &counts, int stage, std::chrono::steady_clock::time_point start);
+void countBlockFields(Stats &counts, const Block *block);
+uint64_t varIntSize(uint64_t val);
+void printStats(const Stats &counts, std::ostream &out);
+
+void Stats::add(const Stats &other)
+{
+  blocks += other.blocks;
+  transactions += other.transactions;
+  bytesIn += other.bytesIn;
+  bytesOut += other.bytesOut;
+  for (int c = 0; c < Column::COUNT; c++)
+  {
+    columnBytes[c] += other.columnBytes[c];
+    columnArchiveBytes[c] += other.columnArchiveBytes[c];
+  }
+  indexBytes += other.indexBytes;
+  for (int f = 0; f < StatsField::COUNT; f++)
+    fieldBytes[f] += other.fieldBytes[f];
+  for (int n = 0; n <= N_OUTPUT_SCRIPT_TEMPLATES; n++)
+    outputScripts[n].add(other.outputScripts[n]);
+  for (int n = 0; n < N_INPUT_SCRIPT_STATS; n++)
+    inputScripts[n].add(other.inputScripts[n]);
+  for (int n = 0; n < N_WITNESS_STATS; n++)
+    witnesses[n].add(other.witnesses[n]);
+  for (int s = 0; s < StatsStage::COUNT; s++)
+    seconds[s] += other.seconds[s];
+}
+
+// Starts timing a stage. Without stats, the clock isn't even read.
+std::chrono::steady_clock::time_point statsStart()
+{
+  return stats ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+}
+
+void statsStop(Stats &counts, int stage, std::chrono::steady_clock::time_point start)
+{
+  if (stats)
+    counts.seconds[stage] += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Counts the bytes of each field of a parsed block, as it is in a block file
+void countBlockFields(Stats &counts, const Block *block)
+{
+  uint64_t *bytes = counts.fieldBytes;
+  counts.blocks++;
+  counts.transactions += block->transactionCount;
+  counts.bytesIn += 8 + (uint64_t)block->size;
+  bytes[StatsField::HEADERS] += 88;
+  bytes[StatsField::COUNTS] += varIntSize(block->transactionCount);
+
+  for (const Transaction *transaction : block->transactions)
+  {
+    bytes[StatsField::VERSIONS] += 8 + (transaction->flag ? 2 : 0);
+    bytes[StatsField::COUNTS] += varIntSize(transaction->inputCount) + varIntSize(transaction->outputCount);
+    for (const Input *input : transaction->inputs)
+    {
+      bytes[StatsField::PREV_HASHES] += 32;
+      bytes[StatsField::PREV_INDICES] += 4;
+      bytes[StatsField::SEQUENCES] += 4;
+      bytes[StatsField::INPUT_SCRIPTS] += varIntSize(input->scriptLength) + input->scriptLength;
+      if (transaction->flag)
+      {
+        bytes[StatsField::COUNTS] += varIntSize(input->witnessCount);
+        for (const Witness *w : input->witnesses)
+          bytes[StatsField::WITNESSES] += varIntSize(w->size) + w->size;
+      }
+    }
+    for (const Output *output : transaction->outputs)
+    {
+      bytes[StatsField::AMOUNTS] += 8;
+      bytes[StatsField::OUTPUT_SCRIPTS] += varIntSize(output->scriptLength) + output->scriptLength;
+    }
+  }
+}
+
+// How many bytes writeVarInt() takes for val
+uint64_t varIntSize(uint64_t val)
+{
+  return val < 0xfd ? 1 : val < 0x10000 ? 3 : val < 0x100000000 ? 5 : 9;
+}
+
+void printStats(const Stats &counts, std::ostream &out)
+{
+  auto percent = [](uint64_t part, uint64_t whole) { return whole ? 100.0 * part / whole : 0.0; };
+  auto printCounter = [&](const char *kind, const char *name, const StatsCounter &counter)
+  {
+    if (!counter.count)
+      return;
+    out << "  " << std::left << std::setw(10) << kind << std::setw(22) << name << std::right << std::setw(12)
+        << counter.count << std::setw(14) << counter.bytesIn << std::setw(14) << counter.bytesStored << std::endl;
+  };
+
+  out << std::endl << "Statistics" << std::endl;
+  out << std::fixed << std::setprecision(1);
+  out << "  " << counts.blocks << " blocks, " << counts.transactions << " transactions, " << counts.bytesIn
+      << " bytes in, " << counts.bytesOut << " bytes out" << std::endl;
+
+  uint64_t columnTotal = 0;
+  for (int c = 0; c < Column::COUNT; c++)
+    columnTotal += counts.columnArchiveBytes[c];
+  if (columnTotal)
+  {
+    out << std::endl << std::left << std::setw(34) << "Archive by column" << std::right << std::setw(14) << "stored"
+        << std::setw(14) << "archive" << std::setw(8) << "%" << std::endl;
+    for (int c = 0; c < Column::COUNT; c++)
+      out << "  " << std::left << std::setw(32) << COLUMN_NAMES[c] << std::right << std::setw(14)
+          << counts.columnBytes[c] << std::setw(14) << counts.columnArchiveBytes[c] << std::setw(8)
+          << percent(counts.columnArchiveBytes[c], counts.bytesOut) << std::endl;
+    // Whatever isn't in a column is block numbers, magic numbers and sizes
+    uint64_t framing = counts.bytesOut - columnTotal - counts.indexBytes;
+    out << "  " << std::left << std::setw(46) << "framing" << std::right << std::setw(14) << framing
+        << std::setw(8) << percent(framing, counts.bytesOut) << std::endl;
+    out << "  " << std::left << std::setw(46) << "index" << std::right << std::setw(14) << counts.indexBytes
+        << std::setw(8) << percent(counts.indexBytes, counts.bytesOut) << std::endl;
+
+    out << std::endl << std::left << std::setw(34) << "Input by field" << std::right << std::setw(14) << "bytes"
+        << std::setw(22) << "%" << std::endl;
+    for (int f = 0; f < StatsField::COUNT; f++)
+      out << "  " << std::left << std::setw(32) << FIELD_NAMES[f] << std::right << std::setw(14)
+          << counts.fieldBytes[f] << std::setw(22) << percent(counts.fieldBytes[f], counts.bytesIn) << std::endl;
+
+    out << std::endl << std::left << std::setw(34) << "Scripts by type" << std::right << std::setw(12) << "count"
+        << std::setw(14) << "bytes in" << std::setw(14) << "stored" << std::endl;
+    for (int n = 0; n < N_OUTPUT_SCRIPT_TEMPLATES; n++)
+      printCounter("output", OUTPUT_SCRIPT_TEMPLATES[n].name, counts.outputScripts[n]);
+    printCounter("output", "other", counts.outputScripts[N_OUTPUT_SCRIPT_TEMPLATES]);
+    for (int n = 0; n < N_INPUT_SCRIPT_STATS; n++)
+      printCounter("input", INPUT_SCRIPT_NAMES[n], counts.inputScripts[n]);
+    for (int n = 0; n < N_WITNESS_STATS; n++)
+      printCounter("witness", WITNESS_NAMES[n], counts.witnesses[n]);
+  }
+
+  out << std::endl << std::left << std::setw(34) << "Time by stage" << std::right << std::setw(14) << "seconds"
+      << std::endl;
+  for (int s = 0; s < StatsStage::COUNT; s++)
+    if (counts.seconds[s] > 0)
+      out << "  " << std::left << std::setw(32) << STAGE_NAMES[s] << std::right << std::setprecision(3)
+          << std::setw(14) << counts.seconds[s] << std::endl;
+  out << "(Stages that run on worker threads are added up over the threads.)" << std::endl;
+}
+
+#endif
@@ -0,0 +1,50 @@
+// streams.h
+
+#ifndef STREAMS_H
+#define STREAMS_H
+
+#include <fstream>
+#include <iostream>
+#include <string.h>
+
+// A file name of "-" means standard input or output, so btcompress can be used in pipelines.
+std::istream *openInput(const char *inputFile, std::ifstream &file);
+std::ostream *openOutput(const char *outputFile, std::ofstream &file);
+
+// Opens inputFile for reading, as file, unless it is "-". Returns 0 if it can't be opened.
+std::istream *openInput(const char *inputFile, std::ifstream &file)
+{
+  if (strcmp(inputFile, "-") == 0)
+    return &std::cin;
+
+  file.open(inputFile, std::ifstream::in | std::ifstream::binary);
+  if (!file.is_open())
+  {
+    std::cout << "Could not open file \'" << inputFile << "\'" << std::endl;
+    return 0;
+  }
+  return &file;
+}
+
+// Opens outputFile for writing, as file, unless it is "-". Returns 0 if it can't be opened.
+std::ostream *openOutput(const char *outputFile, std::ofstream &file)
+{
+  if (strcmp(outputFile, "-") == 0)
+  {
+    // Console messages are written to std::cout all over the place. Send them to standard error
+    // from now on, and write the output through standard output's original buffer instead.
+    static std::ostream standardOutput(std::cout.rdbuf());
+    std::cout.rdbuf(std::cerr.rdbuf());
+    return &standardOutput;
+  }
+
+  file.open(outputFile, std::ofstream::out | std::ofstream::binary);
+  if (!file.is_open())
+  {
+    std::cout << "Could not open file \'" << outputFile << "\'" << std::endl;
+    return 0;
+  }
+  return &file;
+}
+
+#endif
@@ -3,32 +3,101 @@
 #ifndef TRANSACTION_H
 #define TRANSACTION_H
 
+#include "arena.h"
+#include "bytewriter.h"
 #include "input.h"
 #include "output.h"
+#include "sha256.h"
 
+#include <array>
 #include <iostream>
 #include <stdint.h>
 #include <vector>
 
 struct Transaction
 {
-  ~Transaction();
-
   uint32_t version;
   bool flag;
   uint64_t inputCount; // varInt
   uint64_t outputCount; // varInt
   uint32_t lockTime;
-  std::vector<Input*> inputs;
-  std::vector<Output*> outputs;
-  //std::vector<Witness*> witnesses;
+  ArenaArray<Input*> inputs;
+  ArenaArray<Output*> outputs;
+  std::array<uint8_t, 32> hash; // The txid, once computeHash() has been called
+
+  void computeHash(ByteWriter &scratch);
+  void writeWithoutWitnesses(ByteWriter &out);
 };
 
-Transaction::~Transaction()
+void computeTransactionHashes(Transaction *const *transactions, size_t n, ByteWriter &scratch);
+
+/* Computes the transaction's id: the double SHA-256 of the transaction without its witnesses.
+ * The result is stored in the Transaction::hash field, in the same byte order as
+ * Input::prevTransactionHash. scratch is used to serialize the transaction. */
+void Transaction::computeHash(ByteWriter &scratch)
+{
+  scratch.clear();
+  writeWithoutWitnesses(scratch);
+
+  uint8_t doubleHash[32];
+  sha256d(scratch.data, scratch.size, doubleHash);
+  for (int i = 0; i < 32; i++)
+    hash[i] = doubleHash[31 - i];
+}
+
+// Serializes the transaction the way it is hashed for its txid, i.e. the pre-segwit format.
+void Transaction::writeWithoutWitnesses(ByteWriter &out)
 {
-  for (auto p : inputs) delete p;
-  for (auto p : outputs) delete p;
-  //for (auto p : witnesses) delete p;
+  out.put32(version);
+
+  writeVarInt(out, inputCount);
+  for (Input *input : inputs)
+  {
+    out.appendReversed(input->prevTransactionHash.data(), 32);
+    out.put32(input->prevTransactionIndex);
+    writeVarInt(out, input->scriptLength);
+    out.append(input->script, input->scriptLength);
+    out.put32(input->sequenceNumber);
+  }
+
+  writeVarInt(out, outputCount);
+  for (Output *output : outputs)
+  {
+    out.put64(output->value);
+    writeVarInt(out, output->scriptLength);
+    out.append(output->script, output->scriptLength);
+  }
+
+  out.put32(lockTime);
+}
+
+/* Does Transaction::computeHash() for n transactions at once. Hashing them together lets
+ * sha256dBatch() work on several at the same time. */
+void computeTransactionHashes(Transaction *const *transactions, size_t n, ByteWriter &scratch)
+{
+  std::vector<size_t> offsets(n + 1);
+  scratch.clear();
+  for (size_t i = 0; i < n; i++)
+  {
+    offsets[i] = scratch.size;
+    transactions[i]->writeWithoutWitnesses(scratch);
+  }
+  offsets[n] = scratch.size;
+
+  // Only point into scratch once it has stopped growing
+  std::vector<const uint8_t*> data(n);
+  std::vector<size_t> sizes(n);
+  for (size_t i = 0; i < n; i++)
+  {
+    data[i] = scratch.data + offsets[i];
+    sizes[i] = offsets[i + 1] - offsets[i];
+  }
+  std::vector<uint8_t> hashes(32 * n);
+  sha256dBatch(data.data(), sizes.data(), n, (uint8_t (*)[32])hashes.data());
+
+  for (size_t i = 0; i < n; i++)
+    for (int j = 0; j < 32; j++)
+      transactions[i]->hash[j] = hashes[32 * i + 31 - j];
 }
 
 void printTransaction(Transaction * transaction)
@@ -0,0 +1,40 @@
+// txhashlocation.h
+
+#ifndef TXHASHLOCATION_H
+#define TXHASHLOCATION_H
+
+#include <stdint.h>
+
+/* Where the transaction an input spends from can be found. Instead of the 32-byte hash, a
+ * compressed input stores a varint code:
+ *   0          NEW_EXTERNAL: the hash is not the txid of any earlier transaction in the archive.
+ *              The 32-byte hash follows, and is numbered as the next external hash.
+ *   1          EXTERNAL: an external hash that appeared before. Its index follows as a varint.
+ *   2 + n      INTERNAL: the txid of a transaction n blocks back in the archive (0 is the same
+ *              block). The transaction's position within that block follows as a varint.
+ * The decompressor recomputes the txids of the transactions it has decompressed, so only the
+ * external hashes (mostly the null hash of coinbase inputs, unless the archive doesn't start at
+ * the genesis block) ever have to be stored in full.
+ * So that neither side has to keep every txid and external hash of the archive around, an input
+ * can only refer to the last TX_ID_HORIZON blocks: n must be less than that, and an external hash
+ * must have been numbered in one of those blocks. A hash from further back is stored in full
+ * again, as a new external hash.
+ * That is still a lot: without -m, each side keeps 32 bytes (more, in the compressor's tables) for
+ * every transaction and external hash in the last TX_ID_HORIZON blocks. At mainnet's few thousand
+ * transactions a block, that comes to several GB (about 7 GB at 3,500). With -m, they go to
+ * temporary files instead (see ExternalTxHashes and decodedSpillFile). */
+// Blocks. Most spends are of much more recent transactions than this.
+static const uint32_t TX_ID_HORIZON = 1 << 16;
+
+struct TxHashLocation
+{
+  static const uint8_t NEW_EXTERNAL = 0;
+  static const uint8_t EXTERNAL = 1;
+  static const uint8_t INTERNAL = 2;
+
+  uint8_t kind;
+  uint64_t value; // EXTERNAL: the external hash's index. INTERNAL: how many blocks back.
+  uint64_t position; // INTERNAL: the transaction's position in its block
+};
+
+#endif
@@ -0,0 +1,135 @@
+// txhashmap.h
+
+#ifndef TXHASHMAP_H
+#define TXHASHMAP_H
+
+#include <algorithm>
+#include <array>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+/* Maps transaction hashes to 32-bit numbers: the index of an external hash, or the position of a
+ * transaction in the archive (see TxHashLocation). This is a flat, open-addressing hash table
+ * with linear probing: one probe sequence both finds an existing hash and inserts a new one.
+ * Transaction hashes are already uniformly distributed, so 8 bytes of the hash itself serve as
+ * the hash function.
+ * Numbers only ever go up, and those below minIndex are out of reach (see TX_ID_HORIZON), so
+ * their entries are treated as if they weren't there. They are dropped when the table would
+ * otherwise grow, which keeps it from holding more than the hashes still in reach. */
+struct TxHashMap
+{
+  struct Entry
+  {
+    std::array<uint8_t, 32> hash;
+    uint32_t index; // EMPTY if the slot is unused
+  };
+
+  static const uint32_t EMPTY = 0xffffffff;
+
+  TxHashMap() : count(0), minIndex(0) { rehash(1024); }
+
+  size_t size() const { return count; }
+  void reserve(size_t n);
+  uint32_t find(const std::array<uint8_t, 32> &hash) const;
+  uint32_t findOrInsert(const std::array<uint8_t, 32> &hash, uint32_t newIndex, bool &inserted);
+
+  void rehash(size_t capacity);
+  size_t slotOf(const std::array<uint8_t, 32> &hash) const
+  {
+    uint64_t h;
+    memcpy(&h, hash.data() + 8, sizeof(uint64_t));
+    return h & (entries.size() - 1);
+  }
+
+  std::vector<Entry> entries; // The number of entries is always a power of 2
+  size_t count;
+  uint32_t minIndex;
+};
+
+// Makes room for n hashes without having to grow the table again.
+void TxHashMap::reserve(size_t n)
+{
+  // Keep the table at most 70% full
+  size_t capacity = entries.size();
+  while (capacity * 7 / 10 < n)
+    capacity *= 2;
+  if (capacity != entries.size())
+    rehash(capacity);
+}
+
+// Returns the index of the given hash, or EMPTY if it isn't in the table.
+uint32_t TxHashMap::find(const std::array<uint8_t, 32> &hash) const
+{
+  size_t mask = entries.size() - 1;
+  for (size_t i = slotOf(hash); ; i = (i + 1) & mask)
+  {
+    const Entry &e = entries[i];
+    if (e.index == EMPTY)
+      return EMPTY;
+    if (e.hash == hash)
+      return e.index >= minIndex ? e.index : EMPTY;
+  }
+}
+
+/* Returns the index of the given hash. If the hash isn't in the table yet, or is out of reach, it
+ * is added with index newIndex, and inserted is set. */
+uint32_t TxHashMap::findOrInsert(const std::array<uint8_t, 32> &hash, uint32_t newIndex, bool &inserted)
+{
+  if (count + 1 > entries.size() * 7 / 10)
+  {
+    // Dropping the entries that are out of reach may be enough to make room
+    size_t live = 0;
+    for (const Entry &e : entries)
+      live += e.index != EMPTY && e.index >= minIndex;
+    rehash(live + 1 > entries.size() * 7 / 20 ? entries.size() * 2 : entries.size());
+  }
+
+  size_t mask = entries.size() - 1;
+  for (size_t i = slotOf(hash); ; i = (i + 1) & mask)
+  {
+    Entry &e = entries[i];
+    if (e.index == EMPTY)
+    {
+      e.hash = hash;
+      e.index = newIndex;
+      count++;
+      inserted = true;
+      return newIndex;
+    }
+    if (e.hash == hash)
+    {
+      inserted = e.index < minIndex;
+      if (inserted)
+        e.index = newIndex;
+      return e.index;
+    }
+  }
+}
+
+void TxHashMap::rehash(size_t capacity)
+{
+  std::vector<Entry> old;
+  old.swap(entries);
+
+  Entry empty;
+  empty.hash.fill(0);
+  empty.index = EMPTY;
+  entries.assign(capacity, empty);
+
+  size_t mask = capacity - 1;
+  count = 0;
+  for (const Entry &e : old)
+  {
+    if (e.index == EMPTY || e.index < minIndex)
+      continue;
+    size_t i = slotOf(e.hash);
+    while (entries[i].index != EMPTY)
+      i = (i + 1) & mask;
+    entries[i] = e;
+    count++;
+  }
+}
+
+#endif
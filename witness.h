@@ -4,12 +4,11 @@
 #define WITNESS_H
 
 #include <stdint.h>
-#include <vector>
 
 struct Witness
 {
   uint64_t size; // varInt
-  std::vector<uint8_t> data;
+  const uint8_t *data; // Points into the mapped input file, or into the block's arena
 };
 
 #endif
@@ -0,0 +1,73 @@
+// witnessstack.h
+
+#ifndef WITNESSSTACK_H
+#define WITNESSSTACK_H
+
+#include "inputscript.h"
+#include "signature.h"
+#include "witness.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/* Most witnesses have one of a few shapes, in which the item lengths and the DER framing of the
+ * signatures are known. A compressed input stores its witness as a varint code:
+ *   P2WPKH + h     <signature> <33-byte public key>
+ *                  Stored as the hash type if h is 1 (see InputScriptType), r and s, and the key.
+ *   MULTISIG + h   <> <signature>... <m-of-n CHECKMULTISIG script with 33-byte keys>, as spent
+ *                  through P2WSH, with m signatures. Stored as a byte holding m - 1 and n - 1,
+ *                  then each signature as for P2WPKH, then the n keys.
+ *   TAPROOT        <64-byte Schnorr signature>, as in a Taproot key path spend. Stored as is.
+ *   TAPROOT + 1    <65-byte Schnorr signature, with its hash type>. Stored as is.
+ *   N_WITNESS_CODES + k   Any other witness, with k items, each stored as a varint length and the
+ *                  item itself.
+ * For MULTISIG, h is 1 if every signature's hash type is stored, and 0 if they are all SIGHASH_ALL. */
+struct WitnessStackType
+{
+  static const uint8_t P2WPKH = 0;
+  static const uint8_t MULTISIG = 2;
+  static const uint8_t TAPROOT = 4;
+};
+
+static const uint8_t N_WITNESS_CODES = 6;
+static const uint8_t OP_1 = 0x51;
+static const uint8_t OP_CHECKMULTISIG = 0xae;
+
+bool splitWitnessSignature(const Witness *w, uint8_t rs[64], uint8_t &hashType);
+size_t joinWitnessSignature(uint8_t *item, const uint8_t rs[64], uint8_t hashType);
+bool matchMultisigScript(const Witness *w, int &m, int &n);
+
+// Gets r, s and the hash type out of a signature item. Returns false if it can't be rebuilt from them.
+bool splitWitnessSignature(const Witness *w, uint8_t rs[64], uint8_t &hashType)
+{
+  if (w->size < 2)
+    return false;
+  hashType = w->data[w->size - 1];
+  return compressSignature(rs, w->data, w->size - 1);
+}
+
+// The opposite of splitWitnessSignature(). item must have room for MAX_DER_SIGNATURE_SIZE + 1 bytes.
+size_t joinWitnessSignature(uint8_t *item, const uint8_t rs[64], uint8_t hashType)
+{
+  size_t n = expandSignature(item, rs);
+  item[n] = hashType;
+  return n + 1;
+}
+
+// Whether an item is OP_m <33-byte key>... (n of them) OP_n OP_CHECKMULTISIG
+bool matchMultisigScript(const Witness *w, int &m, int &n)
+{
+  if (w->size < 3 + 34 || (w->size - 3) % 34 != 0 || (w->size - 3) / 34 > 16)
+    return false;
+  n = (w->size - 3) / 34;
+  m = w->data[0] - OP_1 + 1;
+  if (m < 1 || m > n || w->data[w->size - 2] != OP_1 + n - 1 || w->data[w->size - 1] != OP_CHECKMULTISIG)
+    return false;
+  for (int k = 0; k < n; k++)
+    if (w->data[1 + 34 * k] != 33)
+      return false;
+  return true;
+}
+
+#endif